@@ -31,7 +31,12 @@
 
 #include <cif++.hpp>
 
+#include <atomic>
 #include <filesystem>
+#include <mutex>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
 
 class dssp
 {
@@ -90,6 +95,26 @@ class dssp
 		} histogram;
 	};
 
+	/// \brief The wall clock time in seconds spent in each phase of the last
+	/// calculation. The accessibility is calculated in parallel with the
+	/// secondary structure, the sum of the phases may exceed the total time.
+	/// The time for placing the hydrogens is not part of geometry. Writing
+	/// the output is not timed here, that is up to the caller.
+	struct timings
+	{
+		double load, geometry, pair_search, hbond_energies, beta_sheets, helices, pp_helices, accessibility, hydrogens;
+	};
+
+	/// \brief The amount of work done in the last calculation: the
+	/// candidate residue pairs for H-bonds, the bridges before and the
+	/// ladders after merging, the residues in the neighbour lists for
+	/// accessibility, the atoms these contributed to the occlusion tests
+	/// and the number of surface dots tested.
+	struct counters
+	{
+		uint64_t atoms, residues, candidate_pairs, bridges, ladders, neighbours, neighbour_atoms, surface_dots;
+	};
+
 	enum class chain_break_type
 	{
 		None,
@@ -97,16 +122,194 @@ class dssp
 		Gap
 	};
 
-	dssp(const cif::datablock &db, int model_nr, int min_poly_proline_stretch_length, bool calculateSurfaceAccessibility);
-	dssp(const cif::mm::structure &s, int min_poly_proline_stretch_length, bool calculateSurfaceAccessibility);
+	/// \brief Progress reporting and cancellation of a calculation
+	///
+	/// Derive from this class and pass it to the constructor. report is
+	/// called when a phase starts, each time about one percent of its work
+	/// is done and when it is finished. The calls may come from any of the
+	/// calculating threads but are never made concurrently, progress that
+	/// is made while a report is running is included in the next one.
+	///
+	/// cancel may be called from any thread, the calculation then stops
+	/// with a cancelled_error after the chunk of work it is working on.
+	/// The object must stay valid as long as the dssp object is used to
+	/// recompute, the same one may be shared by several calculations.
+	class progress
+	{
+	  public:
+		virtual ~progress() = default;
+
+		virtual void report(std::string_view phase, uint64_t done, uint64_t total) = 0;
+
+		void cancel() { m_cancelled.store(true, std::memory_order_relaxed); }
+		bool cancelled() const { return m_cancelled.load(std::memory_order_relaxed); }
+
+	  private:
+		friend class progress_tracker;
+
+		std::atomic<bool> m_cancelled{ false };
+		std::mutex m_mutex;
+	};
+
+	/// \brief Thrown when a calculation is cancelled using progress::cancel
+	class cancelled_error : public std::runtime_error
+	{
+	  public:
+		cancelled_error()
+			: std::runtime_error("The calculation was cancelled")
+		{
+		}
+	};
+
+	/// \brief The optional quantities to calculate, the secondary structure
+	/// itself, the H-bonds and the kappa, phi and psi angles it depends on
+	/// are always calculated.
+	enum class calculate_flags : uint32_t
+	{
+		none = 0,
+		angles = 1 << 0,          ///< alpha, omega and tco, calculated on first access otherwise
+		side_chains = 1 << 1,     ///< keep the side chain atoms, needed for chiral_volume and chi
+		accessibility = 1 << 2,   ///< the surface accessibility, implies side_chains
+		bridge_partners = 1 << 3, ///< bridge partners, sheet and strand numbers
+		statistics = 1 << 4,      ///< the H-bond counts in get_statistics
+
+		all = angles | side_chains | accessibility | bridge_partners | statistics
+	};
+
+	friend constexpr calculate_flags operator|(calculate_flags a, calculate_flags b)
+	{
+		return static_cast<calculate_flags>(static_cast<uint32_t>(a) | static_cast<uint32_t>(b));
+	}
+
+	friend constexpr calculate_flags operator&(calculate_flags a, calculate_flags b)
+	{
+		return static_cast<calculate_flags>(static_cast<uint32_t>(a) & static_cast<uint32_t>(b));
+	}
+
+	/// \brief The flags not in \a a, used to clear flags like in
+	/// calculate_flags::all & ~calculate_flags::accessibility
+	friend constexpr calculate_flags operator~(calculate_flags a)
+	{
+		return static_cast<calculate_flags>(~static_cast<uint32_t>(a) & static_cast<uint32_t>(calculate_flags::all));
+	}
+
+	/// \brief The number of dots on the sphere around each atom used to
+	/// calculate the surface accessibility, this is the classic value
+	static constexpr size_t kDefaultSurfaceDots = 401;
+
+	/// \brief The settings for a calculation
+	///
+	/// Unlike the constructors taking separate arguments, the calculation
+	/// then does not depend on global state like cif::VERBOSE. Any number of
+	/// dssp objects may be constructed concurrently, from different threads,
+	/// this way.
+	struct options
+	{
+		int min_poly_proline_stretch_length = 3;
+		calculate_flags flags = calculate_flags::all;
+
+		/// The number of threads, use 0 to use as many as there are cores
+		size_t nr_of_threads = 1;
+
+		/// The number of surface dots per atom, rounded up to an odd number.
+		/// Fewer dots are faster but less accurate, the time to test the dots
+		/// is linear in this number.
+		size_t surface_dots = kDefaultSurfaceDots;
+
+		/// Receives the progress and allows cancelling, may be null
+		progress *reporter = nullptr;
+
+		/// Show a cif::progress_bar when there is no reporter
+		bool progress_bar = false;
+
+		/// Diagnostic messages are written to \a log when \a verbose is
+		/// larger than zero, more details when it is larger than one
+		int verbose = 0;
+		std::ostream *log = nullptr;
+	};
+
+	/// \brief Calculate the secondary structure for model \a model_nr in \a db
+	///
+	/// The H-bond energies and surface accessibility are calculated using \a nr_of_threads threads,
+	/// use 0 to use as many threads as there are cores.
+	dssp(const cif::datablock &db, int model_nr, int min_poly_proline_stretch_length, bool calculateSurfaceAccessibility,
+		size_t nr_of_threads = 1);
+	dssp(const cif::mm::structure &s, int min_poly_proline_stretch_length, bool calculateSurfaceAccessibility,
+		size_t nr_of_threads = 1);
+
+	/// \brief Calculate the secondary structure for model \a model_nr in \a db and
+	/// only the optional quantities in \a flags. The accessors for anything not
+	/// requested return their default values. The constructors taking a bool
+	/// calculate everything except, when false, the accessibility.
+	///
+	/// When \a reporter is specified it gets the progress of the calculation
+	/// and can be used to cancel it, otherwise a progress bar is shown.
+	dssp(const cif::datablock &db, int model_nr, int min_poly_proline_stretch_length, calculate_flags flags,
+		size_t nr_of_threads = 1, progress *reporter = nullptr);
+
+	/// \brief Calculate the secondary structure for model \a model_nr in \a db
+	/// using the settings in \a options
+	dssp(const cif::datablock &db, int model_nr, const options &options);
 
 	~dssp();
 
 	dssp(const dssp &) = delete;
 	dssp &operator=(const dssp &) = delete;
 
+	dssp(dssp &&rhs);
+	dssp &operator=(dssp &&rhs);
+
+	/// \brief Calculate the secondary structure for all models in \a db
+	///
+	/// The atom_site category is scanned only once to partition the atoms by
+	/// pdbx_PDB_model_num, the models are then calculated in parallel using
+	/// \a nr_of_threads threads. The result is sorted by model number.
+	static std::vector<dssp> calculate_all_models(const cif::datablock &db, int min_poly_proline_stretch_length,
+		bool calculateSurfaceAccessibility, size_t nr_of_threads = 1);
+	static std::vector<dssp> calculate_all_models(const cif::datablock &db, int min_poly_proline_stretch_length,
+		calculate_flags flags, size_t nr_of_threads = 1, progress *reporter = nullptr);
+	static std::vector<dssp> calculate_all_models(const cif::datablock &db, const options &options);
+
+	/// \brief Read mmCIF from \a is keeping only the data needed to calculate
+	/// the secondary structure and to write the legacy, binary and secondary
+	/// structure string formats
+	///
+	/// Everything else, including the atom_site items not used, is skipped
+	/// while parsing. That way the memory needed is close to that of the
+	/// coordinates. The result can not be used to write annotated mmCIF.
+	static cif::file read_required_categories(std::istream &is);
+
+	/// \brief The categories and the atom_site items kept by
+	/// read_required_categories, the output of the formats other than
+	/// mmCIF depends on these only
+	static const std::vector<std::string_view> &required_categories();
+	static const std::vector<std::string_view> &required_atom_site_items();
+
+	int get_model_nr() const;
+
 	statistics get_statistics() const;
 
+	timings get_timings() const;
+	counters get_counters() const;
+
+	// --------------------------------------------------------------------
+	// Trajectories. The residues and atoms found when constructing are kept,
+	// for each frame the coordinates can then be replaced and the secondary
+	// structure recalculated without parsing the datablock again.
+
+	/// \brief The number of atoms update_coordinates expects, i.e. the
+	/// number of rows in atom_site used when this object was constructed
+	size_t atom_count() const;
+
+	/// \brief Replace the coordinates, \a coordinates contains \a count
+	/// floats, x, y and z for each of the atom_count() atoms in the order of
+	/// atom_site. Atoms not used by DSSP are ignored.
+	void update_coordinates(const float *coordinates, size_t count);
+
+	/// \brief Recalculate everything for the coordinates set with
+	/// update_coordinates, reusing the buffers of the previous calculation
+	void recompute();
+
 	class iterator;
 	using res_iterator = typename std::vector<residue>::iterator;
 
@@ -240,20 +443,111 @@ class dssp
 	// To access residue info by key, i.e. LabelAsymID and LabelSeqID
 	using key_type = std::tuple<std::string, int>;
 
+	// To access residue info by PDB numbering, i.e. PDBStrandID, PDBSeqNum and PDBInsCode
+	using pdb_key_type = std::tuple<std::string, int, std::string>;
+
 	iterator begin() const;
 	iterator end() const;
 
 	residue_info operator[](const key_type &key) const;
 
+	/// \brief Return the residue with PDB (author) numbering \a key, throws
+	/// std::out_of_range if there is no such residue
+	residue_info get_residue_by_pdb_id(const pdb_key_type &key) const;
+
+	/// \brief The number of atoms in atom_site for the residue \a key
+	size_t atom_count(const key_type &key) const;
+
+	/// \brief Replace the coordinates of only the residues in \a residues and
+	/// recalculate, doing only the work needed for the residues that moved
+	///
+	/// \a coordinates contains \a count floats, x, y and z for each of the
+	/// atoms of each residue, residue by residue in the order of \a residues
+	/// and the atoms of a residue in the order of atom_site. The outcome is
+	/// the same as that of update_coordinates followed by recompute.
+	void update_residues(const std::vector<key_type> &residues, const float *coordinates, size_t count);
+
 	bool empty() const { return begin() == end(); }
 
+	/// \brief The number of residues
+	size_t size() const;
+
+	// --------------------------------------------------------------------
+	// Bulk access, for exporting the results of all residues at once. These
+	// fill caller provided arrays of size() elements, in the order of the
+	// iterator, without creating a residue_info for each residue. Residues
+	// are referred to by their index in these arrays, -1 for none.
+
+	enum class angle_type
+	{
+		alpha,
+		kappa,
+		phi,
+		psi,
+		tco,
+		omega
+	};
+
+	void get_types(structure_type *types) const;
+	void get_accessibilities(float *accessibilities) const;
+
+	/// \brief Fill \a angles with \a angle for each residue, NaN when it
+	/// cannot be calculated
+	void get_angles(angle_type angle, float *angles) const;
+
+	/// \brief Fill \a indices and \a energies with the best (\a i is 0) or
+	/// second best (\a i is 1) H-bond partners, either may be null. The
+	/// energy is 0 when there is no partner.
+	void get_acceptors(int i, int32_t *indices, double *energies) const;
+	void get_donors(int i, int32_t *indices, double *energies) const;
+
 	// --------------------------------------------------------------------
 	// Writing out the data, either in legacy format...
 
 	void write_legacy_output(std::ostream& os) const;
 
-	// ... or as annotation in the cif::datablock
-	void annotate(cif::datablock &db, bool writeOther, bool writeDSSPCategories) const;
+	// ... or as annotation in the cif::datablock. The rows of the per residue
+	// categories are built using \a nr_of_threads threads, the result does not
+	// depend on it.
+	void annotate(cif::datablock &db, bool writeOther, bool writeDSSPCategories, size_t nr_of_threads = 1) const;
+
+	/// \brief Annotate \a db with the results for all \a models
+	///
+	/// The secondary structure is taken from the first model, the
+	/// dssp_struct_summary category gets the rows for each model, keyed by
+	/// pdbx_PDB_model_num. With only one model this is the same as annotate.
+	static void annotate(cif::datablock &db, const std::vector<dssp> &models, bool writeOther, bool writeDSSPCategories,
+		size_t nr_of_threads = 1);
+
+	/// \brief Extend the validator for mmcif_pdbx.dic with the DSSP dictionary
+	///
+	/// The validator is shared by all files and annotate extends it the first
+	/// time it is called. When other threads may read or validate mmCIF at
+	/// that moment, call this once before starting them instead. Calling it
+	/// again has no effect.
+	static void extend_dictionary();
+
+	// ... or in the binary columnar format described in doc/dssp-binary-format.md,
+	// with a column for each field of residue_info and the statistics ...
+
+	void write_binary_output(std::ostream &os) const;
+
+	// ... or as the secondary structure string of each chain
+
+	enum class ss_string_format
+	{
+		fasta,
+		tsv
+	};
+
+	/// \brief Write the secondary structure of each chain as a string with one
+	/// DSSP code per residue to \a os, the datablock is left untouched
+	///
+	/// FASTA records have a header line ">name:chain", followed by " model=nr"
+	/// for models other than 1. TSV lines contain the name, the model number,
+	/// the chain ID and the string, separated by tabs. The chain ID is the
+	/// pdb_strand_id and \a name defaults to the name of the datablock.
+	void write_secondary_structure(std::ostream &os, ss_string_format format, std::string_view name = {}) const;
 
 	// convenience method, when creating old style DSSP files
 
@@ -268,6 +562,8 @@ class dssp
 	std::string get_pdb_header_line(pdb_record_type pdb_record) const;
 
   private:
+	dssp(struct DSSP_impl *impl);
+
 	struct DSSP_impl *m_impl;
 };
 
@@ -30,14 +30,156 @@
 #include <cif++.hpp>
 #include <cif++/dictionary_parser.hpp>
 
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
 #include <exception>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
 
 // --------------------------------------------------------------------
+// The legacy format is written through a fixed size buffer, the fields are
+// formatted in place using std::to_chars following the printf rules: right
+// aligned in a field of at least the requested width.
+
+// Floating point std::to_chars needs GCC 11 or libc++ 14, the build checks
+// for it. Without the check, use the feature test macro.
+#ifndef DSSP_HAVE_FLOAT_TO_CHARS
+#if defined(__cpp_lib_to_chars)
+#define DSSP_HAVE_FLOAT_TO_CHARS 1
+#else
+#define DSSP_HAVE_FLOAT_TO_CHARS 0
+#endif
+#endif
+
+class legacy_writer
+{
+  public:
+	legacy_writer(std::ostream &os)
+		: m_os(os)
+		, m_buffer(new char[kBufferSize + kMaxFieldSize])
+	{
+	}
+
+	~legacy_writer()
+	{
+		flush();
+	}
+
+	legacy_writer(const legacy_writer &) = delete;
+	legacy_writer &operator=(const legacy_writer &) = delete;
+
+	void flush()
+	{
+		m_os.write(m_buffer.get(), m_length);
+		m_length = 0;
+	}
+
+	legacy_writer &put(char c)
+	{
+		reserve(1);
+		m_buffer[m_length++] = c;
+		return *this;
+	}
+
+	legacy_writer &put(std::string_view s)
+	{
+		if (s.length() > kBufferSize)
+		{
+			flush();
+			m_os.write(s.data(), s.length());
+		}
+		else
+		{
+			reserve(s.length());
+			std::memcpy(m_buffer.get() + m_length, s.data(), s.length());
+			m_length += s.length();
+		}
+		return *this;
+	}
+
+	// %<width>.1s
+	legacy_writer &put_first(std::string_view s)
+	{
+		return put(s.empty() ? ' ' : s.front());
+	}
+
+	// %<width>d
+	legacy_writer &put(long long v, int width)
+	{
+		reserve(kMaxFieldSize);
+		auto b = m_buffer.get() + m_length;
+		return align(b, std::to_chars(b, b + kMaxFieldSize, v).ptr, width);
+	}
+
+	// %<width>.<precision>f
+	legacy_writer &put(double v, int width, int precision)
+	{
+		reserve(kMaxFieldSize);
+		auto b = m_buffer.get() + m_length;
+		return align(b, format_fixed(b, b + kMaxFieldSize, v, precision), width);
+	}
+
+	// An H-bond as offset and energy, %11s of "%d,%3.1f"
+	legacy_writer &put_hbond(int offset, double energy)
+	{
+		reserve(kMaxFieldSize);
+		auto b = m_buffer.get() + m_length;
+		auto e = std::to_chars(b, b + kMaxFieldSize, offset).ptr;
+		*e++ = ',';
+		return align(b, format_fixed(e, b + kMaxFieldSize, energy, 1), 11);
+	}
 
-std::string ResidueToDSSPLine(const dssp::residue_info &info)
+  private:
+	static constexpr size_t kBufferSize = 64 * 1024;
+
+	// Enough for any double in fixed notation with a small precision
+	static constexpr size_t kMaxFieldSize = 400;
+
+	// %.<precision>f in [b, e), returns the end of the text
+	static char *format_fixed(char *b, char *e, double v, int precision)
+	{
+#if DSSP_HAVE_FLOAT_TO_CHARS
+		return std::to_chars(b, e, v, std::chars_format::fixed, precision).ptr;
+#else
+		int n = std::snprintf(b, e - b, "%.*f", precision, v);
+		return b + std::clamp<ptrdiff_t>(n, 0, e - b - 1);
+#endif
+	}
+
+	void reserve(size_t n)
+	{
+		if (m_length + n > kBufferSize)
+			flush();
+	}
+
+	// Right align the field formatted at [b, e) in \a width characters
+	legacy_writer &align(char *b, char *e, int width)
+	{
+		size_t n = e - b;
+		if (n < static_cast<size_t>(width))
+		{
+			size_t pad = width - n;
+			std::memmove(b + pad, b, n);
+			std::memset(b, ' ', pad);
+			n = width;
+		}
+		m_length += n;
+		return *this;
+	}
+
+	std::ostream &m_os;
+	std::unique_ptr<char[]> m_buffer;
+	size_t m_length = 0;
+};
+
+// --------------------------------------------------------------------
+
+void ResidueToDSSPLine(legacy_writer &out, const dssp::residue_info &info)
 {
 	/*
 	    This is the header line for the residue lines in a DSSP file:
@@ -110,42 +252,47 @@ std::string ResidueToDSSPLine(const dssp::residue_info &info)
 	if (info.sheet() != 0)
 		sheet = 'A' + (info.sheet() - 1) % 26;
 
-	std::string NHO[2], ONH[2];
+	out.put(info.nr(), 5).put(residue.pdb_seq_num(), 5).put_first(residue.pdb_ins_code()).put_first(residue.pdb_strand_id())
+		.put(' ').put(code).put("  ").put(ss)
+		.put(helix[3]).put(helix[0]).put(helix[1]).put(helix[2])
+		.put(bend).put(chirality).put(bridgelabel[0]).put(bridgelabel[1])
+		.put(bp[0], 4).put(bp[1], 4).put(sheet).put(floor(info.accessibility() + 0.5), 4, 0).put(' ');
+
+	// The H-bonds in the order N-H-->O, O-->H-N, N-H-->O, O-->H-N
 	for (int i : { 0, 1 })
 	{
-		const auto &[donor, donorE] = info.donor(i);
 		const auto &[acceptor, acceptorE] = info.acceptor(i);
-
-		NHO[i] = ONH[i] = "0, 0.0";
-
 		if (acceptor)
-		{
-			auto d = acceptor.nr() - info.nr();
-			NHO[i] = cif::format("%d,%3.1f", d, acceptorE).str();
-		}
+			out.put_hbond(acceptor.nr() - info.nr(), acceptorE);
+		else
+			out.put("     0, 0.0");
 
+		const auto &[donor, donorE] = info.donor(i);
 		if (donor)
-		{
-			auto d = donor.nr() - info.nr();
-			ONH[i] = cif::format("%d,%3.1f", d, donorE).str();
-		}
+			out.put_hbond(donor.nr() - info.nr(), donorE);
+		else
+			out.put("     0, 0.0");
 	}
 
 	// auto ca = residue.atomByID("CA");
 	auto const &[cax, cay, caz] = residue.ca_location();
 
-	return cif::format("%5d%5d%1.1s%1.1s %c  %c%c%c%c%c%c%c%c%c%4d%4d%c%4.0f %11s%11s%11s%11s  %6.3f%6.1f%6.1f%6.1f%6.1f %6.1f %6.1f %6.1f",
-		info.nr(), residue.pdb_seq_num(), residue.pdb_ins_code(), residue.pdb_strand_id(), code,
-		ss, helix[3], helix[0], helix[1], helix[2], bend, chirality, bridgelabel[0], bridgelabel[1],
-		bp[0], bp[1], sheet, floor(info.accessibility() + 0.5),
-		NHO[0], ONH[0], NHO[1], ONH[1],
-		residue.tco().value_or(0),
-		residue.kappa().value_or(360),
-		residue.alpha().value_or(360),
-		residue.phi().value_or(360),
-		residue.psi().value_or(360),
-		cax, cay, caz)
-	    .str();
+	out.put("  ")
+		.put(residue.tco().value_or(0), 6, 3)
+		.put(residue.kappa().value_or(360), 6, 1)
+		.put(alpha, 6, 1)
+		.put(residue.phi().value_or(360), 6, 1)
+		.put(residue.psi().value_or(360), 6, 1)
+		.put(' ').put(cax, 6, 1)
+		.put(' ').put(cay, 6, 1)
+		.put(' ').put(caz, 6, 1)
+		.put('\n');
+}
+
+// A line of the header with a count and the count per 100 residues, "%5d%5.1f"
+void WriteCountLine(legacy_writer &out, uint32_t count, uint32_t residues, std::string_view text)
+{
+	out.put(count, 5).put(count * 100.0 / residues, 5, 1).put(text).put('\n');
 }
 
 void writeDSSP(const dssp &dssp, std::ostream &os)
@@ -154,59 +301,74 @@ void writeDSSP(const dssp &dssp, std::ostream &os)
 
 	auto stats = dssp.get_statistics();
 
+	// std::gmtime returns a shared buffer, use the reentrant versions
 	std::time_t today = system_clock::to_time_t(system_clock::now());
-	std::tm *tm = std::gmtime(&today);
+	std::tm tm = {};
+#if defined(_WIN32)
+	gmtime_s(&tm, &today);
+#else
+	gmtime_r(&today, &tm);
+#endif
+
+	char date[32];
+	auto dateLength = std::strftime(date, sizeof(date), "%F", &tm);
 
 	std::string version = klibdsspVersionNumber;
 	if (version.length() < 10)
 		version.insert(version.end(), 10 - version.length(), ' ');
 
-	os << "==== Secondary Structure Definition by the program DSSP, NKI version " << version << "                    ==== DATE=" << std::put_time(tm, "%F") << "        ." << std::endl
-	   << "REFERENCE W. KABSCH AND C.SANDER, BIOPOLYMERS 22 (1983) 2577-2637                                                              ." << std::endl
-	   << dssp.get_pdb_header_line(dssp::pdb_record_type::HEADER) << '.' << std::endl
-	   << dssp.get_pdb_header_line(dssp::pdb_record_type::COMPND) << '.' << std::endl
-	   << dssp.get_pdb_header_line(dssp::pdb_record_type::SOURCE) << '.' << std::endl
-	   << dssp.get_pdb_header_line(dssp::pdb_record_type::AUTHOR) << '.' << std::endl;
+	legacy_writer out(os);
 
-	os << cif::format("%5d%3d%3d%3d%3d TOTAL NUMBER OF RESIDUES, NUMBER OF CHAINS, NUMBER OF SS-BRIDGES(TOTAL,INTRACHAIN,INTERCHAIN)                .",
-			  stats.count.residues, stats.count.chains, stats.count.SS_bridges, stats.count.intra_chain_SS_bridges, (stats.count.SS_bridges - stats.count.intra_chain_SS_bridges))
-	   << std::endl;
+	out.put("==== Secondary Structure Definition by the program DSSP, NKI version ").put(version).put("                    ==== DATE=")
+		.put(std::string_view{ date, dateLength }).put("        .\n")
+		.put("REFERENCE W. KABSCH AND C.SANDER, BIOPOLYMERS 22 (1983) 2577-2637                                                              .\n")
+		.put(dssp.get_pdb_header_line(dssp::pdb_record_type::HEADER)).put(".\n")
+		.put(dssp.get_pdb_header_line(dssp::pdb_record_type::COMPND)).put(".\n")
+		.put(dssp.get_pdb_header_line(dssp::pdb_record_type::SOURCE)).put(".\n")
+		.put(dssp.get_pdb_header_line(dssp::pdb_record_type::AUTHOR)).put(".\n");
 
-	os << cif::format("%8.1f   ACCESSIBLE SURFACE OF PROTEIN (ANGSTROM**2)                                                                         .", stats.accessible_surface) << std::endl;
-
-	// hydrogenbond summary
+	out.put(stats.count.residues, 5).put(stats.count.chains, 3).put(stats.count.SS_bridges, 3).put(stats.count.intra_chain_SS_bridges, 3)
+		.put(stats.count.SS_bridges - stats.count.intra_chain_SS_bridges, 3)
+		.put(" TOTAL NUMBER OF RESIDUES, NUMBER OF CHAINS, NUMBER OF SS-BRIDGES(TOTAL,INTRACHAIN,INTERCHAIN)                .\n");
 
-	os << cif::format("%5d%5.1f   TOTAL NUMBER OF HYDROGEN BONDS OF TYPE O(I)-->H-N(J)  , SAME NUMBER PER 100 RESIDUES                              .", stats.count.H_bonds, (stats.count.H_bonds * 100.0 / stats.count.residues)) << std::endl;
+	out.put(stats.accessible_surface, 8, 1).put("   ACCESSIBLE SURFACE OF PROTEIN (ANGSTROM**2)                                                                         .\n");
 
-	os << cif::format("%5d%5.1f   TOTAL NUMBER OF HYDROGEN BONDS IN     PARALLEL BRIDGES, SAME NUMBER PER 100 RESIDUES                              .", stats.count.H_bonds_in_parallel_bridges, (stats.count.H_bonds_in_parallel_bridges * 100.0 / stats.count.residues)) << std::endl;
+	// hydrogenbond summary
 
-	os << cif::format("%5d%5.1f   TOTAL NUMBER OF HYDROGEN BONDS IN ANTIPARALLEL BRIDGES, SAME NUMBER PER 100 RESIDUES                              .", stats.count.H_bonds_in_antiparallel_bridges, (stats.count.H_bonds_in_antiparallel_bridges * 100.0 / stats.count.residues)) << std::endl;
+	WriteCountLine(out, stats.count.H_bonds, stats.count.residues, "   TOTAL NUMBER OF HYDROGEN BONDS OF TYPE O(I)-->H-N(J)  , SAME NUMBER PER 100 RESIDUES                              .");
+	WriteCountLine(out, stats.count.H_bonds_in_parallel_bridges, stats.count.residues, "   TOTAL NUMBER OF HYDROGEN BONDS IN     PARALLEL BRIDGES, SAME NUMBER PER 100 RESIDUES                              .");
+	WriteCountLine(out, stats.count.H_bonds_in_antiparallel_bridges, stats.count.residues, "   TOTAL NUMBER OF HYDROGEN BONDS IN ANTIPARALLEL BRIDGES, SAME NUMBER PER 100 RESIDUES                              .");
 
 	for (int k = 0; k < 11; ++k)
-		os << cif::format("%5d%5.1f   TOTAL NUMBER OF HYDROGEN BONDS OF TYPE O(I)-->H-N(I%c%1d), SAME NUMBER PER 100 RESIDUES                              .", stats.count.H_Bonds_per_distance[k], (stats.count.H_Bonds_per_distance[k] * 100.0 / stats.count.residues), (k - 5 < 0 ? '-' : '+'), abs(k - 5)) << std::endl;
+	{
+		char text[] = "   TOTAL NUMBER OF HYDROGEN BONDS OF TYPE O(I)-->H-N(I-5), SAME NUMBER PER 100 RESIDUES                              .";
+		text[54] = k - 5 < 0 ? '-' : '+';
+		text[55] = static_cast<char>('0' + abs(k - 5));
+		WriteCountLine(out, stats.count.H_Bonds_per_distance[k], stats.count.residues, text);
+	}
 
 	// histograms...
-	os << "  1  2  3  4  5  6  7  8  9 10 11 12 13 14 15 16 17 18 19 20 21 22 23 24 25 26 27 28 29 30     *** HISTOGRAMS OF ***           ." << std::endl;
+	out.put("  1  2  3  4  5  6  7  8  9 10 11 12 13 14 15 16 17 18 19 20 21 22 23 24 25 26 27 28 29 30     *** HISTOGRAMS OF ***           .\n");
 
 	for (auto hi : stats.histogram.residues_per_alpha_helix)
-		os << cif::format("%3d", hi);
-	os << "    RESIDUES PER ALPHA HELIX         ." << std::endl;
+		out.put(hi, 3);
+	out.put("    RESIDUES PER ALPHA HELIX         .\n");
 
 	for (auto hi : stats.histogram.parallel_bridges_per_ladder)
-		os << cif::format("%3d", hi);
-	os << "    PARALLEL BRIDGES PER LADDER      ." << std::endl;
+		out.put(hi, 3);
+	out.put("    PARALLEL BRIDGES PER LADDER      .\n");
 
 	for (auto hi : stats.histogram.antiparallel_bridges_per_ladder)
-		os << cif::format("%3d", hi);
-	os << "    ANTIPARALLEL BRIDGES PER LADDER  ." << std::endl;
+		out.put(hi, 3);
+	out.put("    ANTIPARALLEL BRIDGES PER LADDER  .\n");
 
 	for (auto hi : stats.histogram.ladders_per_sheet)
-		os << cif::format("%3d", hi);
-	os << "    LADDERS PER SHEET                ." << std::endl;
+		out.put(hi, 3);
+	out.put("    LADDERS PER SHEET                .\n");
 
 	// per residue information
 
-	os << "  #  RESIDUE AA STRUCTURE BP1 BP2  ACC     N-H-->O    O-->H-N    N-H-->O    O-->H-N    TCO  KAPPA ALPHA  PHI   PSI    X-CA   Y-CA   Z-CA" << std::endl;
+	out.put("  #  RESIDUE AA STRUCTURE BP1 BP2  ACC     N-H-->O    O-->H-N    N-H-->O    O-->H-N    TCO  KAPPA ALPHA  PHI   PSI    X-CA   Y-CA   Z-CA\n");
 
 	int last = 0;
 	for (auto ri : dssp)
@@ -215,18 +377,36 @@ void writeDSSP(const dssp &dssp, std::ostream &os)
 		// can be the transition to a different chain, or missing residues in the current chain
 
 		if (ri.nr() != last + 1)
-			os << cif::format("%5d        !%c             0   0    0      0, 0.0     0, 0.0     0, 0.0     0, 0.0   0.000 360.0 360.0 360.0 360.0    0.0    0.0    0.0",
-					  (last + 1), (ri.chain_break() == dssp::chain_break_type::NewChain ? '*' : ' '))
-			   << std::endl;
+			out.put(last + 1, 5).put("        !").put(ri.chain_break() == dssp::chain_break_type::NewChain ? '*' : ' ')
+				.put("             0   0    0      0, 0.0     0, 0.0     0, 0.0     0, 0.0   0.000 360.0 360.0 360.0 360.0    0.0    0.0    0.0\n");
 
-		os << ResidueToDSSPLine(ri) << std::endl;
+		ResidueToDSSPLine(out, ri);
 		last = ri.nr();
 	}
 }
 
 // --------------------------------------------------------------------
+// The per residue categories can be large. Their rows are built, and the
+// values formatted, in parallel. The rows are then added to the category
+// in the order of the residues since a category cannot be modified
+// concurrently, that keeps the output deterministic.
+
+using residue_list = std::vector<dssp::residue_info>;
 
-void writeBridgePairs(cif::datablock &db, const dssp &dssp)
+template <typename F>
+std::vector<cif::row_initializer> BuildRows(const residue_list &inResidues, size_t inThreads, F &&f)
+{
+	std::vector<cif::row_initializer> rows(inResidues.size());
+
+	parallel_for(inResidues.size(), inThreads, 256, [&](size_t i)
+		{ rows[i] = f(inResidues[i]); });
+
+	return rows;
+}
+
+// --------------------------------------------------------------------
+
+void writeBridgePairs(cif::datablock &db, const residue_list &residues, size_t nr_of_threads)
 {
 	auto &hb = db["dssp_struct_bridge_pairs"];
 
@@ -248,10 +428,9 @@ void writeBridgePairs(cif::datablock &db, const dssp &dssp)
 		}
 	}
 
-	for (auto &res : dssp)
+	auto rows = BuildRows(residues, nr_of_threads, [](const dssp::residue_info &res)
 	{
 		cif::row_initializer data({
-			{ "id", hb.get_unique_id("") },
 			{ "label_comp_id", res.compound_id() },
 			{ "label_seq_id", res.seq_id() },
 			{ "label_asym_id", res.asym_id() },
@@ -319,6 +498,12 @@ void writeBridgePairs(cif::datablock &db, const dssp &dssp)
 			}
 		}
 
+		return data;
+	});
+
+	for (auto &data : rows)
+	{
+		data.emplace_back("id", hb.get_unique_id(""));
 		hb.emplace(std::move(data));
 	}
 }
@@ -339,15 +524,17 @@ void writeSheets(cif::datablock &db, const dssp &dssp)
 	// create a list of strands, based on the SS info in DSSP. Store sheet number along with the strand.
 
 	std::map<std::tuple<int,int>, res_list> strands;
-	std::set<int> sheetNrs;
+	std::map<int, int> sheetNrs;	// with the number of strands
 
 	for (auto &res : dssp)
 	{
 		if (res.type() != dssp::structure_type::Strand and res.type() != dssp::structure_type::Betabridge)
 			continue;
 
-		strands[{res.sheet(), res.strand()}].emplace_back(res);
-		sheetNrs.insert(res.sheet());
+		auto &strand = strands[{res.sheet(), res.strand()}];
+		if (strand.empty())
+			++sheetNrs[res.sheet()];
+		strand.emplace_back(res);
 	}
 
 	// --------------------------------------------------------------------
@@ -355,26 +542,20 @@ void writeSheets(cif::datablock &db, const dssp &dssp)
 	auto &struct_sheet = db["struct_sheet"];
 	auto &struct_sheet_range = db["struct_sheet_range"];
 
-	for (int sheetNr : sheetNrs)
+	for (auto [sheetNr, strandCount] : sheetNrs)
 	{
 		auto sheetID = cif::cif_id_for_number(sheetNr - 1);
 
 		struct_sheet.emplace({
 			{ "id", sheetID },
-			{ "number_strands",
-				std::count_if(strands.begin(), strands.end(), [nr = sheetNr](std::tuple<std::tuple<int,int>, res_list> const &s)
-				{
-					const auto &[strandID, strand] = s;
-					return strand.front().sheet() == nr;
-				})
-			}
+			{ "number_strands", strandCount }
 		});
 
-		for (auto &&[strandTuple, strand] : strands)
+		// The strands are ordered by sheet first
+		for (auto si = strands.lower_bound({ sheetNr, std::numeric_limits<int>::min() }); si != strands.end() and std::get<0>(si->first) == sheetNr; ++si)
 		{
-			if (strand.front().sheet() != sheetNr)
-				continue;
-			
+			auto &strand = si->second;
+
 			std::string strandID = cif::cif_id_for_number(strand.front().strand() - 1);
 
 			std::sort(strand.begin(), strand.end(), [](dssp::residue_info const &a, dssp::residue_info const &b)
@@ -426,9 +607,11 @@ void writeLadders(cif::datablock &db, const dssp &dssp)
 		int sheet;
 		bool parallel;
 		std::vector<std::pair<dssp::residue_info, dssp::residue_info>> pairs;
+		std::set<std::pair<int, int>> seen;	// the nr's of the pairs
 	};
 
 	std::vector<ladder_info> ladders;
+	std::map<int, size_t> index;	// ladder to its index in ladders
 
 	for (auto res : dssp)
 	{
@@ -439,30 +622,23 @@ void writeLadders(cif::datablock &db, const dssp &dssp)
 			if (not p)
 				continue;
 
-			bool is_new = true;
-			for (auto &l : ladders)
+			auto li = index.find(ladder);
+			if (li == index.end())
 			{
-				if (l.ladder != ladder)
-					continue;
-
-				assert(l.parallel == parallel);
+				index.emplace(ladder, ladders.size());
+				ladders.emplace_back(ladder, res.sheet() - 1, parallel, res, p).seen.emplace(res.nr(), p.nr());
+				continue;
+			}
 
-				if (find_if(l.pairs.begin(), l.pairs.end(), [na = p.nr(), nb = res.nr()](const auto &p)
-						{ return p.first.nr() == na and p.second.nr() == nb; }) != l.pairs.end())
-				{
-					is_new = false;
-					break;
-				}
+			auto &l = ladders[li->second];
+			assert(l.parallel == parallel);
 
+			// each pair is found from both sides, keep the first
+			if (l.seen.count({ p.nr(), res.nr() }) == 0)
+			{
+				l.seen.emplace(res.nr(), p.nr());
 				l.pairs.emplace_back(res, p);
-				is_new = false;
-				break;
 			}
-
-			if (not is_new)
-				continue;
-
-			ladders.emplace_back(ladder, res.sheet() - 1, parallel, res, p);
 		}
 	}
 
@@ -601,7 +777,7 @@ void writeStatistics(cif::datablock &db, const dssp &dssp)
 	}
 }
 
-void writeSummary(cif::datablock &db, const dssp &dssp)
+void writeSummary(cif::datablock &db, const dssp &dssp, size_t nr_of_threads)
 {
 	bool writeAccessibility = dssp.get_statistics().accessible_surface > 0;
 
@@ -611,15 +787,17 @@ void writeSummary(cif::datablock &db, const dssp &dssp)
 
 	// prime the category with the field labels we need, this is to ensure proper order in writing out the data.
 
-	for (auto label : { "entry_id", "label_comp_id", "label_asym_id", "label_seq_id", "secondary_structure",
+	for (auto label : { "pdbx_PDB_model_num", "entry_id", "label_comp_id", "label_asym_id", "label_seq_id", "secondary_structure",
 			"ss_bridge", "helix_3_10", "helix_alpha", "helix_pi", "helix_pp", "bend", "chirality", "sheet",
 			"strand", "ladder_1", "ladder_2", "accessibility", "TCO", "kappa", "alpha", "phi", "psi",
 			"x_ca", "y_ca", "z_ca"})
 		dssp_struct_summary.add_item(label);
 
-	for (auto res : dssp)
-	{
+	const std::string &entryID = db.name();
+	const int modelNr = dssp.get_model_nr();
 
+	auto rows = BuildRows(residue_list(dssp.begin(), dssp.end()), nr_of_threads, [&](const dssp::residue_info &res)
+	{
 		/*
 		    This is the header line for the residue lines in a DSSP file:
 
@@ -666,9 +844,11 @@ void writeSummary(cif::datablock &db, const dssp &dssp)
 		if (res.bend())
 			bend = "S";
 
+		auto alpha = res.alpha();
+
 		std::string chirality = ".";
-		if (res.alpha().has_value())
-			chirality = *res.alpha() < 0 ? "-" : "+";
+		if (alpha.has_value())
+			chirality = *alpha < 0 ? "-" : "+";
 
 		std::string ladders[2] = { ".", "." };
 
@@ -684,7 +864,8 @@ void writeSummary(cif::datablock &db, const dssp &dssp)
 		auto const &[cax, cay, caz] = res.ca_location();
 
 		cif::row_initializer data{
-			{ "entry_id", db.name() },
+			{ "pdbx_PDB_model_num", modelNr },
+			{ "entry_id", entryID },
 			{ "label_comp_id", res.compound_id() },
 			{ "label_asym_id", res.asym_id() },
 			{ "label_seq_id", res.seq_id() },
@@ -724,8 +905,8 @@ void writeSummary(cif::datablock &db, const dssp &dssp)
 		else
 			data.emplace_back("kappa", ".");
 
-		if (res.alpha().has_value())
-			data.emplace_back("alpha", *res.alpha(), 1);
+		if (alpha.has_value())
+			data.emplace_back("alpha", *alpha, 1);
 		else
 			data.emplace_back("alpha", ".");
 
@@ -738,39 +919,52 @@ void writeSummary(cif::datablock &db, const dssp &dssp)
 			data.emplace_back("psi", *res.psi(), 1);
 		else
 			data.emplace_back("psi", ".");
-		
+
+		return data;
+	});
+
+	for (auto &data : rows)
 		dssp_struct_summary.emplace(std::move(data));
-	}
 }
 
-void annotateDSSP(cif::datablock &db, const dssp &dssp, bool writeOther, bool writeExperimental)
+// The validator for mmcif_pdbx.dic is shared by all files using it. It is
+// extended with the DSSP dictionary only once, after that it is never
+// modified again.
+void extendDictionary()
+{
+	static std::once_flag sExtended;
+	std::call_once(sExtended, []()
+		{
+			auto &validator = const_cast<cif::validator &>(cif::validator_factory::instance()["mmcif_pdbx.dic"]);
+			if (validator.get_validator_for_category("dssp_struct_summary") == nullptr)
+			{
+				auto dssp_extension = cif::load_resource("dssp-extension.dic");
+				if (dssp_extension)
+					cif::extend_dictionary(validator, *dssp_extension);
+			} });
+}
+
+// The secondary structure is annotated for the first model, the summary
+// is written for all models
+void annotateDSSP(cif::datablock &db, const std::vector<const dssp *> &models, bool writeOther, bool writeExperimental, size_t nr_of_threads)
 {
 	using namespace std::literals;
 
-	if (db.get_validator() != nullptr) {
-		auto &validator = const_cast<cif::validator &>(*db.get_validator());
-		if (validator.get_validator_for_category("dssp_struct_summary") == nullptr)
-		{
-			auto dssp_extension = cif::load_resource("dssp-extension.dic");
-			if (dssp_extension)
-				cif::extend_dictionary(validator, *dssp_extension);
-		}
-	}
+	const dssp &dssp = *models.front();
 
-	if (dssp.empty())
-	{
-		if (cif::VERBOSE > 0)
-			std::cout << "No secondary structure information found" << std::endl;
-	}
-	else
+	extendDictionary();
+
+	if (not dssp.empty())
 	{
 		if (writeExperimental)
 		{
-			writeBridgePairs(db, dssp);
+			writeBridgePairs(db, residue_list(dssp.begin(), dssp.end()), nr_of_threads);
 			writeSheets(db, dssp);
 			writeLadders(db, dssp);
 			writeStatistics(db, dssp);
-			writeSummary(db, dssp);
+
+			for (auto model : models)
+				writeSummary(db, *model, nr_of_threads);
 		}
 
 		// replace all struct_conf and struct_conf_type records
@@ -884,3 +1078,334 @@ void annotateDSSP(cif::datablock &db, const dssp &dssp, bool writeOther, bool wr
 		{ "classification", "model annotation" }
 	});
 }
+
+void annotateDSSP(cif::datablock &db, const dssp &dssp, bool writeOther, bool writeExperimental, size_t nr_of_threads)
+{
+	annotateDSSP(db, std::vector<const class dssp *>{ &dssp }, writeOther, writeExperimental, nr_of_threads);
+}
+
+void annotateDSSP(cif::datablock &db, const std::vector<dssp> &models, bool writeOther, bool writeExperimental, size_t nr_of_threads)
+{
+	if (models.empty())
+		throw std::runtime_error("No models to annotate");
+
+	std::vector<const dssp *> pointers;
+	for (auto &model : models)
+		pointers.push_back(&model);
+
+	annotateDSSP(db, pointers, writeOther, writeExperimental, nr_of_threads);
+}
+
+// --------------------------------------------------------------------
+
+void writeSecondaryStructureStrings(const dssp &dssp, std::ostream &os, dssp::ss_string_format format, std::string_view name)
+{
+	std::string record, ss;
+
+	auto flush = [&](const std::string &chainID)
+	{
+		if (ss.empty())
+			return;
+
+		record.clear();
+
+		if (format == dssp::ss_string_format::fasta)
+		{
+			record += '>';
+			record += name;
+			record += ':';
+			record += chainID;
+			if (dssp.get_model_nr() != 1)
+				record += " model=" + std::to_string(dssp.get_model_nr());
+			record += '\n';
+		}
+		else
+		{
+			record += name;
+			record += '\t';
+			record += std::to_string(dssp.get_model_nr());
+			record += '\t';
+			record += chainID;
+			record += '\t';
+		}
+
+		record += ss;
+		record += '\n';
+
+		os.write(record.data(), record.length());
+		ss.clear();
+	};
+
+	// The residues of a chain are consecutive, a new chain starts at
+	// each change in asym_id
+	std::string asymID, chainID;
+
+	for (auto res : dssp)
+	{
+		if (res.asym_id() != asymID)
+		{
+			flush(chainID);
+			asymID = res.asym_id();
+			chainID = res.pdb_strand_id();
+		}
+
+		ss += static_cast<char>(res.type());
+	}
+
+	flush(chainID);
+}
+
+// --------------------------------------------------------------------
+// The binary columnar format, see doc/dssp-binary-format.md. All values
+// are stored little endian, independent of the host.
+
+namespace
+{
+
+enum class binary_column_type : uint32_t
+{
+	int32 = 1,
+	float32 = 2,
+	uint8 = 3,
+	string = 4
+};
+
+constexpr char kBinaryMagic[8] = { 'D', 'S', 'S', 'P', 'B', 'I', 'N', 0 };
+constexpr uint32_t kBinaryVersion = 1;
+constexpr size_t kBinaryHeaderSize = 64;
+constexpr size_t kBinaryColumnNameSize = 32;
+constexpr size_t kBinaryDirectoryEntrySize = kBinaryColumnNameSize + 24;
+
+void AppendLE(std::string &buffer, uint64_t v, size_t size)
+{
+	for (size_t i = 0; i < size; ++i, v >>= 8)
+		buffer += static_cast<char>(v & 0xff);
+}
+
+void AppendLE(std::string &buffer, uint32_t v)
+{
+	AppendLE(buffer, v, 4);
+}
+
+void AppendLE(std::string &buffer, float v)
+{
+	uint32_t u;
+	std::memcpy(&u, &v, sizeof(u));
+	AppendLE(buffer, u, 4);
+}
+
+void AppendLE(std::string &buffer, double v)
+{
+	uint64_t u;
+	std::memcpy(&u, &v, sizeof(u));
+	AppendLE(buffer, u, 8);
+}
+
+void PadTo8(std::string &buffer)
+{
+	buffer.append((8 - buffer.length() % 8) % 8, '\0');
+}
+
+struct binary_column
+{
+	std::string name;
+	binary_column_type type;
+	std::string data;
+};
+
+class binary_columns
+{
+  public:
+	binary_columns(const dssp &dssp)
+		: m_residues(dssp.begin(), dssp.end())
+	{
+	}
+
+	template <typename F>
+	void add_int32(std::string name, F &&f)
+	{
+		auto &column = add(std::move(name), binary_column_type::int32, 4);
+		for (auto &r : m_residues)
+			AppendLE(column.data, static_cast<uint32_t>(static_cast<int32_t>(f(r))));
+	}
+
+	// Missing values are stored as NaN
+	template <typename F>
+	void add_float32(std::string name, F &&f)
+	{
+		auto &column = add(std::move(name), binary_column_type::float32, 4);
+		for (auto &r : m_residues)
+			AppendLE(column.data, static_cast<float>(f(r)));
+	}
+
+	template <typename F>
+	void add_uint8(std::string name, F &&f)
+	{
+		auto &column = add(std::move(name), binary_column_type::uint8, 1);
+		for (auto &r : m_residues)
+			column.data += static_cast<char>(f(r));
+	}
+
+	// N + 1 offsets into the characters that follow them
+	template <typename F>
+	void add_string(std::string name, F &&f)
+	{
+		std::string chars;
+		auto &column = add(std::move(name), binary_column_type::string, 4 * (m_residues.size() + 1));
+		AppendLE(column.data, uint32_t{ 0 });
+		for (auto &r : m_residues)
+		{
+			chars += f(r);
+			AppendLE(column.data, static_cast<uint32_t>(chars.length()));
+		}
+		column.data += chars;
+	}
+
+	size_t size() const { return m_residues.size(); }
+
+	const std::vector<binary_column> &columns() const { return m_columns; }
+
+  private:
+	binary_column &add(std::string name, binary_column_type type, size_t elementSize)
+	{
+		assert(name.length() < kBinaryColumnNameSize);
+		auto &column = m_columns.emplace_back(binary_column{ std::move(name), type, {} });
+		column.data.reserve(elementSize * m_residues.size());
+		return column;
+	}
+
+	std::vector<dssp::residue_info> m_residues;
+	std::vector<binary_column> m_columns;
+};
+
+float OptionalAngle(const std::optional<float> &v)
+{
+	return v.value_or(std::numeric_limits<float>::quiet_NaN());
+}
+
+} // namespace
+
+void writeBinary(const dssp &dssp, std::ostream &os)
+{
+	using residue_info = dssp::residue_info;
+
+	binary_columns columns(dssp);
+
+	columns.add_int32("nr", [](const residue_info &r) { return r.nr(); });
+	columns.add_string("asym_id", [](const residue_info &r) { return r.asym_id(); });
+	columns.add_int32("seq_id", [](const residue_info &r) { return r.seq_id(); });
+	columns.add_string("compound_id", [](const residue_info &r) { return r.compound_id(); });
+	columns.add_string("pdb_strand_id", [](const residue_info &r) { return r.pdb_strand_id(); });
+	columns.add_int32("pdb_seq_num", [](const residue_info &r) { return r.pdb_seq_num(); });
+	columns.add_string("pdb_ins_code", [](const residue_info &r) { return r.pdb_ins_code(); });
+	columns.add_uint8("chain_break", [](const residue_info &r) { return static_cast<uint8_t>(r.chain_break()); });
+
+	columns.add_uint8("type", [](const residue_info &r) { return static_cast<uint8_t>(r.type()); });
+	columns.add_uint8("helix_3_10", [](const residue_info &r) { return static_cast<uint8_t>(r.helix(dssp::helix_type::_3_10)); });
+	columns.add_uint8("helix_alpha", [](const residue_info &r) { return static_cast<uint8_t>(r.helix(dssp::helix_type::alpha)); });
+	columns.add_uint8("helix_pi", [](const residue_info &r) { return static_cast<uint8_t>(r.helix(dssp::helix_type::pi)); });
+	columns.add_uint8("helix_pp", [](const residue_info &r) { return static_cast<uint8_t>(r.helix(dssp::helix_type::pp)); });
+	columns.add_uint8("bend", [](const residue_info &r) { return r.bend(); });
+	columns.add_int32("ss_bridge_nr", [](const residue_info &r) { return r.ssBridgeNr(); });
+
+	for (int i : { 0, 1 })
+	{
+		auto n = std::to_string(i + 1);
+		columns.add_int32("bridge_partner_" + n + "_nr", [i](const residue_info &r)
+			{ auto p = std::get<0>(r.bridge_partner(i)); return p ? p.nr() : 0; });
+		columns.add_int32("bridge_partner_" + n + "_ladder", [i](const residue_info &r)
+			{ return std::get<0>(r.bridge_partner(i)) ? std::get<1>(r.bridge_partner(i)) : 0; });
+		columns.add_uint8("bridge_partner_" + n + "_parallel", [i](const residue_info &r)
+			{ return std::get<2>(r.bridge_partner(i)); });
+	}
+
+	columns.add_int32("sheet", [](const residue_info &r) { return r.sheet(); });
+	columns.add_int32("strand", [](const residue_info &r) { return r.strand(); });
+	columns.add_float32("accessibility", [](const residue_info &r) { return r.accessibility(); });
+
+	columns.add_float32("alpha", [](const residue_info &r) { return OptionalAngle(r.alpha()); });
+	columns.add_float32("kappa", [](const residue_info &r) { return OptionalAngle(r.kappa()); });
+	columns.add_float32("phi", [](const residue_info &r) { return OptionalAngle(r.phi()); });
+	columns.add_float32("psi", [](const residue_info &r) { return OptionalAngle(r.psi()); });
+	columns.add_float32("tco", [](const residue_info &r) { return OptionalAngle(r.tco()); });
+	columns.add_float32("omega", [](const residue_info &r) { return OptionalAngle(r.omega()); });
+
+	for (int i : { 0, 1 })
+	{
+		auto n = std::to_string(i + 1);
+		columns.add_int32("acceptor_" + n + "_nr", [i](const residue_info &r)
+			{ auto p = std::get<0>(r.acceptor(i)); return p ? p.nr() : 0; });
+		columns.add_float32("acceptor_" + n + "_energy", [i](const residue_info &r)
+			{ return std::get<1>(r.acceptor(i)); });
+		columns.add_int32("donor_" + n + "_nr", [i](const residue_info &r)
+			{ auto p = std::get<0>(r.donor(i)); return p ? p.nr() : 0; });
+		columns.add_float32("donor_" + n + "_energy", [i](const residue_info &r)
+			{ return std::get<1>(r.donor(i)); });
+	}
+
+	columns.add_float32("ca_x", [](const residue_info &r) { return std::get<0>(r.ca_location()); });
+	columns.add_float32("ca_y", [](const residue_info &r) { return std::get<1>(r.ca_location()); });
+	columns.add_float32("ca_z", [](const residue_info &r) { return std::get<2>(r.ca_location()); });
+
+	// The statistics block
+
+	auto stats = dssp.get_statistics();
+
+	std::string statistics;
+	AppendLE(statistics, stats.accessible_surface);
+	for (uint32_t v : { stats.count.residues, stats.count.chains, stats.count.SS_bridges, stats.count.intra_chain_SS_bridges,
+			 stats.count.H_bonds, stats.count.H_bonds_in_antiparallel_bridges, stats.count.H_bonds_in_parallel_bridges })
+		AppendLE(statistics, v);
+	for (auto v : stats.count.H_Bonds_per_distance)
+		AppendLE(statistics, v);
+	for (auto histogram : { stats.histogram.residues_per_alpha_helix, stats.histogram.parallel_bridges_per_ladder,
+			 stats.histogram.antiparallel_bridges_per_ladder, stats.histogram.ladders_per_sheet })
+	{
+		for (size_t i = 0; i < dssp::kHistogramSize; ++i)
+			AppendLE(statistics, histogram[i]);
+	}
+	PadTo8(statistics);
+
+	// Lay out the file, header, statistics, directory and the columns
+
+	const auto &data = columns.columns();
+
+	uint64_t statisticsOffset = kBinaryHeaderSize;
+	uint64_t directoryOffset = statisticsOffset + statistics.length();
+	uint64_t offset = directoryOffset + data.size() * kBinaryDirectoryEntrySize;
+
+	std::string directory;
+	for (auto &column : data)
+	{
+		directory += column.name;
+		directory.append(kBinaryColumnNameSize - column.name.length(), '\0');
+		AppendLE(directory, static_cast<uint32_t>(column.type));
+		AppendLE(directory, uint32_t{ 0 });
+		AppendLE(directory, offset, 8);
+		AppendLE(directory, column.data.length(), 8);
+
+		offset += (column.data.length() + 7) / 8 * 8;
+	}
+
+	// offset is now the total size
+	std::string header(kBinaryMagic, sizeof(kBinaryMagic));
+	AppendLE(header, kBinaryVersion);
+	AppendLE(header, static_cast<uint32_t>(dssp.get_model_nr()));
+	AppendLE(header, static_cast<uint32_t>(columns.size()));
+	AppendLE(header, static_cast<uint32_t>(data.size()));
+	AppendLE(header, statisticsOffset, 8);
+	AppendLE(header, directoryOffset, 8);
+	AppendLE(header, offset, 8);
+	header.resize(kBinaryHeaderSize, '\0');
+
+	os.write(header.data(), header.length());
+	os.write(statistics.data(), statistics.length());
+	os.write(directory.data(), directory.length());
+
+	const char kPadding[8] = {};
+	for (auto &column : data)
+	{
+		os.write(column.data.data(), column.data.length());
+		os.write(kPadding, (8 - column.data.length() % 8) % 8);
+	}
+}
@@ -28,5 +28,107 @@
 
 #include "dssp.hpp"
 
+#include <algorithm>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 void writeDSSP(const dssp& dssp, std::ostream& os);
-void annotateDSSP(cif::datablock &db, const dssp& dssp, bool writeOther, bool writeExperimental);
+void extendDictionary();
+void annotateDSSP(cif::datablock &db, const dssp& dssp, bool writeOther, bool writeExperimental, size_t nr_of_threads = 1);
+void annotateDSSP(cif::datablock &db, const std::vector<dssp> &models, bool writeOther, bool writeExperimental, size_t nr_of_threads = 1);
+void writeBinary(const dssp &dssp, std::ostream &os);
+void writeSecondaryStructureStrings(const dssp &dssp, std::ostream &os, dssp::ss_string_format format, std::string_view name);
+
+// --------------------------------------------------------------------
+// A small work stealing scheduler. The range [0, inCount) is cut into
+// chunks of inChunkSize which are divided evenly over the threads. Each
+// thread takes chunks from the front of its own queue and when that is
+// empty it steals chunks from the back of the queue of another thread.
+// Shared by the calculation and the writers.
+
+inline size_t resolve_thread_count(size_t inThreads)
+{
+	if (inThreads == 0)
+		inThreads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	return inThreads;
+}
+
+template <typename F>
+void parallel_for(size_t inCount, size_t inThreads, size_t inChunkSize, F &&f)
+{
+	size_t chunks = (inCount + inChunkSize - 1) / inChunkSize;
+	inThreads = std::min(resolve_thread_count(inThreads), chunks);
+
+	if (inThreads <= 1)
+	{
+		for (size_t i = 0; i < inCount; ++i)
+			f(i);
+		return;
+	}
+
+	struct work_queue
+	{
+		std::mutex mutex;
+		size_t next, end;
+	};
+
+	std::vector<work_queue> queues(inThreads);
+	for (size_t t = 0; t < inThreads; ++t)
+	{
+		queues[t].next = chunks * t / inThreads;
+		queues[t].end = chunks * (t + 1) / inThreads;
+	}
+
+	auto take = [&queues](size_t t, bool front, size_t &chunk)
+	{
+		std::unique_lock lock(queues[t].mutex);
+		if (queues[t].next == queues[t].end)
+			return false;
+		chunk = front ? queues[t].next++ : --queues[t].end;
+		return true;
+	};
+
+	std::exception_ptr error;
+	std::mutex error_mutex;
+
+	auto worker = [&](size_t t)
+	{
+		try
+		{
+			for (;;)
+			{
+				size_t chunk;
+				bool found = take(t, true, chunk);
+
+				for (size_t v = 1; not found and v < inThreads; ++v)
+					found = take((t + v) % inThreads, false, chunk);
+
+				if (not found)
+					break;
+
+				for (size_t i = chunk * inChunkSize; i < std::min(inCount, (chunk + 1) * inChunkSize); ++i)
+					f(i);
+			}
+		}
+		catch (...)
+		{
+			std::unique_lock lock(error_mutex);
+			if (not error)
+				error = std::current_exception();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t t = 1; t < inThreads; ++t)
+		threads.emplace_back(worker, t);
+
+	worker(0);
+
+	for (auto &t : threads)
+		t.join();
+
+	if (error)
+		std::rethrow_exception(error);
+}
@@ -30,10 +30,24 @@
 
 #include "dssp-io.hpp"
 
+#include <atomic>
+#include <chrono>
 #include <deque>
 #include <iomanip>
+#include <limits>
+#include <memory_resource>
+#include <mutex>
 #include <numeric>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+#if (defined(__x86_64__) or defined(__i386__)) and (defined(__GNUC__) or defined(__clang__))
+#define DSSP_HAVE_AVX2_KERNELS 1
+#include <immintrin.h>
+#endif
 
 #ifdef near
 #undef near
@@ -41,6 +55,7 @@
 
 using residue = dssp::residue;
 using statistics = dssp::statistics;
+using counters = dssp::counters;
 using structure_type = dssp::structure_type;
 using helix_type = dssp::helix_type;
 using helix_position_type = dssp::helix_position_type;
@@ -132,6 +147,175 @@ float cosinus_angle(const point &p1, const point &p2, const point &p3, const poi
 	return result;
 }
 
+// --------------------------------------------------------------------
+// A simple cell list for finding points that are close to each other.
+// Points are binned in cubic cells of size inCellSize, the cells are kept
+// as a sorted array of (cell key, index) pairs so memory use only depends
+// on the number of points, not on the extent of the structure.
+
+class spatial_index
+{
+  public:
+	spatial_index() = default;
+
+	spatial_index(const std::vector<point> &inPoints, float inCellSize)
+	{
+		build(inPoints, inCellSize);
+	}
+
+	/// \brief (Re)build the index for \a inPoints, reusing the storage
+	void build(const std::vector<point> &inPoints, float inCellSize)
+	{
+		mCellSize = inCellSize;
+		mOrigin = {};
+		mCells.clear();
+
+		if (not inPoints.empty())
+		{
+			mOrigin = inPoints.front();
+			for (auto &p : inPoints)
+			{
+				mOrigin.mX = std::min(mOrigin.mX, p.mX);
+				mOrigin.mY = std::min(mOrigin.mY, p.mY);
+				mOrigin.mZ = std::min(mOrigin.mZ, p.mZ);
+			}
+		}
+
+		mCells.reserve(inPoints.size());
+		for (uint32_t i = 0; i < inPoints.size(); ++i)
+		{
+			auto p = inPoints[i];
+			mCells.emplace_back(cell_key(cell_nr(p.mX, mOrigin.mX), cell_nr(p.mY, mOrigin.mY), cell_nr(p.mZ, mOrigin.mZ)), i);
+		}
+
+		std::sort(mCells.begin(), mCells.end());
+	}
+
+	/// \brief Call \a f for the index of each point that lies in a cell
+	/// overlapping the box of +/- \a inRange around \a p. This is a superset
+	/// of the points within \a inRange, the caller does the exact test.
+	template <typename F>
+	void for_each_in_range(const point &p, float inRange, F &&f) const
+	{
+		// pad the box a little so rounding can never drop a pair that passes the exact test
+		inRange += 0.001f;
+
+		int32_t x0 = cell_nr(p.mX - inRange, mOrigin.mX), x1 = cell_nr(p.mX + inRange, mOrigin.mX);
+		int32_t y0 = cell_nr(p.mY - inRange, mOrigin.mY), y1 = cell_nr(p.mY + inRange, mOrigin.mY);
+		int32_t z0 = cell_nr(p.mZ - inRange, mOrigin.mZ), z1 = cell_nr(p.mZ + inRange, mOrigin.mZ);
+
+		for (int32_t x = x0; x <= x1; ++x)
+		{
+			for (int32_t y = y0; y <= y1; ++y)
+			{
+				// cells with the same x and y are consecutive in the sorted array
+				auto last = cell_key(x, y, z1);
+				for (auto c = std::lower_bound(mCells.begin(), mCells.end(), std::make_pair(cell_key(x, y, z0), uint32_t(0)));
+					 c != mCells.end() and c->first <= last; ++c)
+				{
+					f(c->second);
+				}
+			}
+		}
+	}
+
+  private:
+	int32_t cell_nr(float v, float origin) const
+	{
+		// keep cell numbers within the 21 bits reserved in the key
+		return std::clamp(static_cast<int32_t>(std::floor((v - origin) / mCellSize)) + 1, 0, (1 << 21) - 1);
+	}
+
+	static uint64_t cell_key(int32_t x, int32_t y, int32_t z)
+	{
+		return (static_cast<uint64_t>(x) << 42) bitor (static_cast<uint64_t>(y) << 21) bitor static_cast<uint64_t>(z);
+	}
+
+	float mCellSize = 1;
+	point mOrigin = {};
+	std::vector<std::pair<uint64_t, uint32_t>> mCells;
+};
+
+// --------------------------------------------------------------------
+// Reports the progress of a phase to a dssp::progress or, when there is
+// none and it is requested in the options, to a cif::progress_bar.
+// consumed may be called from several threads at once, a report is made
+// only when another percent of the work is done.
+
+class progress_tracker
+{
+  public:
+	progress_tracker(const dssp::options &inOptions, const char *inPhase, uint64_t inTotal, bool inProgressBar = true)
+		: m_progress(inOptions.reporter)
+		, m_phase(inPhase)
+		, m_total(inTotal)
+		, m_step(std::max<uint64_t>(1, inTotal / 100))
+	{
+		if (m_progress == nullptr and inProgressBar and inOptions.progress_bar)
+			m_bar.reset(new cif::progress_bar(static_cast<int64_t>(inTotal), inPhase));
+
+		report(0, true);
+	}
+
+	progress_tracker(const progress_tracker &) = delete;
+	progress_tracker &operator=(const progress_tracker &) = delete;
+
+	void consumed(uint64_t inAmount)
+	{
+		uint64_t done = m_done.fetch_add(inAmount, std::memory_order_relaxed) + inAmount;
+		if ((done - inAmount) / m_step != done / m_step)
+			report(done, false);
+		else if (m_progress != nullptr and m_progress->cancelled())
+			throw dssp::cancelled_error();
+	}
+
+	// Report the phase as done
+	void finish()
+	{
+		report(m_total, true);
+	}
+
+  private:
+	void report(uint64_t inDone, bool inWait)
+	{
+		if (m_progress != nullptr)
+		{
+			if (m_progress->cancelled())
+				throw dssp::cancelled_error();
+
+			std::unique_lock lock(m_progress->m_mutex, std::defer_lock);
+			if (inWait)
+				lock.lock();
+			else if (not lock.try_lock())
+				return;
+
+			m_progress->report(m_phase, inDone, m_total);
+		}
+		else if (m_bar)
+		{
+			std::unique_lock lock(m_mutex);
+			m_bar->progress(static_cast<int64_t>(inDone));
+		}
+	}
+
+	dssp::progress *m_progress;
+	const char *m_phase;
+	uint64_t m_total, m_step;
+	std::atomic<uint64_t> m_done = 0;
+	std::unique_ptr<cif::progress_bar> m_bar;
+	std::mutex m_mutex;
+};
+
+// --------------------------------------------------------------------
+
+#if DSSP_HAVE_AVX2_KERNELS
+bool CPUSupportsAVX2()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
 enum residue_type : char
 {
 	kUnknownResidue = 'X',
@@ -216,17 +400,51 @@ enum class bridge_type
 	AntiParallel
 };
 
+// Bridges are allocator aware, the containers in a std::pmr::vector of
+// bridges all use the memory resource of that vector.
 struct bridge
 {
+	using allocator_type = std::pmr::polymorphic_allocator<uint32_t>;
+
+	bridge(bridge_type inType, const allocator_type &inAlloc = {})
+		: type(inType), i(inAlloc), j(inAlloc)
+	{
+	}
+
+	bridge(const bridge &b, const allocator_type &inAlloc = {})
+		: type(b.type), sheet(b.sheet), ladder(b.ladder), i(b.i, inAlloc), j(b.j, inAlloc), chainI(b.chainI), chainJ(b.chainJ)
+	{
+	}
+
+	// With a different memory resource the indices are copied, that may
+	// fail to allocate. With the same resource the buffers are taken over.
+	bridge(bridge &&b, const allocator_type &inAlloc)
+		: type(b.type), sheet(b.sheet), ladder(b.ladder), i(std::move(b.i), inAlloc), j(std::move(b.j), inAlloc), chainI(b.chainI), chainJ(b.chainJ)
+	{
+	}
+
+	// Takes over the buffers and can not fail, so a growing vector of
+	// bridges moves them instead of copying
+	bridge(bridge &&b) noexcept
+		: type(b.type), sheet(b.sheet), ladder(b.ladder), i(std::move(b.i)), j(std::move(b.j)), chainI(b.chainI), chainJ(b.chainJ)
+	{
+	}
+
+	bridge &operator=(const bridge &) = default;
+	bridge &operator=(bridge &&) = default;
+
 	bridge_type type;
-	uint32_t sheet, ladder;
-	std::set<bridge *> link;
-	std::deque<uint32_t> i, j;
-	std::string chainI, chainJ;
+	uint32_t sheet = 0, ladder = 0;
+	// Vectors rather than deques, moving a deque allocates. Ladders are
+	// short, inserting at the front of j is cheap.
+	std::pmr::vector<uint32_t> i, j;
+	const std::string *chainI = nullptr, *chainJ = nullptr;	// interned, see string_pool
 
-	bool operator<(const bridge &b) const { return chainI < b.chainI or (chainI == b.chainI and i.front() < b.i.front()); }
+	bool operator<(const bridge &b) const { return *chainI < *b.chainI or (chainI == b.chainI and i.front() < b.i.front()); }
 };
 
+static_assert(std::is_nothrow_move_constructible_v<bridge>);
+
 struct bridge_partner
 {
 	residue *m_residue;
@@ -253,22 +471,175 @@ const float
 	kRadiusSideAtom = 1.8f,
 	kRadiusWater = 1.4f;
 
+class accumulator;
+class MSurfaceDots;
+struct surface_scratch;
+
+// Strings that occur many times, like the chain and compound IDs, are
+// stored only once. Interned strings are equal when their addresses are.
+class string_pool
+{
+  public:
+	const std::string *intern(std::string_view s)
+	{
+		auto i = mIndex.find(s);
+		if (i == mIndex.end())
+		{
+			auto &str = mStrings.emplace_back(s);
+			i = mIndex.emplace(str, &str).first;
+		}
+
+		return i->second;
+	}
+
+  private:
+	std::deque<std::string> mStrings;
+	std::unordered_map<std::string_view, const std::string *> mIndex;
+};
+
+// --------------------------------------------------------------------
+// Loading atom_site. The columns are looked up once, values are used as
+// text where possible to avoid creating strings for each atom.
+
+struct atom_site_columns
+{
+	atom_site_columns(const cif::category &atom_site)
+		: asym_id(atom_site.get_item_ix("label_asym_id"))
+		, comp_id(atom_site.get_item_ix("label_comp_id"))
+		, atom_id(atom_site.get_item_ix("label_atom_id"))
+		, alt_id(atom_site.get_item_ix("label_alt_id"))
+		, type_symbol(atom_site.get_item_ix("type_symbol"))
+		, seq_id(atom_site.get_item_ix("label_seq_id"))
+		, model_nr(atom_site.get_item_ix("pdbx_PDB_model_num"))
+		, x(atom_site.get_item_ix("Cartn_x"))
+		, y(atom_site.get_item_ix("Cartn_y"))
+		, z(atom_site.get_item_ix("Cartn_z"))
+		, auth_asym_id(atom_site.get_item_ix("auth_asym_id"))
+		, auth_seq_id(atom_site.get_item_ix("auth_seq_id"))
+	{
+	}
+
+	uint16_t asym_id, comp_id, atom_id, alt_id, type_symbol, seq_id, model_nr, x, y, z, auth_asym_id, auth_seq_id;
+};
+
+// --------------------------------------------------------------------
+// Reading only the data used by DSSP_impl, keep these lists in sync with
+// the categories it reads and with atom_site_columns.
+
+const std::vector<std::string_view> kRequiredCategories = {
+	"atom_site", "audit_author", "database_PDB_rev", "entity", "entity_name_com", "entity_poly", "entity_src_gen",
+	"entity_src_nat", "pdbx_database_status", "pdbx_poly_seq_scheme", "struct_conn", "struct_keywords"
+};
+
+// id is kept as it is the key of atom_site
+const std::vector<std::string_view> kRequiredAtomSiteItems = {
+	"id", "label_asym_id", "label_comp_id", "label_atom_id", "label_alt_id", "type_symbol", "label_seq_id",
+	"pdbx_PDB_model_num", "Cartn_x", "Cartn_y", "Cartn_z", "auth_asym_id", "auth_seq_id"
+};
+
+class required_categories_parser : public cif::parser
+{
+  public:
+	required_categories_parser(std::istream &is, cif::file &file)
+		: cif::parser(is, file)
+	{
+	}
+
+	void produce_category(std::string_view name) override
+	{
+		m_skip = std::find_if(std::begin(kRequiredCategories), std::end(kRequiredCategories),
+					 [name](std::string_view c) { return cif::iequals(c, name); }) == std::end(kRequiredCategories);
+		m_atom_site = cif::iequals(name, "atom_site");
+
+		if (not m_skip)
+			cif::parser::produce_category(name);
+	}
+
+	void produce_row() override
+	{
+		if (not m_skip)
+			cif::parser::produce_row();
+	}
+
+	void produce_item(std::string_view category, std::string_view item, std::string_view value) override
+	{
+		if (m_skip)
+			return;
+
+		if (m_atom_site and std::find_if(std::begin(kRequiredAtomSiteItems), std::end(kRequiredAtomSiteItems),
+								[item](std::string_view i) { return cif::iequals(i, item); }) == std::end(kRequiredAtomSiteItems))
+			return;
+
+		cif::parser::produce_item(category, item, value);
+	}
+
+  private:
+	bool m_skip = false, m_atom_site = false;
+};
+
+// --------------------------------------------------------------------
+
+// The text of an item, empty for null values, like as<std::string>()
+inline std::string_view ItemText(const cif::item_handle &item)
+{
+	std::string_view result = item.text();
+	if (result == "." or result == "?")
+		result = {};
+	return result;
+}
+
+// Atom names packed in an integer, to compare them in a switch. Names longer
+// than four characters never match any of the names used.
+constexpr uint32_t AtomKey(std::string_view name)
+{
+	uint32_t result = 0;
+	if (name.length() > 4)
+		result = std::numeric_limits<uint32_t>::max();
+	else
+	{
+		for (char ch : name)
+			result = (result << 8) bitor static_cast<uint8_t>(ch);
+	}
+	return result;
+}
+
+// Where residue::addAtom stored the coordinates of an atom. Atoms that are
+// not used have slot kNoSlot, side chain atoms have kSlotSideChain plus
+// their index in mSideChain.
+enum atom_slot_type : int16_t
+{
+	kSlotOtherModel = -2,	// atom belongs to another model
+	kNoSlot = -1,
+	kSlotCA,
+	kSlotC,
+	kSlotN,
+	kSlotO,
+	kSlotSideChain
+};
+
+struct atom_slot
+{
+	int16_t slot = kNoSlot;
+	int8_t chiral = -1;	// index in m_chiralAtoms, if any
+};
+
 struct dssp::residue
 {
 	residue(residue &&) = default;
 	residue &operator=(residue &&) = default;
 
 	residue(int model_nr,
-		std::string_view pdb_strand_id, int pdb_seq_num, std::string_view pdb_ins_code)
-		: mPDBStrandID(pdb_strand_id)
+		std::string_view pdb_strand_id, int pdb_seq_num, std::string_view pdb_ins_code, string_pool &ioStrings)
+		: mChainBreak(chain_break_type::None)
+		, mPDBStrandID(ioStrings.intern(pdb_strand_id))
 		, mPDBSeqNum(pdb_seq_num)
-		, mPDBInsCode(pdb_ins_code)
-		, mChainBreak(chain_break_type::None)
+		, mPDBInsCode(ioStrings.intern(pdb_ins_code))
 		, m_model_nr(model_nr)
 	{
+		mAsymID = mCompoundID = mAltID = mAuthAsymID = ioStrings.intern("");
+
 		// update the box containing all atoms
-		mBox[0].mX = mBox[0].mY = mBox[0].mZ = std::numeric_limits<float>::max();
-		mBox[1].mX = mBox[1].mY = mBox[1].mZ = -std::numeric_limits<float>::max();
+		resetBox();
 
 		mH = point{ std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
 
@@ -276,98 +647,223 @@ struct dssp::residue
 			p = {};
 	}
 
-	void addAtom(cif::row_handle atom)
+	// Side chain atoms are not stored here, their ID and location are
+	// returned in \a outAtomID and \a outLocation for DSSP_impl to store in
+	// its side chain arena. Which is then passed to setSideChain. When
+	// \a inSideChains is false the side chain atoms are skipped altogether.
+	atom_slot addAtom(cif::row_handle atom, const atom_site_columns &inColumns, string_pool &ioStrings, bool inSideChains,
+		const std::string *&outAtomID, point &outLocation)
 	{
-		std::string asymID, compID, atomID, type, authAsymID;
-		std::optional<std::string> altID;
-		int seqID, authSeqID;
-		std::optional<int> model;
-		float x, y, z;
+		atom_slot result;
 
-		cif::tie(asymID, compID, atomID, altID, type, seqID, model, x, y, z, authAsymID, authSeqID) =
-			atom.get("label_asym_id", "label_comp_id", "label_atom_id", "label_alt_id", "type_symbol", "label_seq_id",
-				"pdbx_PDB_model_num", "Cartn_x", "Cartn_y", "Cartn_z",
-				"auth_asym_id", "auth_seq_id");
-
-		if (model and model != m_model_nr)
-			return;
+		if (auto model = atom[inColumns.model_nr].as<std::optional<int>>(); model and model != m_model_nr)
+			return { kSlotOtherModel };
 
 		if (m_seen == 0)
 		{
-			mAsymID = asymID;
-			mCompoundID = compID;
-			mSeqID = seqID;
+			mAsymID = ioStrings.intern(ItemText(atom[inColumns.asym_id]));
+			mCompoundID = ioStrings.intern(ItemText(atom[inColumns.comp_id]));
+			mSeqID = atom[inColumns.seq_id].as<int>();
 
-			mAuthSeqID = authSeqID;
-			mAuthAsymID = authAsymID;
+			mAuthSeqID = atom[inColumns.auth_seq_id].as<int>();
+			mAuthAsymID = ioStrings.intern(ItemText(atom[inColumns.auth_asym_id]));
 
-			mType = MapResidue(mCompoundID);
+			mType = MapResidue(*mCompoundID);
 
-			if (altID)
-				mAltID = *altID;
+			if (auto altID = atom[inColumns.alt_id].as<std::optional<std::string>>(); altID)
+				mAltID = ioStrings.intern(*altID);
 		}
 
-		if (atomID == "CA")
-		{
-			m_seen |= 1;
-			mCAlpha = { x, y, z };
-			ExtendBox(mCAlpha, kRadiusCA + 2 * kRadiusWater);
+		auto atomID = ItemText(atom[inColumns.atom_id]);
+		auto atomKey = AtomKey(atomID);
 
-			if (mType == kValine)
-				m_chiralAtoms[1] = mCAlpha;
-		}
-		else if (atomID == "C")
+		switch (atomKey)
 		{
-			m_seen |= 2;
-			mC = { x, y, z };
-			ExtendBox(mC, kRadiusC + 2 * kRadiusWater);
-		}
-		else if (atomID == "N")
-		{
-			m_seen |= 4;
-			mH = mN = { x, y, z };
-			ExtendBox(mN, kRadiusN + 2 * kRadiusWater);
+			case AtomKey("CA"):
+				m_seen |= 1;
+				result.slot = kSlotCA;
+
+				if (mType == kValine and inSideChains)
+					result.chiral = 1;
+				break;
+
+			case AtomKey("C"):
+				m_seen |= 2;
+				result.slot = kSlotC;
+				break;
+
+			case AtomKey("N"):
+				m_seen |= 4;
+				result.slot = kSlotN;
+				break;
+
+			case AtomKey("O"):
+				m_seen |= 8;
+				result.slot = kSlotO;
+				break;
+
+			default:
+				if (ItemText(atom[inColumns.type_symbol]) == "H")
+					break;
+
+				m_seen |= 16;
+				if (not inSideChains)
+					break;
+
+				result.slot = static_cast<int16_t>(kSlotSideChain + mSideChainSize++);
+				outAtomID = ioStrings.intern(atomID);
+
+				if (mType == kLeucine)
+				{
+					switch (atomKey)
+					{
+						case AtomKey("CG"): result.chiral = 0; break;
+						case AtomKey("CB"): result.chiral = 1; break;
+						case AtomKey("CD1"): result.chiral = 2; break;
+						case AtomKey("CD2"): result.chiral = 3; break;
+					}
+				}
+				else if (mType == kValine)
+				{
+					switch (atomKey)
+					{
+						case AtomKey("CB"): result.chiral = 0; break;
+						case AtomKey("CG1"): result.chiral = 2; break;
+						case AtomKey("CG2"): result.chiral = 3; break;
+					}
+				}
+				break;
 		}
-		else if (atomID == "O")
+
+		if (result.slot != kNoSlot)
 		{
-			m_seen |= 8;
-			mO = { x, y, z };
-			ExtendBox(mO, kRadiusO + 2 * kRadiusWater);
+			point location{ atom[inColumns.x].as<float>(), atom[inColumns.y].as<float>(), atom[inColumns.z].as<float>() };
+
+			if (result.slot < kSlotSideChain)
+				setAtom(result, location);
+			else
+				outLocation = location;
 		}
-		else if (type != "H")
+
+		return result;
+	}
+
+	// Use the side chain storage at \a inAtoms and \a inAtomIDs, both with
+	// room for the number of side chain atoms counted by addAtom
+	void setSideChain(point *inAtoms, const std::string **inAtomIDs)
+	{
+		mSideChain = inAtoms;
+		mSideChainIDs = inAtomIDs;
+	}
+
+	const point *SideChainBegin() const { return mSideChain; }
+	const point *SideChainEnd() const { return mSideChain + mSideChainSize; }
+
+	// Store the coordinates for an atom previously added with addAtom
+	void setAtom(atom_slot inSlot, const point &p)
+	{
+		switch (inSlot.slot)
 		{
-			m_seen |= 16;
-			mSideChain.emplace_back(atomID, point{ x, y, z });
-			ExtendBox(point{ x, y, z }, kRadiusSideAtom + 2 * kRadiusWater);
+			case kSlotOtherModel:
+			case kNoSlot:
+				return;
 
-			if (mType == kLeucine)
-			{
-				if (atomID == "CG")
-					m_chiralAtoms[0] = { x, y, z };
-				else if (atomID == "CB")
-					m_chiralAtoms[1] = { x, y, z };
-				else if (atomID == "CD1")
-					m_chiralAtoms[2] = { x, y, z };
-				else if (atomID == "CD2")
-					m_chiralAtoms[3] = { x, y, z };
-			}
-			else if (mType == kValine)
-			{
-				if (atomID == "CB")
-					m_chiralAtoms[0] = { x, y, z };
-				else if (atomID == "CG1")
-					m_chiralAtoms[2] = { x, y, z };
-				else if (atomID == "CG2")
-					m_chiralAtoms[3] = { x, y, z };
-			}
+			case kSlotCA:
+				mCAlpha = p;
+				ExtendBox(mCAlpha, kRadiusCA + 2 * kRadiusWater);
+				break;
+
+			case kSlotC:
+				mC = p;
+				ExtendBox(mC, kRadiusC + 2 * kRadiusWater);
+				break;
+
+			case kSlotN:
+				mH = mN = p;
+				ExtendBox(mN, kRadiusN + 2 * kRadiusWater);
+				break;
+
+			case kSlotO:
+				mO = p;
+				ExtendBox(mO, kRadiusO + 2 * kRadiusWater);
+				break;
+
+			default:
+				mSideChain[inSlot.slot - kSlotSideChain] = p;
+				ExtendBox(p, kRadiusSideAtom + 2 * kRadiusWater);
+				break;
 		}
+
+		if (inSlot.chiral >= 0)
+			m_chiralAtoms[inSlot.chiral] = p;
 	}
 
-	void finish()
+	// Prepare for a new set of coordinates, the atoms are then set using setAtom
+	void resetBox()
+	{
+		mBox[0].mX = mBox[0].mY = mBox[0].mZ = std::numeric_limits<float>::max();
+		mBox[1].mX = mBox[1].mY = mBox[1].mZ = -std::numeric_limits<float>::max();
+	}
+
+	// Reset everything that is calculated from the coordinates
+	void resetCalculated()
+	{
+		resetStructure();
+
+		mAccessibility = 0;
+
+		resetHBonds();
+	}
+
+	void resetHBonds()
+	{
+		for (auto &hb : mHBondDonor)
+			hb = {};
+		for (auto &hb : mHBondAcceptor)
+			hb = {};
+	}
+
+	// Reset the angles and the secondary structure, but not the H-bonds
+	// and accessibility which are expensive to calculate
+	void resetStructure()
+	{
+		mAnglesCalculated = false;
+		mAlpha.reset();
+		mKappa.reset();
+		mPhi.reset();
+		mPsi.reset();
+		mTCO.reset();
+		mOmega.reset();
+
+		mSSBridgeNr = 0;
+		mSecondaryStructure = structure_type::Loop;
+
+		for (auto &bp : mBetaPartner)
+			bp = {};
+
+		mSheet = 0;
+		mStrand = 0;
+		for (auto &flag : mHelixFlags)
+			flag = helix_position_type::None;
+		mBend = false;
+		mChainBreak = chain_break_type::None;
+	}
+
+	// A residue is complete when it has all its backbone atoms
+	bool isComplete() const
 	{
 		const int kSeenAll = (1 bitor 2 bitor 4 bitor 8);
-		mComplete = (m_seen bitand kSeenAll) == kSeenAll;
+		return (m_seen bitand kSeenAll) == kSeenAll;
+	}
 
+	// The angles the secondary structure does not depend on. These are stored
+	// by calculateGeometry when requested, otherwise calculated on access.
+	std::optional<float> CalculateAlpha() const;
+	std::optional<float> CalculateTCO() const;
+	std::optional<float> CalculateOmega() const;
+
+	void finish()
+	{
 		if (mType == kValine or mType == kLeucine)
 			mChiralVolume = dot_product(m_chiralAtoms[1] - m_chiralAtoms[0],
 				cross_product(m_chiralAtoms[2] - m_chiralAtoms[0], m_chiralAtoms[3] - m_chiralAtoms[0]));
@@ -463,8 +959,10 @@ struct dssp::residue
 		return mSSBridgeNr;
 	}
 
-	float CalculateSurface(const std::vector<residue> &inResidues);
-	float CalculateSurface(const point &inAtom, float inRadius, const std::vector<residue *> &inNeighbours);
+	float CalculateSurface(const std::vector<residue> &inResidues, const spatial_index &inIndex, float inMaxRadius, const MSurfaceDots &inDots,
+		surface_scratch &ioScratch);
+	float CalculateSurface(const point &inAtom, float inRadius, const std::vector<residue *> &inNeighbours, const MSurfaceDots &inDots,
+		accumulator &accumulate);
 
 	bool AtomIntersectsBox(const point &atom, float inRadius) const
 	{
@@ -506,63 +1004,119 @@ struct dssp::residue
 			return mH;
 		else
 		{
-			for (const auto &[n, p] : mSideChain)
+			for (uint32_t i = 0; i < mSideChainSize; ++i)
 			{
-				if (n == name)
-					return p;
+				if (*mSideChainIDs[i] == name)
+					return mSideChain[i];
 			}
 		}
 
 		return {};
 	}
 
+	// The fields used by the H-bond, bridge and helix passes come first, the
+	// fields used for the accessibility next and the rest last.
+
 	residue *mNext = nullptr;
 	residue *mPrev = nullptr;
 
-	// const Monomer &mM;
+	point mCAlpha, mC, mN, mO, mH;
+	HBond mHBondDonor[2] = {}, mHBondAcceptor[2] = {};
+	bridge_partner mBetaPartner[2] = {};
 
-	std::string mAsymID;
+	const std::string *mAsymID;
 	int mSeqID;
-	std::string mCompoundID;
-	std::string mAltID;
 	int mNumber;
-	bool mComplete = false;
-
-	std::string mAuthAsymID;
-	int mAuthSeqID;
+	uint32_t mSheet = 0;
+	uint32_t mStrand = 0;	// Added to ease the writing of mmCIF's struct_sheet and friends
 
-	std::string mPDBStrandID;
-	int mPDBSeqNum;
-	std::string mPDBInsCode;
+	residue_type mType;
+	structure_type mSecondaryStructure = structure_type::Loop;
+	helix_position_type mHelixFlags[4] = { helix_position_type::None, helix_position_type::None, helix_position_type::None, helix_position_type::None }; //
+	bool mBend = false;
+	chain_break_type mChainBreak = chain_break_type::None;
+	uint8_t mSSBridgeNr = 0;
 
-	point mCAlpha, mC, mN, mO, mH;
 	point mBox[2] = {};
 	float mRadius;
 	point mCenter;
-	std::vector<std::tuple<std::string, point>> mSideChain;
+	point *mSideChain = nullptr;
+	uint32_t mSideChainSize = 0;
 	float mAccessibility = 0;
-	float mChiralVolume = 0;
 
 	// float mAlpha = 360, mKappa = 360, mPhi = 360, mPsi = 360, mTCO = 0, mOmega = 360;
 	std::optional<float> mAlpha, mKappa, mPhi, mPsi, mTCO, mOmega;
+	bool mAnglesCalculated = false;	// alpha, tco and omega, see CalculateAlpha
+	float mChiralVolume = 0;
 
-	residue_type mType;
-	uint8_t mSSBridgeNr = 0;
-	structure_type mSecondaryStructure = structure_type::Loop;
-	HBond mHBondDonor[2] = {}, mHBondAcceptor[2] = {};
-	bridge_partner mBetaPartner[2] = {};
-	uint32_t mSheet = 0;
-	uint32_t mStrand = 0;	// Added to ease the writing of mmCIF's struct_sheet and friends
-	helix_position_type mHelixFlags[4] = { helix_position_type::None, helix_position_type::None, helix_position_type::None, helix_position_type::None }; //
-	bool mBend = false;
-	chain_break_type mChainBreak = chain_break_type::None;
+	const std::string **mSideChainIDs = nullptr;
+	const std::string *mCompoundID;
+	const std::string *mAltID;
+	const std::string *mAuthAsymID;
+	int mAuthSeqID;
+	const std::string *mPDBStrandID;
+	int mPDBSeqNum;
+	const std::string *mPDBInsCode;
 
 	int m_seen = 0, m_model_nr = 0;
-	std::array<point, 4> m_chiralAtoms;
+	std::array<point, 4> m_chiralAtoms = {};
 };
 
 // --------------------------------------------------------------------
 
+// The sorted candidates of an accumulator in SoA layout, padded to a
+// multiple of kLanes with entries that never occlude a dot. The storage
+// is kept between calls to avoid reallocating it for every atom.
+//
+// The radius is rounded down to the nearest float. For a float distance d
+// and a double radius r, (r < d) is true if and only if (float(r) < d) with
+// float(r) the largest float not above r. So the occlusion test can be
+// done in single precision with exactly the same outcome.
+
+class candidate_block
+{
+  public:
+	static constexpr size_t kLanes = 8;
+
+	void resize(size_t inSize)
+	{
+		mSize = inSize;
+		mPaddedSize = (inSize + kLanes - 1) / kLanes * kLanes;
+
+		mData.resize(4 * mPaddedSize);
+
+		for (size_t i = mSize; i < mPaddedSize; ++i)
+		{
+			mData[i] = mData[mPaddedSize + i] = mData[2 * mPaddedSize + i] = 0;
+			mData[3 * mPaddedSize + i] = -std::numeric_limits<float>::infinity();
+		}
+	}
+
+	void set(size_t inIx, const point &inLocation, double inRadius)
+	{
+		float r = static_cast<float>(inRadius);
+		if (r > inRadius)
+			r = std::nextafter(r, -std::numeric_limits<float>::infinity());
+
+		mData[inIx] = inLocation.mX;
+		mData[mPaddedSize + inIx] = inLocation.mY;
+		mData[2 * mPaddedSize + inIx] = inLocation.mZ;
+		mData[3 * mPaddedSize + inIx] = r;
+	}
+
+	size_t size() const { return mSize; }
+	size_t padded_size() const { return mPaddedSize; }
+
+	const float *x() const { return mData.data(); }
+	const float *y() const { return mData.data() + mPaddedSize; }
+	const float *z() const { return mData.data() + 2 * mPaddedSize; }
+	const float *radius() const { return mData.data() + 3 * mPaddedSize; }
+
+  private:
+	size_t mSize = 0, mPaddedSize = 0;
+	std::vector<float> mData;
+};
+
 class accumulator
 {
   public:
@@ -597,19 +1151,33 @@ class accumulator
 		}
 	}
 
+	void clear()
+	{
+		m_x.clear();
+	}
+
 	void sort()
 	{
 		sort_heap(m_x.begin(), m_x.end());
+
+		m_block.resize(m_x.size());
+		for (size_t i = 0; i < m_x.size(); ++i)
+			m_block.set(i, m_x[i].location, m_x[i].radius);
 	}
 
 	std::vector<candidate> m_x;
+	candidate_block m_block;
+
+	// The number of atoms and dots tested, not reset by clear
+	uint64_t m_atoms = 0, m_dots = 0;
 };
 
 // we use a fibonacci sphere to calculate the even distribution of the dots
 class MSurfaceDots
 {
   public:
-	static MSurfaceDots &Instance();
+	// The sphere with (at least) \a inDots dots, built once for each resolution
+	static const MSurfaceDots &Instance(size_t inDots = dssp::kDefaultSurfaceDots);
 
 	size_t size() const { return mPoints.size(); }
 	const point &operator[](size_t inIx) const { return mPoints[inIx]; }
@@ -622,12 +1190,26 @@ class MSurfaceDots
 	double mWeight;
 };
 
-MSurfaceDots &MSurfaceDots::Instance()
+const MSurfaceDots &MSurfaceDots::Instance(size_t inDots)
 {
-	const int32_t kN = 200;
+	// The number of dots is always odd, 2 * N + 1
+	const int32_t N = static_cast<int32_t>(inDots / 2);
+
+	static MSurfaceDots sDefault(static_cast<int32_t>(dssp::kDefaultSurfaceDots / 2));
+	if (N == static_cast<int32_t>(dssp::kDefaultSurfaceDots / 2))
+		return sDefault;
 
-	static MSurfaceDots sInstance(kN);
-	return sInstance;
+	// The tables are never removed, references to them stay valid
+	static std::mutex sMutex;
+	static std::map<int32_t, std::unique_ptr<MSurfaceDots>> sTables;
+
+	std::unique_lock lock(sMutex);
+
+	auto &table = sTables[N];
+	if (not table)
+		table.reset(new MSurfaceDots(N));
+
+	return *table;
 }
 
 MSurfaceDots::MSurfaceDots(int32_t N)
@@ -647,9 +1229,90 @@ MSurfaceDots::MSurfaceDots(int32_t N)
 	}
 }
 
-float residue::CalculateSurface(const point &inAtom, float inRadius, const std::vector<residue *> &inNeighbours)
+// --------------------------------------------------------------------
+// The occlusion test, count the surface dots at radius inRadius that are
+// not inside any of the candidates. The scalar version is the reference,
+// the vectorized versions must return exactly the same counts.
+
+using count_free_dots_func = size_t (*)(const MSurfaceDots &inDots, float inRadius, const candidate_block &inCandidates);
+
+size_t CountFreeDotsScalar(const MSurfaceDots &inDots, float inRadius, const candidate_block &inCandidates)
 {
-	accumulator accumulate;
+	size_t result = 0;
+
+	for (size_t i = 0; i < inDots.size(); ++i)
+	{
+		point xx = inDots[i] * inRadius;
+
+		bool free = true;
+		for (size_t k = 0; free and k < inCandidates.size(); ++k)
+			free = inCandidates.radius()[k] < distance_sq(xx, point{ inCandidates.x()[k], inCandidates.y()[k], inCandidates.z()[k] });
+
+		if (free)
+			++result;
+	}
+
+	return result;
+}
+
+#if DSSP_HAVE_AVX2_KERNELS
+// Tests eight candidates at a time. Note that we do not use FMA, that would
+// round differently from the scalar code.
+__attribute__((target("avx2")))
+size_t CountFreeDotsAVX2(const MSurfaceDots &inDots, float inRadius, const candidate_block &inCandidates)
+{
+	size_t result = 0;
+	size_t n = inCandidates.padded_size();
+
+	const float *cx = inCandidates.x();
+	const float *cy = inCandidates.y();
+	const float *cz = inCandidates.z();
+	const float *cr = inCandidates.radius();
+
+	for (size_t i = 0; i < inDots.size(); ++i)
+	{
+		point xx = inDots[i] * inRadius;
+
+		__m256 px = _mm256_set1_ps(xx.mX);
+		__m256 py = _mm256_set1_ps(xx.mY);
+		__m256 pz = _mm256_set1_ps(xx.mZ);
+
+		bool free = true;
+		for (size_t k = 0; free and k < n; k += candidate_block::kLanes)
+		{
+			__m256 dx = _mm256_sub_ps(px, _mm256_loadu_ps(cx + k));
+			__m256 dy = _mm256_sub_ps(py, _mm256_loadu_ps(cy + k));
+			__m256 dz = _mm256_sub_ps(pz, _mm256_loadu_ps(cz + k));
+
+			__m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+
+			// occluded when not (radius < distance)
+			__m256 occluded = _mm256_cmp_ps(_mm256_loadu_ps(cr + k), d, _CMP_NLT_UQ);
+			free = _mm256_movemask_ps(occluded) == 0;
+		}
+
+		if (free)
+			++result;
+	}
+
+	return result;
+}
+#endif
+
+count_free_dots_func SelectCountFreeDotsKernel()
+{
+#if DSSP_HAVE_AVX2_KERNELS
+	if (CPUSupportsAVX2())
+		return &CountFreeDotsAVX2;
+#endif
+
+	return &CountFreeDotsScalar;
+}
+
+float residue::CalculateSurface(const point &inAtom, float inRadius, const std::vector<residue *> &inNeighbours, const MSurfaceDots &inDots,
+	accumulator &accumulate)
+{
+	accumulate.clear();
 
 	for (auto r : inNeighbours)
 	{
@@ -660,8 +1323,8 @@ float residue::CalculateSurface(const point &inAtom, float inRadius, const std::
 			accumulate(inAtom, r->mC, inRadius, kRadiusC);
 			accumulate(inAtom, r->mO, inRadius, kRadiusO);
 
-			for (const auto &[name, atom] : r->mSideChain)
-				accumulate(inAtom, atom, inRadius, kRadiusSideAtom);
+			for (auto atom = r->SideChainBegin(); atom != r->SideChainEnd(); ++atom)
+				accumulate(inAtom, *atom, inRadius, kRadiusSideAtom);
 		}
 	}
 
@@ -670,29 +1333,77 @@ float residue::CalculateSurface(const point &inAtom, float inRadius, const std::
 	float radius = inRadius + kRadiusWater;
 	float surface = 0;
 
-	MSurfaceDots &surfaceDots = MSurfaceDots::Instance();
-
-	for (size_t i = 0; i < surfaceDots.size(); ++i)
-	{
-		point xx = surfaceDots[i] * radius;
+	static const count_free_dots_func sCountFreeDots = SelectCountFreeDotsKernel();
+	size_t freeDots = sCountFreeDots(inDots, radius, accumulate.m_block);
 
-		bool free = true;
-		for (size_t k = 0; free and k < accumulate.m_x.size(); ++k)
-			free = accumulate.m_x[k].radius < distance_sq(xx, accumulate.m_x[k].location);
+	accumulate.m_atoms += accumulate.m_x.size();
+	accumulate.m_dots += inDots.size();
 
-		if (free)
-			surface += static_cast<float>(surfaceDots.weight());
-	}
+	// add the weights one by one, as before, to get the same rounding
+	for (size_t i = 0; i < freeDots; ++i)
+		surface += static_cast<float>(inDots.weight());
 
 	return surface * radius * radius;
 }
 
-float residue::CalculateSurface(const std::vector<residue> &inResidues)
+// Scratch space for the surface calculation of a single residue
+struct surface_scratch
 {
+	std::vector<uint32_t> candidates;
 	std::vector<residue *> neighbours;
+	accumulator accumulate;
+};
 
-	for (auto &r : inResidues)
+// The buffers used by CalculateAccessibilities, kept to be reused. Each
+// residue takes one of the scratch spaces from the pool while calculating.
+class surface_workspace
+{
+  public:
+	std::unique_ptr<surface_scratch> acquire()
+	{
+		std::unique_lock lock(mMutex);
+		if (mPool.empty())
+			return std::make_unique<surface_scratch>();
+
+		auto result = std::move(mPool.back());
+		mPool.pop_back();
+		return result;
+	}
+
+	void release(std::unique_ptr<surface_scratch> scratch)
+	{
+		std::unique_lock lock(mMutex);
+		mPool.push_back(std::move(scratch));
+	}
+
+	std::vector<point> mCenters;
+	spatial_index mIndex;
+
+  private:
+	std::mutex mMutex;
+	std::vector<std::unique_ptr<surface_scratch>> mPool;
+};
+
+float residue::CalculateSurface(const std::vector<residue> &inResidues, const spatial_index &inIndex, float inMaxRadius, const MSurfaceDots &inDots,
+	surface_scratch &ioScratch)
+{
+	auto &candidates = ioScratch.candidates;
+	candidates.clear();
+
+	// No residue can overlap unless its center is within our radius plus the largest radius
+	inIndex.for_each_in_range(mCenter, mRadius + inMaxRadius, [&candidates](uint32_t i)
+		{ candidates.push_back(i); });
+
+	// keep the neighbours in the order of the residues
+	std::sort(candidates.begin(), candidates.end());
+
+	auto &neighbours = ioScratch.neighbours;
+	neighbours.clear();
+
+	for (uint32_t i : candidates)
 	{
+		auto &r = inResidues[i];
+
 		point center = r.mCenter;
 		float radius = r.mRadius;
 
@@ -700,99 +1411,392 @@ float residue::CalculateSurface(const std::vector<residue> &inResidues)
 			neighbours.push_back(const_cast<residue *>(&r));
 	}
 
-	mAccessibility = CalculateSurface(mN, kRadiusN, neighbours) +
-	                 CalculateSurface(mCAlpha, kRadiusCA, neighbours) +
-	                 CalculateSurface(mC, kRadiusC, neighbours) +
-	                 CalculateSurface(mO, kRadiusO, neighbours);
+	auto &accumulate = ioScratch.accumulate;
 
-	for (const auto &[name, atom] : mSideChain)
-		mAccessibility += CalculateSurface(atom, kRadiusSideAtom, neighbours);
+	mAccessibility = CalculateSurface(mN, kRadiusN, neighbours, inDots, accumulate) +
+	                 CalculateSurface(mCAlpha, kRadiusCA, neighbours, inDots, accumulate) +
+	                 CalculateSurface(mC, kRadiusC, neighbours, inDots, accumulate) +
+	                 CalculateSurface(mO, kRadiusO, neighbours, inDots, accumulate);
+
+	for (auto atom = SideChainBegin(); atom != SideChainEnd(); ++atom)
+		mAccessibility += CalculateSurface(*atom, kRadiusSideAtom, neighbours, inDots, accumulate);
 
 	return mAccessibility;
 }
 
-void CalculateAccessibilities(std::vector<residue> &inResidues, statistics &stats)
+// When \a inSubset is specified, only the accessibility of the residues in
+// it is recalculated, the others keep their previous value.
+void CalculateAccessibilities(std::vector<residue> &inResidues, statistics &stats, counters &ioCounters, size_t inThreads, surface_workspace &ioWorkspace,
+	const dssp::options &inOptions, const std::vector<uint32_t> *inSubset = nullptr)
 {
 	stats.accessible_surface = 0;
+
+	if (inResidues.empty())
+		return;
+
+	// Build an index over the residue centers once, shared by all residues
+	auto &centers = ioWorkspace.mCenters;
+	centers.clear();
+
+	float maxRadius = 0;
+	for (auto &residue : inResidues)
+	{
+		centers.emplace_back(residue.mCenter);
+		maxRadius = std::max(maxRadius, residue.mRadius);
+	}
+
+	auto &index = ioWorkspace.mIndex;
+	index.build(centers, std::max(maxRadius, 1.0f));
+
+	std::atomic<uint64_t> neighbours = 0, neighbourAtoms = 0, surfaceDots = 0;
+
+	const MSurfaceDots &dots = MSurfaceDots::Instance(inOptions.surface_dots);
+
+	const size_t count = inSubset ? inSubset->size() : inResidues.size();
+
+	// This runs next to the secondary structure calculation, a second
+	// progress bar would garble the first
+	progress_tracker progress(inOptions, "calculate accessibility", count, false);
+
+	// The cost per residue varies a lot, hence the small chunks
+	parallel_for(count, inThreads, 8, [&](size_t i)
+		{
+			auto scratch = ioWorkspace.acquire();
+			scratch->accumulate.m_atoms = scratch->accumulate.m_dots = 0;
+
+			inResidues[inSubset ? (*inSubset)[i] : i].CalculateSurface(inResidues, index, maxRadius, dots, *scratch);
+
+			neighbours.fetch_add(scratch->neighbours.size(), std::memory_order_relaxed);
+			neighbourAtoms.fetch_add(scratch->accumulate.m_atoms, std::memory_order_relaxed);
+			surfaceDots.fetch_add(scratch->accumulate.m_dots, std::memory_order_relaxed);
+
+			ioWorkspace.release(std::move(scratch));
+
+			progress.consumed(1); });
+
+	progress.finish();
+
+	ioCounters.neighbours = neighbours;
+	ioCounters.neighbour_atoms = neighbourAtoms;
+	ioCounters.surface_dots = surfaceDots;
+
+	// Sum in residue order, so the total does not depend on the scheduling
 	for (auto &residue : inResidues)
-		stats.accessible_surface += residue.CalculateSurface(inResidues);
+		stats.accessible_surface += residue.mAccessibility;
 }
 
 // --------------------------------------------------------------------
 // TODO: use the angle to improve bond energy calculation.
 
-double CalculateHBondEnergy(residue &inDonor, residue &inAcceptor)
+double CalculateHBondEnergy(const point &inDonorN, const point &inDonorH, const point &inAcceptorC, const point &inAcceptorO)
 {
-	double result = 0;
+	double result;
 
-	if (inDonor.mType != kProline)
-	{
-		double distanceHO = distance(inDonor.mH, inAcceptor.mO);
-		double distanceHC = distance(inDonor.mH, inAcceptor.mC);
-		double distanceNC = distance(inDonor.mN, inAcceptor.mC);
-		double distanceNO = distance(inDonor.mN, inAcceptor.mO);
+	double distanceHO = distance(inDonorH, inAcceptorO);
+	double distanceHC = distance(inDonorH, inAcceptorC);
+	double distanceNC = distance(inDonorN, inAcceptorC);
+	double distanceNO = distance(inDonorN, inAcceptorO);
 
-		if (distanceHO < kMinimalDistance or distanceHC < kMinimalDistance or distanceNC < kMinimalDistance or distanceNO < kMinimalDistance)
-			result = kMinHBondEnergy;
-		else
-			result = kCouplingConstant / distanceHO - kCouplingConstant / distanceHC + kCouplingConstant / distanceNC - kCouplingConstant / distanceNO;
+	if (distanceHO < kMinimalDistance or distanceHC < kMinimalDistance or distanceNC < kMinimalDistance or distanceNO < kMinimalDistance)
+		result = kMinHBondEnergy;
+	else
+		result = kCouplingConstant / distanceHO - kCouplingConstant / distanceHC + kCouplingConstant / distanceNC - kCouplingConstant / distanceNO;
 
-		// DSSP compatibility mode:
-		result = std::round(result * 1000) / 1000;
+	// DSSP compatibility mode:
+	result = std::round(result * 1000) / 1000;
 
-		if (result < kMinHBondEnergy)
-			result = kMinHBondEnergy;
-	}
+	if (result < kMinHBondEnergy)
+		result = kMinHBondEnergy;
 
-	// update donor
-	if (result < inDonor.mHBondAcceptor[0].energy)
+	return result;
+}
+
+// Store the H-bond if it is one of the best two for donor and acceptor
+// Keep the two best bonds in \a ioBonds
+void StoreHBond(HBond (&ioBonds)[2], residue &inPartner, double result)
+{
+	if (result < ioBonds[0].energy)
 	{
-		inDonor.mHBondAcceptor[1] = inDonor.mHBondAcceptor[0];
-		inDonor.mHBondAcceptor[0].res = &inAcceptor;
-		inDonor.mHBondAcceptor[0].energy = result;
+		ioBonds[1] = ioBonds[0];
+		ioBonds[0].res = &inPartner;
+		ioBonds[0].energy = result;
 	}
-	else if (result < inDonor.mHBondAcceptor[1].energy)
+	else if (result < ioBonds[1].energy)
 	{
-		inDonor.mHBondAcceptor[1].res = &inAcceptor;
-		inDonor.mHBondAcceptor[1].energy = result;
+		ioBonds[1].res = &inPartner;
+		ioBonds[1].energy = result;
 	}
+}
+
+void UpdateHBond(residue &inDonor, residue &inAcceptor, double result)
+{
+	// update donor
+	StoreHBond(inDonor.mHBondAcceptor, inAcceptor, result);
 
 	// and acceptor
-	if (result < inAcceptor.mHBondDonor[0].energy)
+	StoreHBond(inAcceptor.mHBondDonor, inDonor, result);
+}
+
+double CalculateHBondEnergy(residue &inDonor, residue &inAcceptor)
+{
+	double result = 0;
+
+	if (inDonor.mType != kProline)
+		result = CalculateHBondEnergy(inDonor.mN, inDonor.mH, inAcceptor.mC, inAcceptor.mO);
+
+	UpdateHBond(inDonor, inAcceptor, result);
+
+	return result;
+}
+
+// --------------------------------------------------------------------
+// Batched H-bond energies. The coordinates needed are copied into SoA
+// arrays once, the energies for a batch of (donor, acceptor) pairs are
+// then calculated in parallel and vectorized. The scalar kernel is the
+// reference, the vectorized kernel must give exactly the same energies.
+
+struct hbond_coordinates
+{
+	void assign(const std::vector<residue> &inResidues)
 	{
-		inAcceptor.mHBondDonor[1] = inAcceptor.mHBondDonor[0];
-		inAcceptor.mHBondDonor[0].res = &inDonor;
-		inAcceptor.mHBondDonor[0].energy = result;
+		for (auto v : { &mNX, &mNY, &mNZ, &mHX, &mHY, &mHZ, &mCX, &mCY, &mCZ, &mOX, &mOY, &mOZ })
+			v->clear();
+		mProline.clear();
+
+		for (auto &r : inResidues)
+		{
+			mNX.push_back(r.mN.mX);
+			mNY.push_back(r.mN.mY);
+			mNZ.push_back(r.mN.mZ);
+			mHX.push_back(r.mH.mX);
+			mHY.push_back(r.mH.mY);
+			mHZ.push_back(r.mH.mZ);
+			mCX.push_back(r.mC.mX);
+			mCY.push_back(r.mC.mY);
+			mCZ.push_back(r.mC.mZ);
+			mOX.push_back(r.mO.mX);
+			mOY.push_back(r.mO.mY);
+			mOZ.push_back(r.mO.mZ);
+			mProline.push_back(r.mType == kProline);
+		}
 	}
-	else if (result < inAcceptor.mHBondDonor[1].energy)
+
+	point N(uint32_t i) const { return { mNX[i], mNY[i], mNZ[i] }; }
+	point H(uint32_t i) const { return { mHX[i], mHY[i], mHZ[i] }; }
+	point C(uint32_t i) const { return { mCX[i], mCY[i], mCZ[i] }; }
+	point O(uint32_t i) const { return { mOX[i], mOY[i], mOZ[i] }; }
+
+	std::vector<float> mNX, mNY, mNZ, mHX, mHY, mHZ, mCX, mCY, mCZ, mOX, mOY, mOZ;
+	std::vector<int32_t> mProline;
+};
+
+// The buffers used by CalculateHBondEnergies, kept to be reused
+struct hbond_workspace
+{
+	hbond_coordinates coords;
+	std::vector<uint32_t> donors, acceptors;
+	std::vector<double> energies;
+};
+
+using hbond_energies_func = void (*)(const hbond_coordinates &inCoords, const uint32_t *inDonors, const uint32_t *inAcceptors, size_t inCount, double *outEnergies);
+
+void CalculateHBondEnergiesScalar(const hbond_coordinates &inCoords, const uint32_t *inDonors, const uint32_t *inAcceptors, size_t inCount, double *outEnergies)
+{
+	for (size_t k = 0; k < inCount; ++k)
 	{
-		inAcceptor.mHBondDonor[1].res = &inDonor;
-		inAcceptor.mHBondDonor[1].energy = result;
+		auto d = inDonors[k], a = inAcceptors[k];
+		outEnergies[k] = inCoords.mProline[d] ? 0 : CalculateHBondEnergy(inCoords.N(d), inCoords.H(d), inCoords.C(a), inCoords.O(a));
 	}
+}
 
-	return result;
+#if DSSP_HAVE_AVX2_KERNELS
+
+// std::round rounds halfway cases away from zero, which is not one of the
+// rounding modes of _mm256_round_pd. Truncate and correct, x - trunc(x) is exact.
+__attribute__((target("avx2")))
+inline __m256d RoundHalfAwayFromZero(__m256d x)
+{
+	const __m256d kSignMask = _mm256_set1_pd(-0.0);
+
+	__m256d t = _mm256_round_pd(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+	__m256d frac = _mm256_andnot_pd(kSignMask, _mm256_sub_pd(x, t));
+	__m256d one = _mm256_or_pd(_mm256_and_pd(kSignMask, x), _mm256_set1_pd(1.0));
+
+	return _mm256_blendv_pd(t, _mm256_add_pd(t, one), _mm256_cmp_pd(frac, _mm256_set1_pd(0.5), _CMP_GE_OQ));
+}
+
+__attribute__((target("avx2")))
+inline __m256 DistanceAVX2(__m256 ax, __m256 ay, __m256 az, __m256 bx, __m256 by, __m256 bz)
+{
+	__m256 dx = _mm256_sub_ps(ax, bx), dy = _mm256_sub_ps(ay, by), dz = _mm256_sub_ps(az, bz);
+	return _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz)));
+}
+
+// Calculate eight pairs at a time, distances in single and energies in
+// double precision, exactly as the scalar code. No FMA.
+__attribute__((target("avx2")))
+void CalculateHBondEnergiesAVX2(const hbond_coordinates &inCoords, const uint32_t *inDonors, const uint32_t *inAcceptors, size_t inCount, double *outEnergies)
+{
+	const __m256d kCoupling = _mm256_set1_pd(kCouplingConstant);
+	const __m256d kMinDistance = _mm256_set1_pd(kMinimalDistance);
+	const __m256d kMinEnergy = _mm256_set1_pd(kMinHBondEnergy);
+	const __m256d kThousand = _mm256_set1_pd(1000);
+
+	size_t k = 0;
+	for (; k + 8 <= inCount; k += 8)
+	{
+		__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(inDonors + k));
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(inAcceptors + k));
+
+		__m256 nx = _mm256_i32gather_ps(inCoords.mNX.data(), d, 4);
+		__m256 ny = _mm256_i32gather_ps(inCoords.mNY.data(), d, 4);
+		__m256 nz = _mm256_i32gather_ps(inCoords.mNZ.data(), d, 4);
+		__m256 hx = _mm256_i32gather_ps(inCoords.mHX.data(), d, 4);
+		__m256 hy = _mm256_i32gather_ps(inCoords.mHY.data(), d, 4);
+		__m256 hz = _mm256_i32gather_ps(inCoords.mHZ.data(), d, 4);
+		__m256 cx = _mm256_i32gather_ps(inCoords.mCX.data(), a, 4);
+		__m256 cy = _mm256_i32gather_ps(inCoords.mCY.data(), a, 4);
+		__m256 cz = _mm256_i32gather_ps(inCoords.mCZ.data(), a, 4);
+		__m256 ox = _mm256_i32gather_ps(inCoords.mOX.data(), a, 4);
+		__m256 oy = _mm256_i32gather_ps(inCoords.mOY.data(), a, 4);
+		__m256 oz = _mm256_i32gather_ps(inCoords.mOZ.data(), a, 4);
+		__m256i proline = _mm256_i32gather_epi32(inCoords.mProline.data(), d, 4);
+
+		__m256 distanceHO = DistanceAVX2(hx, hy, hz, ox, oy, oz);
+		__m256 distanceHC = DistanceAVX2(hx, hy, hz, cx, cy, cz);
+		__m256 distanceNC = DistanceAVX2(nx, ny, nz, cx, cy, cz);
+		__m256 distanceNO = DistanceAVX2(nx, ny, nz, ox, oy, oz);
+
+		for (int half : { 0, 1 })
+		{
+			__m256d dHO = _mm256_cvtps_pd(half ? _mm256_extractf128_ps(distanceHO, 1) : _mm256_castps256_ps128(distanceHO));
+			__m256d dHC = _mm256_cvtps_pd(half ? _mm256_extractf128_ps(distanceHC, 1) : _mm256_castps256_ps128(distanceHC));
+			__m256d dNC = _mm256_cvtps_pd(half ? _mm256_extractf128_ps(distanceNC, 1) : _mm256_castps256_ps128(distanceNC));
+			__m256d dNO = _mm256_cvtps_pd(half ? _mm256_extractf128_ps(distanceNO, 1) : _mm256_castps256_ps128(distanceNO));
+
+			__m256d tooClose = _mm256_or_pd(
+				_mm256_or_pd(_mm256_cmp_pd(dHO, kMinDistance, _CMP_LT_OQ), _mm256_cmp_pd(dHC, kMinDistance, _CMP_LT_OQ)),
+				_mm256_or_pd(_mm256_cmp_pd(dNC, kMinDistance, _CMP_LT_OQ), _mm256_cmp_pd(dNO, kMinDistance, _CMP_LT_OQ)));
+
+			__m256d e = _mm256_sub_pd(
+				_mm256_add_pd(
+					_mm256_sub_pd(_mm256_div_pd(kCoupling, dHO), _mm256_div_pd(kCoupling, dHC)),
+					_mm256_div_pd(kCoupling, dNC)),
+				_mm256_div_pd(kCoupling, dNO));
+
+			e = _mm256_blendv_pd(e, kMinEnergy, tooClose);
+
+			e = _mm256_div_pd(RoundHalfAwayFromZero(_mm256_mul_pd(e, kThousand)), kThousand);
+
+			e = _mm256_blendv_pd(e, kMinEnergy, _mm256_cmp_pd(e, kMinEnergy, _CMP_LT_OQ));
+
+			__m128i p = half ? _mm256_extracti128_si256(proline, 1) : _mm256_castsi256_si128(proline);
+			__m256d isProline = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm_cmpgt_epi32(p, _mm_setzero_si128())));
+			e = _mm256_andnot_pd(isProline, e);
+
+			_mm256_storeu_pd(outEnergies + k + 4 * half, e);
+		}
+	}
+
+	CalculateHBondEnergiesScalar(inCoords, inDonors + k, inAcceptors + k, inCount - k, outEnergies + k);
+}
+#endif
+
+hbond_energies_func SelectHBondEnergiesKernel()
+{
+#if DSSP_HAVE_AVX2_KERNELS
+	if (CPUSupportsAVX2())
+		return &CalculateHBondEnergiesAVX2;
+#endif
+
+	return &CalculateHBondEnergiesScalar;
 }
 
 // --------------------------------------------------------------------
 
-void CalculateHBondEnergies(std::vector<residue> &inResidues, std::vector<std::tuple<uint32_t, uint32_t>> &q)
+// When \a inAffected is specified, only the bonds of the residues flagged
+// in it are calculated, all other residues keep the bonds they have.
+void CalculateHBondEnergies(std::vector<residue> &inResidues, std::vector<std::tuple<uint32_t, uint32_t>> &q, size_t inThreads, hbond_workspace &ioWorkspace,
+	const dssp::options &inOptions, const std::vector<uint8_t> *inAffected = nullptr)
 {
-	std::unique_ptr<cif::progress_bar> progress;
-	if (cif::VERBOSE == 0 or cif::VERBOSE == 1)
-		progress.reset(new cif::progress_bar(q.size(), "calculate hbond energies"));
+	progress_tracker progress(inOptions, "calculate hbond energies", q.size());
 
-	for (const auto &[i, j] : q)
+	static const hbond_energies_func sCalculateEnergies = SelectHBondEnergiesKernel();
+
+	auto &coords = ioWorkspace.coords;
+	coords.assign(inResidues);
+
+	// Pairs are processed in batches to limit memory use. Each pair (i, j)
+	// results in the bond i -> j and, unless j == i + 1, in j -> i.
+	const size_t kBatchSize = 16384, kChunkSize = 1024;
+
+	auto &donors = ioWorkspace.donors;
+	auto &acceptors = ioWorkspace.acceptors;
+	auto &energies = ioWorkspace.energies;
+
+	if (inAffected != nullptr)
 	{
-		auto &ri = inResidues[i];
-		auto &rj = inResidues[j];
+		for (size_t i = 0; i < inResidues.size(); ++i)
+		{
+			if ((*inAffected)[i])
+				inResidues[i].resetHBonds();
+		}
+	}
+
+	for (size_t b = 0; b < q.size(); b += kBatchSize)
+	{
+		size_t e = std::min(q.size(), b + kBatchSize);
+
+		donors.clear();
+		acceptors.clear();
+
+		for (size_t k = b; k < e; ++k)
+		{
+			const auto &[i, j] = q[k];
+
+			if (inAffected != nullptr and not (*inAffected)[i] and not (*inAffected)[j])
+				continue;
+
+			donors.push_back(i);
+			acceptors.push_back(j);
+
+			if (j != i + 1)
+			{
+				donors.push_back(j);
+				acceptors.push_back(i);
+			}
+		}
+
+		energies.resize(donors.size());
 
-		CalculateHBondEnergy(ri, rj);
-		if (j != i + 1)
-			CalculateHBondEnergy(rj, ri);
-		
-		if (progress)
-			progress->consumed(1);
+		size_t chunks = (donors.size() + kChunkSize - 1) / kChunkSize;
+		parallel_for(chunks, inThreads, 1, [&](size_t c)
+			{
+				size_t n = std::min(kChunkSize, donors.size() - c * kChunkSize);
+				sCalculateEnergies(coords, donors.data() + c * kChunkSize, acceptors.data() + c * kChunkSize, n, energies.data() + c * kChunkSize); });
+
+		// Storing the best two bonds is done in the original order, that
+		// way the outcome for bonds with equal energies is the same as before
+		for (size_t k = 0; k < donors.size(); ++k)
+		{
+			auto &donor = inResidues[donors[k]];
+			auto &acceptor = inResidues[acceptors[k]];
+
+			if (inAffected == nullptr)
+				UpdateHBond(donor, acceptor, energies[k]);
+			else
+			{
+				if ((*inAffected)[donors[k]])
+					StoreHBond(donor.mHBondAcceptor, acceptor, energies[k]);
+				if ((*inAffected)[acceptors[k]])
+					StoreHBond(acceptor.mHBondDonor, donor, energies[k]);
+			}
+		}
+
+		progress.consumed(e - b);
 	}
+
+	progress.finish();
 }
 
 // --------------------------------------------------------------------
@@ -818,6 +1822,32 @@ bool NoChainBreak(const residue &a, const residue &b)
 
 // --------------------------------------------------------------------
 
+std::optional<float> residue::CalculateAlpha() const
+{
+	std::optional<float> result;
+	if (mPrev != nullptr and mNext != nullptr and mNext->mNext != nullptr and NoChainBreak(mPrev, mNext->mNext))
+		result = dihedral_angle(mPrev->mCAlpha, mCAlpha, mNext->mCAlpha, mNext->mNext->mCAlpha);
+	return result;
+}
+
+std::optional<float> residue::CalculateTCO() const
+{
+	std::optional<float> result;
+	if (mPrev != nullptr and NoChainBreak(mPrev, this))
+		result = cosinus_angle(mC, mO, mPrev->mC, mPrev->mO);
+	return result;
+}
+
+std::optional<float> residue::CalculateOmega() const
+{
+	std::optional<float> result;
+	if (mNext != nullptr and NoChainBreak(this, mNext))
+		result = dihedral_angle(mCAlpha, mC, mNext->mN, mNext->mCAlpha);
+	return result;
+}
+
+// --------------------------------------------------------------------
+
 bool TestBond(const residue *a, const residue *b)
 {
 	return (a->mHBondAcceptor[0].res == b and a->mHBondAcceptor[0].energy < kMaxHBondEnergy) or
@@ -856,33 +1886,38 @@ bridge_type TestBridge(const residue &r1, const residue &r2)
 }
 
 // --------------------------------------------------------------------
-// return true if any of the residues in bridge a is identical to any of the residues in bridge b
-bool Linked(const bridge &a, const bridge &b)
+
+void CalculateBetaSheets(std::vector<residue> &inResidues, statistics &stats, counters &ioCounters, std::vector<std::tuple<uint32_t, uint32_t>> &q,
+	std::pmr::memory_resource *inResource, bool inBridgePartners, const dssp::options &inOptions)
 {
-	return find_first_of(a.i.begin(), a.i.end(), b.i.begin(), b.i.end()) != a.i.end() or
-	       find_first_of(a.i.begin(), a.i.end(), b.j.begin(), b.j.end()) != a.i.end() or
-	       find_first_of(a.j.begin(), a.j.end(), b.i.begin(), b.i.end()) != a.j.end() or
-	       find_first_of(a.j.begin(), a.j.end(), b.j.begin(), b.j.end()) != a.j.end();
-}
+	progress_tracker progress(inOptions, "calculate beta sheets", q.size());
 
-// --------------------------------------------------------------------
+	// The progress is reported per chunk of pairs
+	const size_t kChunkSize = 4096;
+	size_t tested = 0;
 
-void CalculateBetaSheets(std::vector<residue> &inResidues, statistics &stats, std::vector<std::tuple<uint32_t, uint32_t>> &q)
-{
-	// if (cif::VERBOSE)
-	// 	std::cerr << "calculating beta sheets" << std::endl;
+	// Calculate Bridges. A bridge can be extended by the pair (i, j) when its
+	// last pair is (i - 1, j - 1) for parallel or (i - 1, j + 1) for
+	// antiparallel bridges. The bridges that are open for extension are
+	// indexed by the pair they expect next, per type. Since every pair is
+	// part of only one bridge there is at most one candidate.
+	std::pmr::vector<bridge> bridges(inResource);
 
-	std::unique_ptr<cif::progress_bar> progress;
-	if (cif::VERBOSE == 0 or cif::VERBOSE == 1)
-		progress.reset(new cif::progress_bar(q.size(), "calculate beta sheets"));
+	auto nextKey = [](uint32_t i, uint32_t j)
+	{ return (static_cast<uint64_t>(i) << 32) bitor j; };
 
-	// Calculate Bridges
-	std::vector<bridge> bridges;
+	std::pmr::unordered_map<uint64_t, uint32_t> open[2] = {
+		std::pmr::unordered_map<uint64_t, uint32_t>(inResource),
+		std::pmr::unordered_map<uint64_t, uint32_t>(inResource)
+	};
 
 	for (const auto &[i, j] : q)
 	{
-		if (progress)
-			progress->consumed(1);
+		if (++tested == kChunkSize)
+		{
+			progress.consumed(tested);
+			tested = 0;
+		}
 
 		auto &ri = inResidues[i];
 		auto &rj = inResidues[j];
@@ -891,50 +1926,84 @@ void CalculateBetaSheets(std::vector<residue> &inResidues, statistics &stats, st
 		if (type == bridge_type::None)
 			continue;
 
-		bool found = false;
-		for (bridge &bridge : bridges)
+		auto &index = open[type == bridge_type::Parallel ? 0 : 1];
+
+		uint32_t b;
+		if (auto o = index.find(nextKey(i, j)); o != index.end())
 		{
-			if (type != bridge.type or i != bridge.i.back() + 1)
-				continue;
+			b = o->second;
+			index.erase(o);
 
-			if (type == bridge_type::Parallel and bridge.j.back() + 1 == j)
-			{
-				bridge.i.push_back(i);
-				bridge.j.push_back(j);
-				found = true;
-				break;
-			}
-
-			if (type == bridge_type::AntiParallel and bridge.j.front() - 1 == j)
-			{
-				bridge.i.push_back(i);
-				bridge.j.push_front(j);
-				found = true;
-				break;
-			}
+			bridges[b].i.push_back(i);
+			if (type == bridge_type::Parallel)
+				bridges[b].j.push_back(j);
+			else
+				bridges[b].j.insert(bridges[b].j.begin(), j);
 		}
-
-		if (not found)
+		else
 		{
-			bridge bridge = {};
+			b = static_cast<uint32_t>(bridges.size());
+
+			auto &bridge = bridges.emplace_back(type);
 
-			bridge.type = type;
 			bridge.i.push_back(i);
 			bridge.chainI = ri.mAsymID;
 			bridge.j.push_back(j);
 			bridge.chainJ = rj.mAsymID;
-
-			bridges.push_back(bridge);
 		}
+
+		// same unsigned arithmetic as before, j == 0 never matches
+		if (type == bridge_type::Parallel)
+			index[nextKey(i + 1, j + 1)] = b;
+		else
+			index[nextKey(i + 1, j - 1)] = b;
 	}
 
+	progress.consumed(tested);
+	progress.finish();
+
 	// extend ladders
 	std::sort(bridges.begin(), bridges.end());
 
-	for (uint32_t i = 0; i < bridges.size(); ++i)
+	// Bridge j can only be merged into bridge i when the first i of j lies
+	// within five residues after the last i of i. Instead of testing all j,
+	// look up the bridges starting at those five residues. The candidates are
+	// tested in the same order as all j would have been, so the outcome is
+	// the same. Merged bridges are removed afterwards.
+	const uint32_t bridgeCount = static_cast<uint32_t>(bridges.size());
+	ioCounters.bridges = bridgeCount;
+
+	std::pmr::vector<std::pair<uint32_t, uint32_t>> starts(inResource);
+	for (uint32_t b = 0; b < bridgeCount; ++b)
+		starts.emplace_back(bridges[b].i.front(), b);
+	std::sort(starts.begin(), starts.end());
+
+	std::pmr::vector<uint8_t> merged(bridgeCount, 0, inResource);
+
+	for (uint32_t i = 0; i < bridgeCount; ++i)
 	{
-		for (uint32_t j = i + 1; j < bridges.size(); ++j)
+		if (merged[i])
+			continue;
+
+		for (uint32_t j = i;;)
 		{
+			// The next bridge after j that starts in the range
+			uint32_t next = bridgeCount;
+			for (uint32_t start = bridges[i].i.back() + 1; start <= bridges[i].i.back() + 5; ++start)
+			{
+				auto c = std::lower_bound(starts.begin(), starts.end(), std::make_pair(start, j + 1));
+				while (c != starts.end() and c->first == start and merged[c->second])
+					++c;
+
+				if (c != starts.end() and c->first == start and c->second < next)
+					next = c->second;
+			}
+
+			if (next == bridgeCount)
+				break;
+
+			j = next;
+
 			uint32_t ibi = bridges[i].i.front();
 			uint32_t iei = bridges[i].i.back();
 			uint32_t jbi = bridges[i].j.front();
@@ -966,18 +2035,25 @@ void CalculateBetaSheets(std::vector<residue> &inResidues, statistics &stats, st
 					bridges[i].j.insert(bridges[i].j.end(), bridges[j].j.begin(), bridges[j].j.end());
 				else
 					bridges[i].j.insert(bridges[i].j.begin(), bridges[j].j.begin(), bridges[j].j.end());
-				bridges.erase(bridges.begin() + j);
-				--j;
+				merged[j] = 1;
 			}
 		}
 	}
 
+	uint32_t kept = 0;
+	for (uint32_t b = 0; b < bridgeCount; ++b)
+	{
+		if (merged[b])
+			continue;
+		if (kept != b)
+			bridges[kept] = std::move(bridges[b]);
+		++kept;
+	}
+	bridges.erase(bridges.begin() + kept, bridges.end());
+
 	// Sheet
-	std::set<bridge *> ladderset;
 	for (bridge &bridge : bridges)
 	{
-		ladderset.insert(&bridge);
-
 		size_t n = bridge.i.size();
 		if (n > dssp::kHistogramSize)
 			n = dssp::kHistogramSize;
@@ -988,56 +2064,125 @@ void CalculateBetaSheets(std::vector<residue> &inResidues, statistics &stats, st
 			stats.histogram.antiparallel_bridges_per_ladder[n - 1] += 1;
 	}
 
-	uint32_t sheet = 1, ladder = 0;
-	while (not ladderset.empty())
+	// A sheet is a set of ladders linked by sharing residues. Build these
+	// with a union-find over the ladders, uniting the ladders that share a
+	// residue. Sheets are numbered in the order of their first ladder, the
+	// ladders sheet by sheet.
+	const uint32_t kNoLadder = std::numeric_limits<uint32_t>::max();
+	const uint32_t ladderCount = static_cast<uint32_t>(bridges.size());
+	ioCounters.ladders = ladderCount;
+
+	std::pmr::vector<uint32_t> parent(ladderCount, 0, inResource);
+	std::iota(parent.begin(), parent.end(), 0);
+
+	auto find = [&parent](uint32_t l)
 	{
-		std::set<bridge *> sheetset;
-		sheetset.insert(*ladderset.begin());
-		ladderset.erase(ladderset.begin());
+		while (parent[l] != l)
+			l = parent[l] = parent[parent[l]];
+		return l;
+	};
+
+	std::pmr::vector<uint32_t> owner(inResidues.size(), kNoLadder, inResource);
 
-		bool done = false;
-		while (not done)
+	for (uint32_t l = 0; l < ladderCount; ++l)
+	{
+		for (auto *v : { &bridges[l].i, &bridges[l].j })
 		{
-			done = true;
-			for (bridge *a : sheetset)
+			for (uint32_t r : *v)
 			{
-				for (bridge *b : ladderset)
+				if (owner[r] == kNoLadder)
+					owner[r] = l;
+				else
 				{
-					if (Linked(*a, *b))
-					{
-						sheetset.insert(b);
-						ladderset.erase(b);
-						done = false;
-						break;
-					}
+					auto a = find(owner[r]), b = find(l);
+					if (a != b)
+						parent[std::max(a, b)] = std::min(a, b);
 				}
-				if (not done)
-					break;
 			}
 		}
+	}
 
-		for (bridge *bridge : sheetset)
-		{
-			bridge->ladder = ladder;
-			bridge->sheet = sheet;
-			bridge->link = sheetset;
+	// the roots are the first ladder of each sheet
+	std::pmr::vector<uint32_t> sheetOf(ladderCount, 0, inResource);
+	std::pmr::vector<uint32_t> sheetSize(1, 0, inResource);
 
-			++ladder;
+	uint32_t sheet = 1, ladder = 0;
+	for (uint32_t l = 0; l < ladderCount; ++l)
+	{
+		auto root = find(l);
+		if (root == l)
+		{
+			sheetOf[l] = sheet++;
+			sheetSize.push_back(0);
 		}
+		else
+			sheetOf[l] = sheetOf[root];
+
+		sheetSize[sheetOf[l]] += 1;
+	}
+
+	std::pmr::vector<uint32_t> sheetStart(sheet + 1, 0, inResource);
+	for (uint32_t s = 1; s < sheet; ++s)
+		sheetStart[s + 1] = sheetStart[s] + sheetSize[s];
 
-		size_t nrOfLaddersPerSheet = sheetset.size();
-		if (nrOfLaddersPerSheet > dssp::kHistogramSize)
-			nrOfLaddersPerSheet = dssp::kHistogramSize;
-		if (nrOfLaddersPerSheet == 1 and (*sheetset.begin())->i.size() > 1)
-			stats.histogram.ladders_per_sheet[0] += 1;
-		else if (nrOfLaddersPerSheet > 1)
-			stats.histogram.ladders_per_sheet[nrOfLaddersPerSheet - 1] += 1;
+	std::pmr::vector<uint32_t> ladders(ladderCount, 0, inResource);
+	for (uint32_t l = 0; l < ladderCount; ++l)
+		ladders[sheetStart[sheetOf[l]]++] = l;
 
-		++sheet;
+	for (uint32_t s = 1, l = 0; s < sheet; ++s)
+	{
+		size_t nrOfLaddersPerSheet = sheetSize[s];
+		bool first = true;
+
+		for (; l < ladderCount and sheetOf[ladders[l]] == s; ++l)
+		{
+			auto &bridge = bridges[ladders[l]];
+
+			bridge.ladder = ladder;
+			bridge.sheet = s;
+
+			++ladder;
+
+			if (first)
+			{
+				if (nrOfLaddersPerSheet > dssp::kHistogramSize)
+					nrOfLaddersPerSheet = dssp::kHistogramSize;
+				if (nrOfLaddersPerSheet == 1 and bridge.i.size() > 1)
+					stats.histogram.ladders_per_sheet[0] += 1;
+				else if (nrOfLaddersPerSheet > 1)
+					stats.histogram.ladders_per_sheet[nrOfLaddersPerSheet - 1] += 1;
+
+				first = false;
+			}
+		}
 	}
 
 	for (bridge &bridge : bridges)
 	{
+		structure_type ss = structure_type::Betabridge;
+		if (bridge.i.size() > 1)
+			ss = structure_type::Strand;
+
+		if (bridge.type == bridge_type::Parallel)
+			stats.count.H_bonds_in_parallel_bridges += bridge.i.back() - bridge.i.front() + 2;
+		else
+			stats.count.H_bonds_in_antiparallel_bridges += bridge.i.back() - bridge.i.front() + 2;
+
+		for (uint32_t i = bridge.i.front(); i <= bridge.i.back(); ++i)
+		{
+			if (inResidues[i].GetSecondaryStructure() != structure_type::Strand)
+				inResidues[i].SetSecondaryStructure(ss);
+		}
+
+		for (uint32_t i = bridge.j.front(); i <= bridge.j.back(); ++i)
+		{
+			if (inResidues[i].GetSecondaryStructure() != structure_type::Strand)
+				inResidues[i].SetSecondaryStructure(ss);
+		}
+
+		if (not inBridgePartners)
+			continue;
+
 		// find out if any of the i and j set members already have
 		// a bridge assigned, if so, we're assigning bridge 2
 
@@ -1061,15 +2206,9 @@ void CalculateBetaSheets(std::vector<residue> &inResidues, statistics &stats, st
 			}
 		}
 
-		structure_type ss = structure_type::Betabridge;
-		if (bridge.i.size() > 1)
-			ss = structure_type::Strand;
-
 		if (bridge.type == bridge_type::Parallel)
 		{
-			stats.count.H_bonds_in_parallel_bridges += bridge.i.back() - bridge.i.front() + 2;
-
-			std::deque<uint32_t>::iterator j = bridge.j.begin();
+			auto j = bridge.j.begin();
 			for (uint32_t i : bridge.i)
 				inResidues[i].SetBetaPartner(betai, inResidues[*j++], bridge.ladder, true);
 
@@ -1079,9 +2218,7 @@ void CalculateBetaSheets(std::vector<residue> &inResidues, statistics &stats, st
 		}
 		else
 		{
-			stats.count.H_bonds_in_antiparallel_bridges += bridge.i.back() - bridge.i.front() + 2;
-
-			std::deque<uint32_t>::reverse_iterator j = bridge.j.rbegin();
+			auto j = bridge.j.rbegin();
 			for (uint32_t i : bridge.i)
 				inResidues[i].SetBetaPartner(betai, inResidues[*j++], bridge.ladder, false);
 
@@ -1091,20 +2228,15 @@ void CalculateBetaSheets(std::vector<residue> &inResidues, statistics &stats, st
 		}
 
 		for (uint32_t i = bridge.i.front(); i <= bridge.i.back(); ++i)
-		{
-			if (inResidues[i].GetSecondaryStructure() != structure_type::Strand)
-				inResidues[i].SetSecondaryStructure(ss);
 			inResidues[i].SetSheet(bridge.sheet);
-		}
 
 		for (uint32_t i = bridge.j.front(); i <= bridge.j.back(); ++i)
-		{
-			if (inResidues[i].GetSecondaryStructure() != structure_type::Strand)
-				inResidues[i].SetSecondaryStructure(ss);
 			inResidues[i].SetSheet(bridge.sheet);
-		}
 	}
 
+	if (not inBridgePartners)
+		return;
+
 	// Create 'strands'. A strand is a range of residues without a gap in between
 	// that belong to the same sheet.
 
@@ -1128,17 +2260,35 @@ void CalculateBetaSheets(std::vector<residue> &inResidues, statistics &stats, st
 
 // --------------------------------------------------------------------
 
-void CalculateAlphaHelices(std::vector<residue> &inResidues, statistics &stats, bool inPreferPiHelices = true)
+// The stretches of residues without chain breaks, as [begin, end) ranges
+// into inResidues. Helices and PP helices cannot cross a chain break, so
+// the stretches can be done independently.
+std::vector<std::pair<uint32_t, uint32_t>> ChainSegments(const std::vector<residue> &inResidues)
 {
-	if (cif::VERBOSE)
-		std::cerr << "calculating alpha helices" << std::endl;
+	std::vector<std::pair<uint32_t, uint32_t>> result;
+
+	for (uint32_t i = 0; i < inResidues.size(); ++i)
+	{
+		if (i == 0 or inResidues[i].mChainBreak != chain_break_type::None)
+			result.emplace_back(i, i);
+		result.back().second = i + 1;
+	}
 
+	return result;
+}
+
+// The helices, turns and bends of the residues [inBegin, inEnd). This is
+// the same as doing all residues at once, except that nothing before
+// inBegin is looked at: a residue there cannot be the start of a helix
+// reaching into this segment.
+void CalculateAlphaHelices(std::vector<residue> &inResidues, uint32_t inBegin, uint32_t inEnd, bool inPreferPiHelices)
+{
 	// Helix and Turn
 	for (helix_type helixType : { helix_type::_3_10, helix_type::alpha, helix_type::pi })
 	{
 		uint32_t stride = static_cast<uint32_t>(helixType) + 3;
 
-		for (uint32_t i = 0; i + stride < inResidues.size(); ++i)
+		for (uint32_t i = inBegin; i + stride < inEnd; ++i)
 		{
 			if (NoChainBreak(inResidues[i], inResidues[i + stride]) and TestBond(&inResidues[i + stride], &inResidues[i]))
 			{
@@ -1157,13 +2307,14 @@ void CalculateAlphaHelices(std::vector<residue> &inResidues, statistics &stats,
 		}
 	}
 
-	for (auto &r : inResidues)
+	for (uint32_t i = inBegin; i < inEnd; ++i)
 	{
+		auto &r = inResidues[i];
 		if (r.mKappa.has_value())
 			r.SetBend(*r.mKappa > 70);
 	}
 
-	for (uint32_t i = 1; i + 4 < inResidues.size(); ++i)
+	for (uint32_t i = inBegin + 1; i + 4 < inEnd; ++i)
 	{
 		if (inResidues[i].IsHelixStart(helix_type::alpha) and inResidues[i - 1].IsHelixStart(helix_type::alpha))
 		{
@@ -1172,7 +2323,7 @@ void CalculateAlphaHelices(std::vector<residue> &inResidues, statistics &stats,
 		}
 	}
 
-	for (uint32_t i = 1; i + 3 < inResidues.size(); ++i)
+	for (uint32_t i = inBegin + 1; i + 3 < inEnd; ++i)
 	{
 		if (inResidues[i].IsHelixStart(helix_type::_3_10) and inResidues[i - 1].IsHelixStart(helix_type::_3_10))
 		{
@@ -1187,7 +2338,7 @@ void CalculateAlphaHelices(std::vector<residue> &inResidues, statistics &stats,
 		}
 	}
 
-	for (uint32_t i = 1; i + 5 < inResidues.size(); ++i)
+	for (uint32_t i = inBegin + 1; i + 5 < inEnd; ++i)
 	{
 		if (inResidues[i].IsHelixStart(helix_type::pi) and inResidues[i - 1].IsHelixStart(helix_type::pi))
 		{
@@ -1203,7 +2354,8 @@ void CalculateAlphaHelices(std::vector<residue> &inResidues, statistics &stats,
 		}
 	}
 
-	for (uint32_t i = 1; i + 1 < inResidues.size(); ++i)
+	// The first and last residue of the structure are never a turn or bend
+	for (uint32_t i = std::max<uint32_t>(inBegin, 1); i < inEnd and i + 1 < inResidues.size(); ++i)
 	{
 		if (inResidues[i].GetSecondaryStructure() == structure_type::Loop)
 		{
@@ -1212,7 +2364,7 @@ void CalculateAlphaHelices(std::vector<residue> &inResidues, statistics &stats,
 			{
 				uint32_t stride = 3 + static_cast<uint32_t>(helixType);
 				for (uint32_t k = 1; k < stride and not isTurn; ++k)
-					isTurn = (i >= k) and inResidues[i - k].IsHelixStart(helixType);
+					isTurn = (i >= inBegin + k) and inResidues[i - k].IsHelixStart(helixType);
 			}
 
 			if (isTurn)
@@ -1221,8 +2373,15 @@ void CalculateAlphaHelices(std::vector<residue> &inResidues, statistics &stats,
 				inResidues[i].SetSecondaryStructure(structure_type::Bend);
 		}
 	}
+}
 
-	std::string asym;
+void CalculateAlphaHelices(std::vector<residue> &inResidues, statistics &stats, const std::vector<std::pair<uint32_t, uint32_t>> &inSegments,
+	size_t inThreads, bool inPreferPiHelices = true)
+{
+	parallel_for(inSegments.size(), inThreads, 1, [&](size_t s)
+		{ CalculateAlphaHelices(inResidues, inSegments[s].first, inSegments[s].second, inPreferPiHelices); });
+
+	const std::string *asym = nullptr;
 	size_t helixLength = 0;
 	for (auto &r : inResidues)
 	{
@@ -1247,28 +2406,19 @@ void CalculateAlphaHelices(std::vector<residue> &inResidues, statistics &stats,
 
 // --------------------------------------------------------------------
 
-void CalculatePPHelices(std::vector<residue> &inResidues, statistics &stats, int stretch_length)
+// The PP helices of the residues [inBegin, inEnd), using the angles in
+// \a phi and \a psi of all residues. A stretch with all angles in range
+// cannot cross a chain break, where psi and phi are missing.
+void CalculatePPHelices(std::vector<residue> &inResidues, uint32_t inBegin, uint32_t inEnd, const std::vector<float> &phi, const std::vector<float> &psi,
+	int stretch_length)
 {
-	if (cif::VERBOSE)
-		std::cerr << "calculating pp helices" << std::endl;
-
-	size_t N = inResidues.size();
-
 	const float epsilon = 29;
 	const float phi_min = -75 - epsilon;
 	const float phi_max = -75 + epsilon;
 	const float psi_min = 145 - epsilon;
 	const float psi_max = 145 + epsilon;
 
-	std::vector<float> phi(N), psi(N);
-
-	for (uint32_t i = 1; i + 1 < inResidues.size(); ++i)
-	{
-		phi[i] = static_cast<float>(inResidues[i].mPhi.value_or(360));
-		psi[i] = static_cast<float>(inResidues[i].mPsi.value_or(360));
-	}
-
-	for (uint32_t i = 1; i + 3 < inResidues.size(); ++i)
+	for (uint32_t i = std::max<uint32_t>(inBegin, 1); i < inEnd and i + 3 < inResidues.size(); ++i)
 	{
 		switch (stretch_length)
 		{
@@ -1382,20 +2532,203 @@ void CalculatePPHelices(std::vector<residue> &inResidues, statistics &stats, int
 	}
 }
 
+void CalculatePPHelices(std::vector<residue> &inResidues, statistics &stats, const std::vector<std::pair<uint32_t, uint32_t>> &inSegments,
+	size_t inThreads, int stretch_length)
+{
+	size_t N = inResidues.size();
+
+	std::vector<float> phi(N), psi(N);
+
+	for (uint32_t i = 1; i + 1 < inResidues.size(); ++i)
+	{
+		phi[i] = static_cast<float>(inResidues[i].mPhi.value_or(360));
+		psi[i] = static_cast<float>(inResidues[i].mPsi.value_or(360));
+	}
+
+	parallel_for(inSegments.size(), inThreads, 1, [&](size_t s)
+		{ CalculatePPHelices(inResidues, inSegments[s].first, inSegments[s].second, phi, psi, stretch_length); });
+}
+
+// --------------------------------------------------------------------
+// The scratch buffers used while calculating. These are not kept by each
+// DSSP_impl, a calculation takes one from a pool and returns it when done.
+// That way batch processing reuses the buffers of the previous structures
+// and after the first few structures there are hardly any new allocations.
+
+struct calculation_workspace
+{
+	std::vector<point> mCAlphas;
+	std::vector<uint32_t> mCandidates;
+	spatial_index mCAlphaIndex;
+	hbond_workspace mHBond;
+	surface_workspace mSurface;
+
+	// For the bridges and ladders, the pool keeps the memory once allocated
+	std::pmr::unsynchronized_pool_resource mResource;
+};
+
+class workspace_lease
+{
+  public:
+	// Workspaces used for structures larger than this are freed when done,
+	// otherwise a long running process would keep the memory needed for
+	// the largest structure it has seen.
+	static constexpr size_t kMaxPooledResidues = 20000;
+
+	workspace_lease(size_t inResidues)
+		: mResidues(inResidues)
+	{
+		auto &pool = get_pool();
+
+		std::unique_lock lock(pool.mMutex);
+		if (not pool.mFree.empty())
+		{
+			mWorkspace = std::move(pool.mFree.back());
+			pool.mFree.pop_back();
+		}
+		lock.unlock();
+
+		if (not mWorkspace)
+			mWorkspace = std::make_unique<calculation_workspace>();
+	}
+
+	~workspace_lease()
+	{
+		if (mResidues > kMaxPooledResidues)
+			return;
+
+		auto &pool = get_pool();
+
+		std::unique_lock lock(pool.mMutex);
+		pool.mFree.push_back(std::move(mWorkspace));
+	}
+
+	workspace_lease(const workspace_lease &) = delete;
+	workspace_lease &operator=(const workspace_lease &) = delete;
+
+	calculation_workspace &operator*() const { return *mWorkspace; }
+	calculation_workspace *operator->() const { return mWorkspace.get(); }
+
+  private:
+	struct pool
+	{
+		std::mutex mMutex;
+		std::vector<std::unique_ptr<calculation_workspace>> mFree;
+	};
+
+	static pool &get_pool()
+	{
+		static pool sPool;
+		return sPool;
+	}
+
+	std::unique_ptr<calculation_workspace> mWorkspace;
+	size_t mResidues;
+};
+
+// --------------------------------------------------------------------
+
+struct residue_key_hash
+{
+	size_t operator()(const std::tuple<std::string_view, int> &key) const
+	{
+		// Mixed in 64 bits, folded when size_t is smaller
+		uint64_t h = std::hash<std::string_view>{}(std::get<0>(key)) ^ (static_cast<uint64_t>(std::hash<int>{}(std::get<1>(key))) * 0x9e3779b97f4a7c15ULL);
+		if constexpr (sizeof(size_t) < sizeof(uint64_t))
+			h ^= h >> 32;
+		return static_cast<size_t>(h);
+	}
+
+	size_t operator()(const dssp::key_type &key) const
+	{
+		return operator()(std::tuple<std::string_view, int>{ std::get<0>(key), std::get<1>(key) });
+	}
+
+	size_t operator()(const dssp::pdb_key_type &key) const
+	{
+		return operator()(dssp::key_type{ std::get<0>(key), std::get<1>(key) }) ^ (std::hash<std::string>{}(std::get<2>(key)) << 1);
+	}
+};
+
+// Adds the wall clock time of its lifetime to one of the dssp::timings
+class phase_timer
+{
+  public:
+	phase_timer(double &ioSeconds)
+		: m_seconds(&ioSeconds)
+		, m_start(std::chrono::steady_clock::now())
+	{
+	}
+
+	~phase_timer()
+	{
+		stop();
+	}
+
+	phase_timer(const phase_timer &) = delete;
+	phase_timer &operator=(const phase_timer &) = delete;
+
+	// Add the time so far to the current phase and continue timing another
+	void switch_to(double &ioSeconds)
+	{
+		stop();
+		m_seconds = &ioSeconds;
+		m_start = std::chrono::steady_clock::now();
+	}
+
+  private:
+	void stop()
+	{
+		*m_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+	}
+
+	double *m_seconds;
+	std::chrono::steady_clock::time_point m_start;
+};
+
 // --------------------------------------------------------------------
 
 struct DSSP_impl
 {
-	DSSP_impl(const cif::datablock &db, int model_nr, int min_poly_proline_stretch_length);
+	DSSP_impl(const cif::datablock &db, int model_nr, const dssp::options &options);
+
+	// Use the atoms in \a atoms instead of scanning the atom_site category
+	DSSP_impl(const cif::datablock &db, int model_nr, const dssp::options &options, const std::vector<cif::row_handle> &atoms);
+
+	// Diagnostic messages go to the log in the options, if any
+	bool Verbose(int inLevel = 1) const
+	{
+		return mOptions.log != nullptr and mOptions.verbose >= inLevel;
+	}
 
-	auto findRes(const std::string &asymID, int seqID)
+	std::ostream &Log() const
 	{
-		return std::find_if(mResidues.begin(), mResidues.end(), [&](auto &r)
-			{ return r.mAsymID == asymID and r.mSeqID == seqID; });
+		return *mOptions.log;
 	}
 
-	void calculateSurface();
-	void calculateSecondaryStructure();
+	bool Requested(dssp::calculate_flags inFlag) const
+	{
+		return (mOptions.flags & inFlag) == inFlag;
+	}
+
+	template <typename Atoms>
+	void loadResidues(const Atoms &atoms);
+	void calculateGeometry();
+
+	void calculate();
+
+	void updateCoordinates(const float *inCoordinates, size_t inCount);
+	void recalculate();
+
+	void updateResidues(const std::vector<dssp::key_type> &inResidues, const float *inCoordinates, size_t inCount);
+
+	std::vector<residue>::iterator findRes(const std::string &asymID, int seqID);
+	std::vector<residue>::iterator findPDBRes(const std::string &pdbStrandID, int pdbSeqNum, const std::string &pdbInsCode);
+
+	void calculateSurface(calculation_workspace &ioWorkspace, size_t inThreads);
+	void calculateSecondaryStructure(calculation_workspace &ioWorkspace, size_t inThreads);
+	void findNearPairs(calculation_workspace &ioWorkspace);
+	void assignSecondaryStructure(calculation_workspace &ioWorkspace, size_t inThreads);
 
 	std::string GetPDBHEADERLine();
 	std::string GetPDBCOMPNDLine();
@@ -1403,59 +2736,239 @@ struct DSSP_impl
 	std::string GetPDBAUTHORLine();
 
 	const cif::datablock &mDB;
+	int mModelNr;
+	string_pool mStrings;
 	std::vector<residue> mResidues;
+
+	// The side chain atoms of all residues, see residue::setSideChain
+	std::vector<point> mSideChainAtoms;
+	std::vector<const std::string *> mSideChainAtomIDs;
 	std::vector<std::pair<residue *, residue *>> mSSBonds;
-	int m_min_poly_proline_stretch_length;
+	dssp::options mOptions;
 	statistics mStats = {};
+	dssp::timings mTimings = {};
+	dssp::counters mCounters = {};
+
+	static constexpr uint32_t kNoResidue = std::numeric_limits<uint32_t>::max();
+	std::vector<std::pair<uint32_t, atom_slot>> mAtomSlots;
+
+	// The atoms for each residue, as indices into mAtomSlots. The atoms for
+	// residue i are mResidueAtoms[mResidueAtomOffsets[i]] upto mResidueAtoms[mResidueAtomOffsets[i + 1]]
+	std::vector<uint32_t> mResidueAtomOffsets, mResidueAtoms;
+
+	// The indices for findRes and findPDBRes, built on first use
+	std::once_flag mResidueIndexBuilt, mPDBResidueIndexBuilt;
+	std::unordered_map<dssp::key_type, uint32_t, residue_key_hash> mResidueIndex;
+	std::unordered_map<dssp::pdb_key_type, uint32_t, residue_key_hash> mPDBResidueIndex;
+
+	// The pairs of residues close enough for H-bonds, kept for updateResidues
+	std::vector<std::tuple<uint32_t, uint32_t>> mNear;
 };
 
 // --------------------------------------------------------------------
 
-DSSP_impl::DSSP_impl(const cif::datablock &db, int model_nr, int min_poly_proline_stretch_length)
+DSSP_impl::DSSP_impl(const cif::datablock &db, int model_nr, const dssp::options &options)
 	: mDB(db)
-	, m_min_poly_proline_stretch_length(min_poly_proline_stretch_length)
+	, mModelNr(model_nr)
+	, mOptions(options)
 {
-	using namespace cif::literals;
+	{
+		phase_timer timer(mTimings.load);
+		loadResidues(mDB["atom_site"]);
+	}
+	calculateGeometry();
+}
 
-	if (cif::VERBOSE)
-		std::cerr << "loading residues" << std::endl;
+DSSP_impl::DSSP_impl(const cif::datablock &db, int model_nr, const dssp::options &options, const std::vector<cif::row_handle> &atoms)
+	: mDB(db)
+	, mModelNr(model_nr)
+	, mOptions(options)
+{
+	{
+		phase_timer timer(mTimings.load);
+		loadResidues(atoms);
+	}
+	calculateGeometry();
+}
 
-	int resNumber = 0;
+template <typename Atoms>
+void DSSP_impl::loadResidues(const Atoms &atoms)
+{
+	using namespace cif::literals;
 
-	auto &pdbx_poly_seq_scheme = mDB["pdbx_poly_seq_scheme"];
-	auto &atom_site = mDB["atom_site"];
+	if (Verbose())
+		Log() << "loading residues" << std::endl;
 
-	using key_type = std::tuple<std::string,int>;
-	using index_type = std::map<key_type, size_t>;
+	auto &pdbx_poly_seq_scheme = mDB["pdbx_poly_seq_scheme"];
 
-	index_type index;
+	// The keys use the interned asym IDs, so atoms can be looked up using
+	// the text in atom_site without creating strings
+	using view_key_type = std::tuple<std::string_view, int>;
+	std::unordered_map<view_key_type, size_t, residue_key_hash> index;
 
 	mResidues.reserve(pdbx_poly_seq_scheme.size());
 
 	for (const auto &[asym_id, seq_id, pdb_strand_id, pdb_seq_num, pdb_ins_code]
 		: pdbx_poly_seq_scheme.rows<std::string,int, std::string, int, std::string>("asym_id", "seq_id", "pdb_strand_id", "pdb_seq_num", "pdb_ins_code"))
 	{
-		index[{asym_id, seq_id}] = mResidues.size();
-		mResidues.emplace_back(model_nr, pdb_strand_id, pdb_seq_num, pdb_ins_code);
+		index[{ *mStrings.intern(asym_id), seq_id }] = mResidues.size();
+		mResidues.emplace_back(mModelNr, pdb_strand_id, pdb_seq_num, pdb_ins_code, mStrings);
+	}
+
+	const atom_site_columns columns(mDB["atom_site"]);
+	const bool sideChains = Requested(dssp::calculate_flags::side_chains) or Requested(dssp::calculate_flags::accessibility);
+
+	// Remember where each atom ended up, for updateCoordinates
+	mAtomSlots.clear();
+	mAtomSlots.reserve(atoms.size());
+
+	// The side chain atoms, as index in mAtomSlots, atom ID and location, until
+	// they can be stored in the arena
+	std::vector<std::tuple<uint32_t, const std::string *, point>> sideChainAtoms;
+
+	// Atoms of the same residue are mostly consecutive, remember the last one
+	view_key_type lastKey;
+	auto last = index.end();
+	bool haveLast = false;
+
+	for (auto atom : atoms)
+	{
+		view_key_type key{ ItemText(atom[columns.asym_id]), atom[columns.seq_id].template as<int>() };
+		if (not haveLast or key != lastKey)
+		{
+			last = index.find(key);
+			lastKey = key;
+			haveLast = true;
+		}
+
+		if (last == index.end())
+		{
+			mAtomSlots.emplace_back(kNoResidue, atom_slot{});
+			continue;
+		}
+
+		const std::string *atomID = nullptr;
+		point location;
+
+		auto slot = mResidues[last->second].addAtom(atom, columns, mStrings, sideChains, atomID, location);
+		if (slot.slot >= kSlotSideChain)
+			sideChainAtoms.emplace_back(static_cast<uint32_t>(mAtomSlots.size()), atomID, location);
+
+		mAtomSlots.emplace_back(slot.slot == kSlotOtherModel ? kNoResidue : static_cast<uint32_t>(last->second), slot);
 	}
 
-	for (auto atom : atom_site)
+	std::vector<uint32_t> renumber(mResidues.size(), kNoResidue);
+	for (uint32_t i = 0, j = 0; i < mResidues.size(); ++i)
 	{
-		std::string asym_id;
-		int seq_id;
+		if (mResidues[i].isComplete())
+			renumber[i] = j++;
+	}
 
-		cif::tie(asym_id, seq_id) = atom.get("label_asym_id", "label_seq_id");
-		auto i = index.find({asym_id, seq_id});
-		if (i == index.end())
+	for (auto &[residue, slot] : mAtomSlots)
+	{
+		if (residue != kNoResidue)
+			residue = renumber[residue];
+	}
+	
+	mResidues.erase(std::remove_if(mResidues.begin(), mResidues.end(), [](const dssp::residue &r) { return not r.isComplete(); }), mResidues.end());
+
+	// Store all side chains in one flat arena
+	size_t sideChainSize = 0;
+	for (auto &residue : mResidues)
+		sideChainSize += residue.mSideChainSize;
+
+	mSideChainAtoms.assign(sideChainSize, {});
+	mSideChainAtomIDs.assign(sideChainSize, nullptr);
+
+	for (size_t i = 0, offset = 0; i < mResidues.size(); offset += mResidues[i].mSideChainSize, ++i)
+		mResidues[i].setSideChain(mSideChainAtoms.data() + offset, mSideChainAtomIDs.data() + offset);
+
+	for (const auto &[atom, atomID, location] : sideChainAtoms)
+	{
+		const auto &[residue, slot] = mAtomSlots[atom];
+		if (residue == kNoResidue)
 			continue;
-		
-		mResidues[i->second].addAtom(atom);
+
+		mResidues[residue].mSideChainIDs[slot.slot - kSlotSideChain] = atomID;
+		mResidues[residue].setAtom(slot, location);
 	}
 
 	for (auto &residue : mResidues)
 		residue.finish();
-	
-	mResidues.erase(std::remove_if(mResidues.begin(), mResidues.end(), [](const dssp::residue &r) { return not r.mComplete; }), mResidues.end());
+
+	mResidueAtomOffsets.assign(mResidues.size() + 1, 0);
+	for (auto &[residue, slot] : mAtomSlots)
+	{
+		if (residue != kNoResidue)
+			++mResidueAtomOffsets[residue + 1];
+	}
+
+	for (size_t i = 0; i < mResidues.size(); ++i)
+		mResidueAtomOffsets[i + 1] += mResidueAtomOffsets[i];
+
+	mResidueAtoms.resize(mResidueAtomOffsets.back());
+	std::vector<uint32_t> fill(mResidueAtomOffsets.begin(), mResidueAtomOffsets.end() - 1);
+	for (uint32_t i = 0; i < mAtomSlots.size(); ++i)
+	{
+		auto residue = mAtomSlots[i].first;
+		if (residue != kNoResidue)
+			mResidueAtoms[fill[residue]++] = i;
+	}
+
+	for (auto [asym1, seq1, asym2, seq2] : mDB["struct_conn"].find<std::string, int, std::string, int>("conn_type_id"_key == "disulf",
+			 "ptnr1_label_asym_id", "ptnr1_label_seq_id", "ptnr2_label_asym_id", "ptnr2_label_seq_id"))
+	{
+		auto r1 = findRes(asym1, seq1);
+		if (r1 == mResidues.end())
+		{
+			if (Verbose())
+				Log() << "Missing (incomplete?) residue for SS bond when trying to find " << asym1 << '/' << seq1 << std::endl;
+			continue;
+			// throw std::runtime_error("Invalid file, missing residue for SS bond");
+		}
+
+		auto r2 = findRes(asym2, seq2);
+		if (r2 == mResidues.end())
+		{
+			if (Verbose())
+				Log() << "Missing (incomplete?) residue for SS bond when trying to find " << asym2 << '/' << seq2 << std::endl;
+			continue;
+			// throw std::runtime_error("Invalid file, missing residue for SS bond");
+		}
+
+		mSSBonds.emplace_back(&*r1, &*r2);
+	}
+}
+
+std::vector<residue>::iterator DSSP_impl::findRes(const std::string &asymID, int seqID)
+{
+	std::call_once(mResidueIndexBuilt, [this]()
+		{
+			for (uint32_t i = 0; i < mResidues.size(); ++i)
+				mResidueIndex.emplace(dssp::key_type{ *mResidues[i].mAsymID, mResidues[i].mSeqID }, i); });
+
+	auto i = mResidueIndex.find({ asymID, seqID });
+	return i == mResidueIndex.end() ? mResidues.end() : mResidues.begin() + i->second;
+}
+
+std::vector<residue>::iterator DSSP_impl::findPDBRes(const std::string &pdbStrandID, int pdbSeqNum, const std::string &pdbInsCode)
+{
+	std::call_once(mPDBResidueIndexBuilt, [this]()
+		{
+			for (uint32_t i = 0; i < mResidues.size(); ++i)
+				mPDBResidueIndex.emplace(dssp::pdb_key_type{ *mResidues[i].mPDBStrandID, mResidues[i].mPDBSeqNum, *mResidues[i].mPDBInsCode }, i); });
+
+	auto i = mPDBResidueIndex.find({ pdbStrandID, pdbSeqNum, pdbInsCode });
+	return i == mPDBResidueIndex.end() ? mResidues.end() : mResidues.begin() + i->second;
+}
+
+// Everything that depends on the coordinates only, chain breaks and the angles
+void DSSP_impl::calculateGeometry()
+{
+	phase_timer timer(mTimings.geometry);
+
+	int resNumber = 0;
+
 	mStats.count.chains = 1;
 
 	chain_break_type brk = chain_break_type::NewChain;
@@ -1474,134 +2987,341 @@ DSSP_impl::DSSP_impl(const cif::datablock &db, int model_nr, int min_poly_prolin
 				else
 					brk = chain_break_type::NewChain;
 
-				++resNumber;
-			}
-		}
+				++resNumber;
+			}
+		}
+
+		residue.mChainBreak = brk;
+		residue.mNumber = resNumber;
+
+		brk = chain_break_type::None;
+	}
+
+	mStats.count.residues = static_cast<uint32_t>(mResidues.size());
+
+	for (size_t i = 0; i + 1 < mResidues.size(); ++i)
+	{
+		auto &cur = mResidues[i];
+
+		auto &next = mResidues[i + 1];
+		next.mPrev = &cur;
+		cur.mNext = &next;
+	}
+
+	// The hydrogens and angles of a residue depend on the coordinates of
+	// its neighbours only, the residues can be done in any order
+	const size_t kChunkSize = 1024;
+
+	// The hydrogens are timed on their own, not as part of the geometry
+	timer.switch_to(mTimings.hydrogens);
+
+	parallel_for(mResidues.size(), mOptions.nr_of_threads, kChunkSize, [this](size_t i)
+		{
+			if (i > 0)
+				mResidues[i].assignHydrogen(); });
+
+	timer.switch_to(mTimings.geometry);
+
+	parallel_for(mResidues.size(), mOptions.nr_of_threads, kChunkSize, [this](size_t i)
+	{
+		auto &cur = mResidues[i];
+
+		if (i >= 2 and i + 2 < mResidues.size())
+		{
+			auto &prevPrev = mResidues[i - 2];
+			auto &nextNext = mResidues[i + 2];
+
+			if (NoChainBreak(prevPrev, nextNext) and prevPrev.mSeqID + 4 == nextNext.mSeqID)
+			{
+				float ckap = cosinus_angle(
+					cur.mCAlpha,
+					prevPrev.mCAlpha,
+					nextNext.mCAlpha,
+					cur.mCAlpha);
+				float skap = std::sqrt(1 - ckap * ckap);
+
+				auto kappa = std::atan2(skap, ckap) * static_cast<float>(180 / kPI);
+				if (not std::isnan(kappa))
+					cur.mKappa = kappa;
+			}
+		}
+
+		if (i + 1 < mResidues.size())
+		{
+			auto &next = mResidues[i + 1];
+			if (NoChainBreak(cur, next))
+				cur.mPsi = dihedral_angle(cur.mN, cur.mCAlpha, cur.mC, next.mN);
+		}
+
+		if (i > 0)
+		{
+			auto &prev = mResidues[i - 1];
+			if (NoChainBreak(prev, cur))
+				cur.mPhi = dihedral_angle(prev.mC, cur.mN, cur.mCAlpha, cur.mC);
+		}
+
+		if (Requested(dssp::calculate_flags::angles))
+		{
+			cur.mAlpha = cur.CalculateAlpha();
+			cur.mTCO = cur.CalculateTCO();
+			cur.mOmega = cur.CalculateOmega();
+			cur.mAnglesCalculated = true;
+		}
+	});
+}
+
+void DSSP_impl::calculate()
+{
+	workspace_lease workspace(mResidues.size());
+
+	size_t threads = resolve_thread_count(mOptions.nr_of_threads);
+
+	if (Requested(dssp::calculate_flags::accessibility))
+	{
+		// The accessibility is calculated in parallel with the secondary
+		// structure. The threads are divided over the two, the larger part
+		// goes to the accessibility which usually takes longest. With a
+		// single thread both still get one, as before.
+		size_t surfaceThreads = std::max<size_t>(threads - threads / 2, 1);
+		size_t structureThreads = std::max<size_t>(threads / 2, 1);
+
+		// An exception in either, like a cancelled_error, is passed on after
+		// both are done
+		std::exception_ptr error;
+		std::thread t([this, &workspace, &error, surfaceThreads]()
+			{
+				try
+				{
+					calculateSurface(*workspace, surfaceThreads);
+				}
+				catch (...)
+				{
+					error = std::current_exception();
+				} });
+
+		try
+		{
+			calculateSecondaryStructure(*workspace, structureThreads);
+		}
+		catch (...)
+		{
+			t.join();
+			throw;
+		}
+
+		t.join();
+
+		if (error)
+			std::rethrow_exception(error);
+	}
+	else
+		calculateSecondaryStructure(*workspace, threads);
+}
+
+void DSSP_impl::updateCoordinates(const float *inCoordinates, size_t inCount)
+{
+	if (inCount != 3 * mAtomSlots.size())
+		throw std::runtime_error("The number of coordinates does not match the number of atoms");
+
+	for (auto &residue : mResidues)
+		residue.resetBox();
+
+	for (size_t i = 0; i < mAtomSlots.size(); ++i)
+	{
+		const auto &[residue, slot] = mAtomSlots[i];
+		if (residue != kNoResidue)
+			mResidues[residue].setAtom(slot, { inCoordinates[3 * i], inCoordinates[3 * i + 1], inCoordinates[3 * i + 2] });
+	}
+
+	for (auto &residue : mResidues)
+		residue.finish();
+}
+
+// Recalculate everything for the current coordinates. The surface is not
+// calculated on a separate thread here, saving a thread per frame.
+void DSSP_impl::recalculate()
+{
+	for (auto &residue : mResidues)
+		residue.resetCalculated();
+
+	mStats = {};
+	mTimings = { mTimings.load };
+	mCounters = {};
+
+	calculateGeometry();
+
+	workspace_lease workspace(mResidues.size());
+
+	if (Requested(dssp::calculate_flags::accessibility))
+		calculateSurface(*workspace, mOptions.nr_of_threads);
+
+	calculateSecondaryStructure(*workspace, mOptions.nr_of_threads);
+}
+
+// Update the coordinates of a few residues and recalculate only what might
+// have changed. H-bond energies are calculated for the pairs involving the
+// moved residues and their successors, whose hydrogen depends on the moved
+// C and O atoms. Accessibility only for the residues whose sphere overlaps
+// the old or new sphere of a moved residue. The rest is cheap and redone.
+void DSSP_impl::updateResidues(const std::vector<dssp::key_type> &inResidues, const float *inCoordinates, size_t inCount)
+{
+	std::vector<uint32_t> moved;
+	size_t atomCount = 0;
+
+	for (const auto &[asymID, seqID] : inResidues)
+	{
+		auto r = findRes(asymID, seqID);
+		if (r == mResidues.end())
+			throw std::out_of_range("Could not find residue " + asymID + ':' + std::to_string(seqID));
+
+		auto i = static_cast<uint32_t>(r - mResidues.begin());
+		moved.push_back(i);
+		atomCount += mResidueAtomOffsets[i + 1] - mResidueAtomOffsets[i];
+	}
+
+	if (inCount != 3 * atomCount)
+		throw std::runtime_error("The number of coordinates does not match the number of atoms");
+
+	std::vector<std::tuple<point, float>> oldSpheres;
+
+	for (auto i : moved)
+	{
+		auto &residue = mResidues[i];
+		oldSpheres.emplace_back(residue.mCenter, residue.mRadius);
+
+		residue.resetBox();
+
+		for (auto a = mResidueAtomOffsets[i]; a < mResidueAtomOffsets[i + 1]; ++a, inCoordinates += 3)
+			residue.setAtom(mAtomSlots[mResidueAtoms[a]].second, { inCoordinates[0], inCoordinates[1], inCoordinates[2] });
 
-		residue.mChainBreak = brk;
-		residue.mNumber = resNumber;
+		residue.finish();
+	}
 
-		brk = chain_break_type::None;
+	for (auto &residue : mResidues)
+		residue.resetStructure();
+
+	mStats = {};
+	mTimings = { mTimings.load };
+	mCounters = {};
+
+	calculateGeometry();
+
+	const size_t N = mResidues.size();
+
+	std::vector<uint8_t> changed(N, 0);
+	for (auto i : moved)
+	{
+		changed[i] = 1;
+		if (i + 1 < N)
+			changed[i + 1] = 1;
 	}
 
-	mStats.count.residues = static_cast<uint32_t>(mResidues.size());
+	// The bonds of the changed residues and of all residues that are, or
+	// were, near enough to have a bond with them are recalculated
+	std::vector<uint8_t> affected(changed);
 
-	for (size_t i = 0; i + 1 < mResidues.size(); ++i)
+	auto markAffected = [&]()
 	{
-		auto &cur = mResidues[i];
+		for (const auto &[i, j] : mNear)
+		{
+			if (changed[i] or changed[j])
+				affected[i] = affected[j] = 1;
+		}
+	};
 
-		auto &next = mResidues[i + 1];
-		next.mPrev = &cur;
-		cur.mNext = &next;
+	workspace_lease workspace(mResidues.size());
+
+	markAffected();
+	findNearPairs(*workspace);
+	markAffected();
+
+	{
+		phase_timer timer(mTimings.hbond_energies);
+		CalculateHBondEnergies(mResidues, mNear, mOptions.nr_of_threads, workspace->mHBond, mOptions, &affected);
 	}
 
-	for (size_t i = 0; i < mResidues.size(); ++i)
+	if (Requested(dssp::calculate_flags::accessibility))
 	{
-		auto &cur = mResidues[i];
+		std::vector<uint32_t> subset;
 
-		if (i >= 2 and i + 2 < mResidues.size())
+		for (uint32_t i = 0; i < N; ++i)
 		{
-			auto &prevPrev = mResidues[i - 2];
-			auto &nextNext = mResidues[i + 2];
+			auto &r = mResidues[i];
 
-			if (NoChainBreak(prevPrev, nextNext) and prevPrev.mSeqID + 4 == nextNext.mSeqID)
+			bool overlaps = false;
+			for (size_t k = 0; k < moved.size() and not overlaps; ++k)
 			{
-				float ckap = cosinus_angle(
-					cur.mCAlpha,
-					prevPrev.mCAlpha,
-					nextNext.mCAlpha,
-					cur.mCAlpha);
-				float skap = std::sqrt(1 - ckap * ckap);
-
-				auto kappa = std::atan2(skap, ckap) * static_cast<float>(180 / kPI);
-				if (not std::isnan(kappa))
-					cur.mKappa = kappa;
-			}
-		}
+				auto &m = mResidues[moved[k]];
+				const auto &[oldCenter, oldRadius] = oldSpheres[k];
 
-		if (i + 1 < mResidues.size())
-		{
-			auto &next = mResidues[i + 1];
-			next.assignHydrogen();
-			if (NoChainBreak(cur, next))
-			{
-				cur.mPsi = dihedral_angle(cur.mN, cur.mCAlpha, cur.mC, next.mN);
-				cur.mOmega = dihedral_angle(cur.mCAlpha, cur.mC, next.mN, next.mCAlpha);
+				overlaps = i == moved[k] or
+				           distance_sq(r.mCenter, m.mCenter) < (r.mRadius + m.mRadius) * (r.mRadius + m.mRadius) or
+				           distance_sq(r.mCenter, oldCenter) < (r.mRadius + oldRadius) * (r.mRadius + oldRadius);
 			}
-		}
 
-		if (i > 0)
-		{
-			auto &prev = mResidues[i - 1];
-			if (NoChainBreak(prev, cur))
-			{
-				cur.mTCO = cosinus_angle(cur.mC, cur.mO, prev.mC, prev.mO);
-				cur.mPhi = dihedral_angle(prev.mC, cur.mN, cur.mCAlpha, cur.mC);
-			}
+			if (overlaps)
+				subset.push_back(i);
 		}
 
-		if (i >= 1 and i + 2 < mResidues.size())
-		{
-			auto &prev = mResidues[i - 1];
-			auto &next = mResidues[i + 1];
-			auto &nextNext = mResidues[i + 2];
-
-			if (NoChainBreak(prev, nextNext))
-				cur.mAlpha = dihedral_angle(prev.mCAlpha, cur.mCAlpha, next.mCAlpha, nextNext.mCAlpha);
-		}
+		phase_timer timer(mTimings.accessibility);
+		CalculateAccessibilities(mResidues, mStats, mCounters, mOptions.nr_of_threads, workspace->mSurface, mOptions, &subset);
 	}
+
+	assignSecondaryStructure(*workspace, mOptions.nr_of_threads);
 }
 
-void DSSP_impl::calculateSecondaryStructure()
+void DSSP_impl::calculateSecondaryStructure(calculation_workspace &ioWorkspace, size_t inThreads)
 {
-	if (cif::VERBOSE)
-		std::cerr << "calculating secondary structure" << std::endl;
+	if (Verbose())
+		Log() << "calculating secondary structure" << std::endl;
 
-	using namespace cif::literals;
+	findNearPairs(ioWorkspace);
 
-	for (auto [asym1, seq1, asym2, seq2] : mDB["struct_conn"].find<std::string, int, std::string, int>("conn_type_id"_key == "disulf",
-			 "ptnr1_label_asym_id", "ptnr1_label_seq_id", "ptnr2_label_asym_id", "ptnr2_label_seq_id"))
 	{
-		auto r1 = findRes(asym1, seq1);
-		if (r1 == mResidues.end())
-		{
-			if (cif::VERBOSE > 0)
-				std::cerr << "Missing (incomplete?) residue for SS bond when trying to find " << asym1 << '/' << seq1 << std::endl;
-			continue;
-			// throw std::runtime_error("Invalid file, missing residue for SS bond");
-		}
+		phase_timer timer(mTimings.hbond_energies);
+		CalculateHBondEnergies(mResidues, mNear, inThreads, ioWorkspace.mHBond, mOptions);
+	}
 
-		auto r2 = findRes(asym2, seq2);
-		if (r2 == mResidues.end())
-		{
-			if (cif::VERBOSE > 0)
-				std::cerr << "Missing (incomplete?) residue for SS bond when trying to find " << asym2 << '/' << seq2 << std::endl;
-			continue;
-			// throw std::runtime_error("Invalid file, missing residue for SS bond");
-		}
+	assignSecondaryStructure(ioWorkspace, inThreads);
+}
 
-		mSSBonds.emplace_back(&*r1, &*r2);
-	}
+// Collect the pairs of residues with their CA atoms close enough for H-bonds
+void DSSP_impl::findNearPairs(calculation_workspace &ioWorkspace)
+{
+	phase_timer timer(mTimings.pair_search);
 
 	// Prefetch the c-alpha positions. No, really, that might be the trick
 
-	std::vector<point> cAlphas;
-	cAlphas.reserve(mResidues.size());
+	auto &cAlphas = ioWorkspace.mCAlphas;
+	cAlphas.clear();
 	for (auto &r : mResidues)
 		cAlphas.emplace_back(r.mCAlpha);
 
-	std::unique_ptr<cif::progress_bar> progress;
-	if (cif::VERBOSE == 0 or cif::VERBOSE == 1)
-		progress.reset(new cif::progress_bar((mResidues.size() * (mResidues.size() - 1)) / 2, "calculate distances"));
+	progress_tracker progress(mOptions, "calculate distances", mResidues.size());
 
 	// Calculate the HBond energies
-	std::vector<std::tuple<uint32_t,uint32_t>> near;
+	auto &near = mNear;
+	near.clear();
+
+	// Use a cell list to find the candidate pairs. The candidates for each i
+	// are sorted, so near ends up in the same (i, j) order as when all pairs
+	// would have been tested, which is what CalculateBetaSheets expects.
+	auto &index = ioWorkspace.mCAlphaIndex;
+	index.build(cAlphas, kMinimalCADistance);
+
+	auto &candidates = ioWorkspace.mCandidates;
 
 	for (uint32_t i = 0; i + 1 < mResidues.size(); ++i)
 	{
 		auto cai = cAlphas[i];
 
-		for (uint32_t j = i + 1; j < mResidues.size(); ++j)
+		candidates.clear();
+		index.for_each_in_range(cai, kMinimalCADistance, [i, &candidates](uint32_t j)
+			{ if (j > i) candidates.push_back(j); });
+
+		std::sort(candidates.begin(), candidates.end());
+
+		for (uint32_t j : candidates)
 		{
 			auto caj = cAlphas[j];
 
@@ -1611,21 +3331,47 @@ void DSSP_impl::calculateSecondaryStructure()
 			near.emplace_back(i, j);
 		}
 
-		if (progress)
-			progress->consumed(mResidues.size() - i - 1);
+		// The progress is reported per chunk of residues
+		if ((i + 1) % 256 == 0)
+			progress.consumed(256);
+	}
+
+	progress.finish();
+
+	mCounters.candidate_pairs = near.size();
+
+	if (Verbose())
+		Log() << "Considering " << near.size() << " pairs of residues" << std::endl;
+}
+
+// The passes that follow the H-bond energies, and the statistics
+void DSSP_impl::assignSecondaryStructure(calculation_workspace &ioWorkspace, size_t inThreads)
+{
+	{
+		phase_timer timer(mTimings.beta_sheets);
+		CalculateBetaSheets(mResidues, mStats, mCounters, mNear, &ioWorkspace.mResource, Requested(dssp::calculate_flags::bridge_partners), mOptions);
 	}
 
-	if (cif::VERBOSE > 0)
-		std::cerr << "Considering " << near.size() << " pairs of residues" << std::endl;
+	// The helices are calculated for each stretch without chain breaks in parallel
+	auto segments = ChainSegments(mResidues);
+
+	if (Verbose())
+		Log() << "calculating alpha helices" << std::endl;
+
+	{
+		phase_timer timer(mTimings.helices);
+		CalculateAlphaHelices(mResidues, mStats, segments, inThreads);
+	}
 
-	progress.reset(nullptr);
+	if (Verbose())
+		Log() << "calculating pp helices" << std::endl;
 
-	CalculateHBondEnergies(mResidues, near);
-	CalculateBetaSheets(mResidues, mStats, near);
-	CalculateAlphaHelices(mResidues, mStats);
-	CalculatePPHelices(mResidues, mStats, m_min_poly_proline_stretch_length);
+	{
+		phase_timer timer(mTimings.pp_helices);
+		CalculatePPHelices(mResidues, mStats, segments, inThreads, mOptions.min_poly_proline_stretch_length);
+	}
 
-	if (cif::VERBOSE > 1)
+	if (Verbose(2))
 	{
 		for (auto &r : mResidues)
 		{
@@ -1642,9 +3388,9 @@ void DSSP_impl::calculateSecondaryStructure()
 				}
 			}
 
-			auto id = r.mAsymID + ':' + std::to_string(r.mSeqID) + '/' + r.mCompoundID;
+			auto id = *r.mAsymID + ':' + std::to_string(r.mSeqID) + '/' + *r.mCompoundID;
 
-			std::cerr << id << std::string(12 - id.length(), ' ')
+			Log() << id << std::string(12 - id.length(), ' ')
 					  << char(r.mSecondaryStructure) << ' '
 					  << helix
 					  << std::endl;
@@ -1660,8 +3406,8 @@ void DSSP_impl::calculateSecondaryStructure()
 	{
 		if (a == b)
 		{
-			if (cif::VERBOSE > 0)
-				std::cerr << "In the SS bonds list, the residue " << a->mAsymID << ':' << a->mSeqID << " is bonded to itself" << std::endl;
+			if (Verbose())
+				Log() << "In the SS bonds list, the residue " << *a->mAsymID << ':' << a->mSeqID << " is bonded to itself" << std::endl;
 			continue;
 		}
 
@@ -1672,6 +3418,9 @@ void DSSP_impl::calculateSecondaryStructure()
 	}
 
 	mStats.count.H_bonds = 0;
+	if (not Requested(dssp::calculate_flags::statistics))
+		return;
+
 	for (auto &r : mResidues)
 	{
 		auto donor = r.mHBondDonor;
@@ -1689,9 +3438,10 @@ void DSSP_impl::calculateSecondaryStructure()
 	}
 }
 
-void DSSP_impl::calculateSurface()
+void DSSP_impl::calculateSurface(calculation_workspace &ioWorkspace, size_t inThreads)
 {
-	CalculateAccessibilities(mResidues, mStats);
+	phase_timer timer(mTimings.accessibility);
+	CalculateAccessibilities(mResidues, mStats, mCounters, inThreads, ioWorkspace.mSurface, mOptions);
 }
 
 // --------------------------------------------------------------------
@@ -1953,12 +3703,12 @@ std::string DSSP_impl::GetPDBAUTHORLine()
 
 std::string dssp::residue_info::asym_id() const
 {
-	return m_impl->mAsymID;
+	return *m_impl->mAsymID;
 }
 
 std::string dssp::residue_info::compound_id() const
 {
-	return m_impl->mCompoundID;
+	return *m_impl->mCompoundID;
 }
 
 char dssp::residue_info::compound_letter() const
@@ -1973,12 +3723,12 @@ int dssp::residue_info::seq_id() const
 
 std::string dssp::residue_info::alt_id() const
 {
-	return m_impl->mAltID;
+	return *m_impl->mAltID;
 }
 
 std::string dssp::residue_info::auth_asym_id() const
 {
-	return m_impl->mAuthAsymID;
+	return *m_impl->mAuthAsymID;
 }
 
 int dssp::residue_info::auth_seq_id() const
@@ -1988,7 +3738,7 @@ int dssp::residue_info::auth_seq_id() const
 
 std::string dssp::residue_info::pdb_strand_id() const
 {
-	return m_impl->mPDBStrandID;
+	return *m_impl->mPDBStrandID;
 }
 
 int dssp::residue_info::pdb_seq_num() const
@@ -1998,12 +3748,12 @@ int dssp::residue_info::pdb_seq_num() const
 
 std::string dssp::residue_info::pdb_ins_code() const
 {
-	return m_impl->mPDBInsCode;
+	return *m_impl->mPDBInsCode;
 }
 
 std::optional<float> dssp::residue_info::alpha() const
 {
-	return m_impl->mAlpha;
+	return m_impl->mAnglesCalculated ? m_impl->mAlpha : m_impl->CalculateAlpha();
 }
 
 std::optional<float> dssp::residue_info::kappa() const
@@ -2013,7 +3763,7 @@ std::optional<float> dssp::residue_info::kappa() const
 
 std::optional<float> dssp::residue_info::omega() const
 {
-	return m_impl->mOmega;
+	return m_impl->mAnglesCalculated ? m_impl->mOmega : m_impl->CalculateOmega();
 }
 
 std::optional<float> dssp::residue_info::phi() const
@@ -2028,7 +3778,7 @@ std::optional<float> dssp::residue_info::psi() const
 
 std::optional<float> dssp::residue_info::tco() const
 {
-	return m_impl->mTCO;
+	return m_impl->mAnglesCalculated ? m_impl->mTCO : m_impl->CalculateTCO();
 }
 
 bool dssp::residue_info::is_pre_pro() const
@@ -2204,22 +3954,83 @@ dssp::iterator &dssp::iterator::operator--()
 
 // --------------------------------------------------------------------
 
-dssp::dssp(const cif::mm::structure &s, int min_poly_proline_stretch_length, bool calculateSurfaceAccessibility)
-	: dssp(s.get_datablock(), static_cast<int>(s.get_model_nr()), min_poly_proline_stretch_length, calculateSurfaceAccessibility)
+// The flags for the constructors taking a bool, everything is calculated except
+// for the accessibility when \a inAccessibility is false
+dssp::calculate_flags AllFlags(bool inAccessibility)
+{
+	using flags = dssp::calculate_flags;
+	auto result = flags::angles | flags::side_chains | flags::bridge_partners | flags::statistics;
+	if (inAccessibility)
+		result = result | flags::accessibility;
+	return result;
+}
+
+// The options for the constructors that take separate arguments, these
+// use the global verbosity of libcifpp and write to std::cerr
+dssp::options GlobalOptions(int inMinPPStretch, dssp::calculate_flags inFlags, size_t inThreads, dssp::progress *inReporter)
+{
+	dssp::options result;
+
+	result.min_poly_proline_stretch_length = inMinPPStretch;
+	result.flags = inFlags;
+	result.nr_of_threads = inThreads;
+	result.reporter = inReporter;
+	result.progress_bar = cif::VERBOSE == 0 or cif::VERBOSE == 1;
+	result.verbose = cif::VERBOSE;
+	result.log = &std::cerr;
+
+	return result;
+}
+
+dssp::dssp(const cif::mm::structure &s, int min_poly_proline_stretch_length, bool calculateSurfaceAccessibility, size_t nr_of_threads)
+	: dssp(s.get_datablock(), static_cast<int>(s.get_model_nr()), min_poly_proline_stretch_length, calculateSurfaceAccessibility, nr_of_threads)
+{
+}
+
+dssp::dssp(const cif::datablock &db, int model_nr, int min_poly_proline_stretch, bool calculateSurfaceAccessibility, size_t nr_of_threads)
+	: dssp(db, model_nr, min_poly_proline_stretch, AllFlags(calculateSurfaceAccessibility), nr_of_threads)
+{
+}
+
+dssp::dssp(const cif::datablock &db, int model_nr, int min_poly_proline_stretch, calculate_flags flags, size_t nr_of_threads,
+	progress *reporter)
+	: dssp(db, model_nr, GlobalOptions(min_poly_proline_stretch, flags, nr_of_threads, reporter))
 {
 }
 
-dssp::dssp(const cif::datablock &db, int model_nr, int min_poly_proline_stretch, bool calculateSurfaceAccessibility)
-	: m_impl(new DSSP_impl(db, model_nr, min_poly_proline_stretch))
+dssp::dssp(const cif::datablock &db, int model_nr, const options &options)
+	: m_impl(new DSSP_impl(db, model_nr, options))
 {
-	if (calculateSurfaceAccessibility)
+	try
 	{
-		std::thread t(std::bind(&DSSP_impl::calculateSurface, m_impl));
-		m_impl->calculateSecondaryStructure();
-		t.join();
+		m_impl->calculate();
 	}
-	else
-		m_impl->calculateSecondaryStructure();
+	catch (...)
+	{
+		delete m_impl;
+		throw;
+	}
+}
+
+dssp::dssp(DSSP_impl *impl)
+	: m_impl(impl)
+{
+}
+
+dssp::dssp(dssp &&rhs)
+	: m_impl(std::exchange(rhs.m_impl, nullptr))
+{
+}
+
+dssp &dssp::operator=(dssp &&rhs)
+{
+	if (this != &rhs)
+	{
+		delete m_impl;
+		m_impl = std::exchange(rhs.m_impl, nullptr);
+	}
+
+	return *this;
 }
 
 dssp::~dssp()
@@ -2227,6 +4038,192 @@ dssp::~dssp()
 	delete m_impl;
 }
 
+const std::vector<std::string_view> &dssp::required_categories()
+{
+	return kRequiredCategories;
+}
+
+const std::vector<std::string_view> &dssp::required_atom_site_items()
+{
+	return kRequiredAtomSiteItems;
+}
+
+cif::file dssp::read_required_categories(std::istream &is)
+{
+	cif::file result;
+
+	required_categories_parser parser(is, result);
+	parser.parse_file();
+
+	if (result.empty())
+		throw std::runtime_error("Invalid input file, no datablocks found");
+
+	// Like cif::pdb::read, so the data compares the same way
+	result.load_dictionary("mmcif_pdbx.dic");
+
+	return result;
+}
+
+std::vector<dssp> dssp::calculate_all_models(const cif::datablock &db, int min_poly_proline_stretch_length, bool calculateSurfaceAccessibility, size_t nr_of_threads)
+{
+	return calculate_all_models(db, min_poly_proline_stretch_length, AllFlags(calculateSurfaceAccessibility), nr_of_threads);
+}
+
+std::vector<dssp> dssp::calculate_all_models(const cif::datablock &db, int min_poly_proline_stretch_length, calculate_flags flags, size_t nr_of_threads,
+	progress *reporter)
+{
+	return calculate_all_models(db, GlobalOptions(min_poly_proline_stretch_length, flags, nr_of_threads, reporter));
+}
+
+std::vector<dssp> dssp::calculate_all_models(const cif::datablock &db, const options &options)
+{
+	// Partition the atoms by model in a single scan. Atoms without
+	// a model number belong to all models.
+	std::map<int, std::vector<cif::row_handle>> models;
+	std::vector<cif::row_handle> shared;
+
+	for (auto atom : db["atom_site"])
+	{
+		auto model_nr = atom["pdbx_PDB_model_num"].as<std::optional<int>>();
+		if (model_nr)
+			models[*model_nr].push_back(atom);
+		else
+			shared.push_back(atom);
+	}
+
+	if (models.empty())
+		models[1].swap(shared);
+	else if (not shared.empty())
+	{
+		for (auto &[model_nr, atoms] : models)
+			atoms.insert(atoms.end(), shared.begin(), shared.end());
+	}
+
+	std::vector<std::pair<int, std::vector<cif::row_handle>>> work(models.begin(), models.end());
+	std::vector<std::unique_ptr<DSSP_impl>> impls(work.size());
+
+	// Use the threads for the models, unless there is only one
+	auto modelOptions = options;
+	if (work.size() > 1)
+		modelOptions.nr_of_threads = 1;
+
+	parallel_for(work.size(), options.nr_of_threads, 1, [&](size_t i)
+		{
+			auto &[model_nr, atoms] = work[i];
+			impls[i].reset(new DSSP_impl(db, model_nr, modelOptions, atoms));
+			impls[i]->calculate(); });
+
+	std::vector<dssp> result;
+	result.reserve(impls.size());
+	for (auto &impl : impls)
+		result.emplace_back(dssp(impl.release()));
+
+	return result;
+}
+
+int dssp::get_model_nr() const
+{
+	return m_impl->mModelNr;
+}
+
+size_t dssp::atom_count() const
+{
+	return m_impl->mAtomSlots.size();
+}
+
+void dssp::update_coordinates(const float *coordinates, size_t count)
+{
+	m_impl->updateCoordinates(coordinates, count);
+}
+
+void dssp::recompute()
+{
+	m_impl->recalculate();
+}
+
+size_t dssp::atom_count(const key_type &key) const
+{
+	auto r = m_impl->findRes(std::get<0>(key), std::get<1>(key));
+	if (r == m_impl->mResidues.end())
+		throw std::out_of_range("Could not find residue with supplied key");
+
+	auto i = r - m_impl->mResidues.begin();
+	return m_impl->mResidueAtomOffsets[i + 1] - m_impl->mResidueAtomOffsets[i];
+}
+
+void dssp::update_residues(const std::vector<key_type> &residues, const float *coordinates, size_t count)
+{
+	m_impl->updateResidues(residues, coordinates, count);
+}
+
+size_t dssp::size() const
+{
+	return m_impl->mResidues.size();
+}
+
+void dssp::get_types(structure_type *types) const
+{
+	for (auto &res : m_impl->mResidues)
+		*types++ = res.mSecondaryStructure;
+}
+
+void dssp::get_accessibilities(float *accessibilities) const
+{
+	for (auto &res : m_impl->mResidues)
+		*accessibilities++ = res.mAccessibility;
+}
+
+void dssp::get_angles(angle_type angle, float *angles) const
+{
+	const float kMissing = std::numeric_limits<float>::quiet_NaN();
+
+	for (auto &res : m_impl->mResidues)
+	{
+		std::optional<float> v;
+
+		switch (angle)
+		{
+			case angle_type::alpha: v = res.mAnglesCalculated ? res.mAlpha : res.CalculateAlpha(); break;
+			case angle_type::kappa: v = res.mKappa; break;
+			case angle_type::phi: v = res.mPhi; break;
+			case angle_type::psi: v = res.mPsi; break;
+			case angle_type::tco: v = res.mAnglesCalculated ? res.mTCO : res.CalculateTCO(); break;
+			case angle_type::omega: v = res.mAnglesCalculated ? res.mOmega : res.CalculateOmega(); break;
+		}
+
+		*angles++ = v.value_or(kMissing);
+	}
+}
+
+// The partners of all residues, either \a indices or \a energies may be null
+void GetHBondPartners(const std::vector<residue> &inResidues, HBond (residue::*inBonds)[2], int i, int32_t *indices, double *energies)
+{
+	if (i < 0 or i > 1)
+		throw std::out_of_range("There are only two H-bond partners");
+
+	const residue *first = inResidues.data();
+
+	for (auto &res : inResidues)
+	{
+		auto &bond = (res.*inBonds)[i];
+
+		if (indices)
+			*indices++ = bond.res ? static_cast<int32_t>(bond.res - first) : -1;
+		if (energies)
+			*energies++ = bond.energy;
+	}
+}
+
+void dssp::get_acceptors(int i, int32_t *indices, double *energies) const
+{
+	GetHBondPartners(m_impl->mResidues, &residue::mHBondAcceptor, i, indices, energies);
+}
+
+void dssp::get_donors(int i, int32_t *indices, double *energies) const
+{
+	GetHBondPartners(m_impl->mResidues, &residue::mHBondDonor, i, indices, energies);
+}
+
 dssp::iterator dssp::begin() const
 {
 	return iterator(m_impl->mResidues.empty() ? nullptr : m_impl->mResidues.data());
@@ -2247,13 +4244,20 @@ dssp::iterator dssp::end() const
 
 dssp::residue_info dssp::operator[](const key_type &key) const
 {
-	auto i = std::find_if(begin(), end(),
-		[key](const residue_info &res) { return res.asym_id() == std::get<0>(key) and res.seq_id() == std::get<1>(key); });
-	
-	if (i == end())
+	auto r = m_impl->findRes(std::get<0>(key), std::get<1>(key));
+	if (r == m_impl->mResidues.end())
 		throw std::out_of_range("Could not find residue with supplied key");
-	
-	return *i;
+
+	return *iterator(&*r);
+}
+
+dssp::residue_info dssp::get_residue_by_pdb_id(const pdb_key_type &key) const
+{
+	auto r = m_impl->findPDBRes(std::get<0>(key), std::get<1>(key), std::get<2>(key));
+	if (r == m_impl->mResidues.end())
+		throw std::out_of_range("Could not find residue with supplied key");
+
+	return *iterator(&*r);
 }
 
 dssp::statistics dssp::get_statistics() const
@@ -2261,6 +4265,19 @@ dssp::statistics dssp::get_statistics() const
 	return m_impl->mStats;
 }
 
+dssp::timings dssp::get_timings() const
+{
+	return m_impl->mTimings;
+}
+
+dssp::counters dssp::get_counters() const
+{
+	auto result = m_impl->mCounters;
+	result.atoms = m_impl->mAtomSlots.size();
+	result.residues = m_impl->mResidues.size();
+	return result;
+}
+
 std::string dssp::get_pdb_header_line(pdb_record_type pdb_record) const
 {
 	switch (pdb_record)
@@ -2285,9 +4302,35 @@ void dssp::write_legacy_output(std::ostream& os) const
 	writeDSSP(*this, os);
 }
 
-void dssp::annotate(cif::datablock &db, bool writeOther, bool writeDSSPCategories) const
+void dssp::write_binary_output(std::ostream &os) const
+{
+	writeBinary(*this, os);
+}
+
+void dssp::write_secondary_structure(std::ostream &os, ss_string_format format, std::string_view name) const
+{
+	writeSecondaryStructureStrings(*this, os, format, name.empty() ? std::string_view{ m_impl->mDB.name() } : name);
+}
+
+void dssp::annotate(cif::datablock &db, bool writeOther, bool writeDSSPCategories, size_t nr_of_threads) const
+{
+	if (empty() and m_impl->Verbose())
+		m_impl->Log() << "No secondary structure information found" << std::endl;
+
+	annotateDSSP(db, *this, writeOther, writeDSSPCategories, nr_of_threads);
+}
+
+void dssp::annotate(cif::datablock &db, const std::vector<dssp> &models, bool writeOther, bool writeDSSPCategories, size_t nr_of_threads)
+{
+	if (not models.empty() and models.front().empty() and models.front().m_impl->Verbose())
+		models.front().m_impl->Log() << "No secondary structure information found" << std::endl;
+
+	annotateDSSP(db, models, writeOther, writeDSSPCategories, nr_of_threads);
+}
+
+void dssp::extend_dictionary()
 {
-	annotateDSSP(db, *this, writeOther, writeDSSPCategories);
+	extendDictionary();
 }
 
 
@@ -28,16 +28,41 @@
 #include "config.hpp"
 #endif
 
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <exception>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <thread>
+
+#ifndef _WIN32
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 #include <mcfp/mcfp.hpp>
 #include <cif++.hpp>
 
 #include "dssp.hpp"
+#include "result-cache.hpp"
 #include "revision.hpp"
+#include "server-connection.hpp"
 
 namespace fs = std::filesystem;
 
@@ -60,19 +85,1083 @@ void print_what(const std::exception &e)
 
 // --------------------------------------------------------------------
 
+// Flatten an exception and its nested exceptions into a single line
+std::string what_of(const std::exception &e)
+{
+	std::string result = e.what();
+	try
+	{
+		std::rethrow_if_nested(e);
+	}
+	catch (const std::exception &nested)
+	{
+		result += " >> " + what_of(nested);
+	}
+	return result;
+}
+
+// --------------------------------------------------------------------
+
+class legacy_format_error : public std::runtime_error
+{
+  public:
+	legacy_format_error()
+		: std::runtime_error("The data in this file won't fit in the old DSSP format, please use the mmCIF format instead.")
+	{
+	}
+};
+
+struct dssp_options
+{
+	std::string fmt;
+	short pp_stretch = 3;
+	bool write_other = false;
+	bool write_dssp_categories = true;
+	bool calculate_accessibility = false;
+	bool all_models = false;
+	size_t nr_of_threads = 1;
+	size_t surface_dots = dssp::kDefaultSurfaceDots;
+
+	// progress bars of several files at once are of no use
+	bool progress_bar = true;
+};
+
+size_t checked_surface_dots(size_t dots)
+{
+	if (dots < 1 or dots > 100000)
+		throw std::runtime_error("The number of surface dots should be between 1 and 100000");
+	return dots;
+}
+
+// The formats containing only the secondary structure strings
+bool is_ss_string_format(const std::string &fmt)
+{
+	return fmt == "fasta" or fmt == "tsv";
+}
+
+dssp::ss_string_format ss_string_format(const std::string &fmt)
+{
+	return fmt == "tsv" ? dssp::ss_string_format::tsv : dssp::ss_string_format::fasta;
+}
+
+// Only output to mmCIF needs all of the input data
+bool needs_all_input(const dssp_options &options)
+{
+	return options.fmt != "dssp" and options.fmt != "binary" and not is_ss_string_format(options.fmt);
+}
+
+// The characters already read from a stream to see what it contains,
+// followed by the rest of that stream
+class lookahead_streambuf : public std::streambuf
+{
+  public:
+	lookahead_streambuf(std::streambuf *inSource, std::string inRead)
+		: m_source(inSource)
+		, m_buffer(std::move(inRead))
+	{
+		setg(m_buffer.data(), m_buffer.data(), m_buffer.data() + m_buffer.length());
+	}
+
+  protected:
+	int_type underflow() override
+	{
+		m_buffer.resize(kBufferSize);
+
+		auto n = m_source->sgetn(m_buffer.data(), kBufferSize);
+		if (n <= 0)
+			return traits_type::eof();
+
+		setg(m_buffer.data(), m_buffer.data(), m_buffer.data() + n);
+		return traits_type::to_int_type(*gptr());
+	}
+
+  private:
+	static constexpr std::streamsize kBufferSize = 65536;
+
+	std::streambuf *m_source;
+	std::string m_buffer;
+};
+
+cif::file read_input(std::istream &in, const dssp_options &options)
+{
+	if (needs_all_input(options))
+		return cif::pdb::read(in);
+
+	// An mmCIF file starts with a comment or a data block, perhaps after a
+	// byte order mark and white space. PDB files do not.
+	auto buf = in.rdbuf();
+
+	for (int ch : { 0xef, 0xbb, 0xbf })
+	{
+		if (buf->sgetc() != ch)
+			break;
+		buf->sbumpc();
+	}
+
+	while (buf->sgetc() != std::streambuf::traits_type::eof() and std::isspace(buf->sgetc()))
+		buf->sbumpc();
+
+	std::string start(5, 0);
+	start.resize(std::max<std::streamsize>(buf->sgetn(start.data(), start.length()), 0));
+
+	lookahead_streambuf lookahead(buf, start);
+	std::istream is(&lookahead);
+
+	if ((not start.empty() and start.front() == '#') or cif::iequals(start, "data_"))
+		return dssp::read_required_categories(is);
+
+	return cif::pdb::read(is);
+}
+
+cif::file read_input(const fs::path &input, const dssp_options &options)
+{
+	cif::gzio::ifstream in(input);
+	if (not in.is_open())
+		throw std::runtime_error("Could not open file");
+
+	return read_input(in, options);
+}
+
+std::vector<dssp> calculate(cif::file &f, const dssp_options &options)
+{
+	if (options.fmt == "dssp")
+	{
+		if (options.all_models)
+			throw std::runtime_error("The old DSSP format can hold only one model, please use the mmCIF format for all models.");
+
+		// See if the data will fit at all
+		auto &db = f.front();
+		for (const auto &[chain_id, seq_nr] : db["pdbx_poly_seq_scheme"].rows<std::string,int>("pdb_strand_id", "pdb_seq_num"))
+		{
+			if (chain_id.length() > 1 or seq_nr > 99999)
+				throw legacy_format_error();
+		}
+	}
+
+	dssp::options settings;
+	settings.min_poly_proline_stretch_length = options.pp_stretch;
+	settings.nr_of_threads = options.nr_of_threads;
+	settings.surface_dots = options.surface_dots;
+	settings.progress_bar = options.progress_bar and (cif::VERBOSE == 0 or cif::VERBOSE == 1);
+	settings.verbose = cif::VERBOSE;
+	settings.log = &std::cerr;
+
+	using flags = dssp::calculate_flags;
+
+	if (is_ss_string_format(options.fmt))
+	{
+		// Only the secondary structure itself is needed
+		settings.flags = flags::none;
+	}
+	else
+	{
+		settings.flags = flags::all;
+		if (options.fmt != "dssp" and options.fmt != "binary" and not options.calculate_accessibility)
+			settings.flags = settings.flags & ~flags::accessibility;
+	}
+
+	std::vector<dssp> result;
+
+	if (options.all_models)
+		result = dssp::calculate_all_models(f.front(), settings);
+	else
+		result.emplace_back(f.front(), 1, settings);
+
+	return result;
+}
+
+void write_output(std::ostream &os, cif::file &f, const std::vector<dssp> &models, const dssp_options &options)
+{
+	if (options.fmt == "dssp")
+		models.front().write_legacy_output(os);
+	else if (options.fmt == "binary")
+	{
+		for (auto &model : models)
+			model.write_binary_output(os);
+	}
+	else if (is_ss_string_format(options.fmt))
+	{
+		for (auto &model : models)
+			model.write_secondary_structure(os, ss_string_format(options.fmt));
+	}
+	else
+	{
+		dssp::annotate(f.front(), models, options.write_other, options.write_dssp_categories, options.nr_of_threads);
+		os << f.front();
+	}
+}
+
+void write_output(const fs::path &output, cif::file &f, const std::vector<dssp> &models, const dssp_options &options)
+{
+	cif::gzio::ofstream out(output);
+
+	if (not out.is_open())
+		throw std::runtime_error("Could not open output file");
+
+	write_output(out, f, models, options);
+}
+
+// --------------------------------------------------------------------
+// The timings and counters of the calculation. read and write are the
+// times spent reading the input and writing the output as measured here.
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::string json_string(std::string_view s)
+{
+	std::ostringstream os;
+	os << '"';
+	for (char ch : s)
+	{
+		if (ch == '"' or ch == '\\')
+			os << '\\' << ch;
+		else if (static_cast<unsigned char>(ch) < 0x20)
+			os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(ch) << std::dec;
+		else
+			os << ch;
+	}
+	os << '"';
+	return os.str();
+}
+
+// Write the metrics as a single line of JSON
+// For output taken from the cache there are no models.
+void write_metrics(std::ostream &os, const fs::path &input, double read, double write, bool cached, const std::vector<dssp> &models)
+{
+	os << "{\"input\":" << json_string(input.string()) << ",\"read\":" << read << ",\"write\":" << write
+	   << ",\"cached\":" << (cached ? "true" : "false") << ",\"models\":[";
+
+	bool first = true;
+	for (auto &model : models)
+	{
+		auto t = model.get_timings();
+		auto c = model.get_counters();
+
+		os << (first ? "" : ",")
+		   << "{\"model\":" << model.get_model_nr()
+		   << ",\"timings\":{\"load\":" << t.load << ",\"hydrogens\":" << t.hydrogens << ",\"geometry\":" << t.geometry
+		   << ",\"pair_search\":" << t.pair_search << ",\"hbond_energies\":" << t.hbond_energies
+		   << ",\"beta_sheets\":" << t.beta_sheets << ",\"helices\":" << t.helices << ",\"pp_helices\":" << t.pp_helices
+		   << ",\"accessibility\":" << t.accessibility << '}'
+		   << ",\"counters\":{\"atoms\":" << c.atoms << ",\"residues\":" << c.residues
+		   << ",\"candidate_pairs\":" << c.candidate_pairs << ",\"bridges\":" << c.bridges << ",\"ladders\":" << c.ladders
+		   << ",\"neighbours\":" << c.neighbours << ",\"neighbour_atoms\":" << c.neighbour_atoms
+		   << ",\"surface_dots\":" << c.surface_dots << "}}";
+
+		first = false;
+	}
+
+	os << "]}" << std::endl;
+}
+
+// The same in a more readable form, for --verbose
+void report_metrics(std::ostream &os, double read, double write, const std::vector<dssp> &models)
+{
+	auto line = [&os](const char *name, double seconds)
+	{
+		os << "  " << std::left << std::setw(16) << name << std::right << std::fixed << std::setprecision(6) << std::setw(12) << seconds << " s" << std::endl;
+	};
+
+	auto count = [&os](const char *name, uint64_t n)
+	{
+		os << "  " << std::left << std::setw(16) << name << std::right << std::setw(12) << n << std::endl;
+	};
+
+	auto flags = os.flags();
+	auto precision = os.precision();
+
+	line("read", read);
+
+	for (auto &model : models)
+	{
+		auto t = model.get_timings();
+		auto c = model.get_counters();
+
+		os << "model " << model.get_model_nr() << std::endl;
+		line("load", t.load);
+		line("hydrogens", t.hydrogens);
+		line("geometry", t.geometry);
+		line("pair search", t.pair_search);
+		line("hbond energies", t.hbond_energies);
+		line("beta sheets", t.beta_sheets);
+		line("helices", t.helices);
+		line("pp helices", t.pp_helices);
+		line("accessibility", t.accessibility);
+
+		count("atoms", c.atoms);
+		count("residues", c.residues);
+		count("candidate pairs", c.candidate_pairs);
+		count("bridges", c.bridges);
+		count("ladders", c.ladders);
+		count("neighbours", c.neighbours);
+		count("neighbour atoms", c.neighbour_atoms);
+		count("surface dots", c.surface_dots);
+	}
+
+	line("write", write);
+
+	os.flags(flags);
+	os.precision(precision);
+}
+
+// --------------------------------------------------------------------
+
+// Only the output formats that do not contain the input can be cached
+bool is_cacheable_format(const std::string &fmt)
+{
+	return fmt == "dssp" or fmt == "binary" or is_ss_string_format(fmt);
+}
+
+// \a name is the name used in the output of the secondary structure formats
+std::string cache_key(const cif::datablock &db, const dssp_options &options, std::string_view name)
+{
+	return content_key(db, { kVersionNumber, options.fmt, std::to_string(options.pp_stretch),
+							   options.all_models ? "all-models" : "first-model",
+							   options.calculate_accessibility ? "accessibility" : "no-accessibility",
+							   std::to_string(options.surface_dots), name });
+}
+
+// Return the output for \a db from the cache when possible, otherwise the
+// output returned by \a calculate_output is stored in the cache
+template <typename F>
+std::string cached_output(result_cache *cache, const cif::datablock &db, const dssp_options &options, std::string_view name,
+	F &&calculate_output, bool *outHit = nullptr)
+{
+	if (outHit != nullptr)
+		*outHit = false;
+
+	if (cache == nullptr or not is_cacheable_format(options.fmt))
+		return calculate_output();
+
+	auto key = cache_key(db, options, name);
+	if (auto output = cache->find(key))
+	{
+		if (options.fmt == "dssp")
+			refresh_legacy_date(*output);
+		if (outHit != nullptr)
+			*outHit = true;
+		return *output;
+	}
+
+	auto output = calculate_output();
+	cache->store(key, output);
+	return output;
+}
+
+// --------------------------------------------------------------------
+// Batch mode, process all files in a list file, a directory or named on
+// stdin using a number of worker threads. Each file gets its own report
+// line, a failure does not stop the batch.
+
+template <typename T>
+class blocking_queue
+{
+  public:
+	blocking_queue(size_t inCapacity)
+		: m_capacity(inCapacity)
+	{
+	}
+
+	void push(T v)
+	{
+		std::unique_lock lock(m_mutex);
+		m_not_full.wait(lock, [this]
+			{ return m_queue.size() < m_capacity; });
+		m_queue.push_back(std::move(v));
+		m_not_empty.notify_one();
+	}
+
+	// Returns an empty optional when the queue is closed and drained
+	std::optional<T> pop()
+	{
+		std::unique_lock lock(m_mutex);
+		m_not_empty.wait(lock, [this]
+			{ return m_closed or not m_queue.empty(); });
+
+		if (m_queue.empty())
+			return {};
+
+		T v = std::move(m_queue.front());
+		m_queue.pop_front();
+		m_not_full.notify_one();
+		return v;
+	}
+
+	void close()
+	{
+		std::unique_lock lock(m_mutex);
+		m_closed = true;
+		m_not_empty.notify_all();
+	}
+
+  private:
+	std::mutex m_mutex;
+	std::condition_variable m_not_empty, m_not_full;
+	std::deque<T> m_queue;
+	size_t m_capacity;
+	bool m_closed = false;
+};
+
+bool is_input_file(const fs::path &p)
+{
+	auto name = p.filename();
+	if (name.extension() == ".gz" or name.extension() == ".xz")
+		name = name.stem();
+
+	auto ext = name.extension();
+	return ext == ".cif" or ext == ".mmcif" or ext == ".pdb" or ext == ".ent";
+}
+
+// Report each input file found in \a batch, which is either a directory,
+// a file containing file names, or - for stdin. Along with the input the
+// name for the output is passed, the path relative to the directory or
+// only the file name for the inputs in a list.
+template <typename F>
+void for_each_batch_input(const std::string &batch, F &&f)
+{
+	auto read_list = [&f](std::istream &is)
+	{
+		std::string line;
+		while (std::getline(is, line))
+		{
+			auto b = line.find_first_not_of(" \t\r");
+			auto e = line.find_last_not_of(" \t\r");
+			if (b == std::string::npos or line[b] == '#')
+				continue;
+
+			fs::path input(line.substr(b, e - b + 1));
+			f(input, input.filename());
+		}
+	};
+
+	if (batch == "-")
+		read_list(std::cin);
+	else if (fs::is_directory(batch))
+	{
+		for (auto &entry : fs::recursive_directory_iterator(batch, fs::directory_options::skip_permission_denied))
+		{
+			if (entry.is_regular_file() and is_input_file(entry.path()))
+				f(entry.path(), entry.path().lexically_relative(batch));
+		}
+	}
+	else
+	{
+		std::ifstream list(batch);
+		if (not list.is_open())
+			throw std::runtime_error("Could not open batch file " + batch);
+		read_list(list);
+	}
+}
+
+struct batch_options
+{
+	fs::path output_dir = ".";
+	size_t nr_of_jobs = 1;
+	size_t nr_of_io_threads = 1;
+	bool compress = false;
+
+	// For the secondary structure string formats, all output goes to this
+	// single file. Or to stdout when it is - in which case the report
+	// lines go to stderr.
+	std::string aggregated_output = "-";
+
+	// Write the metrics for each file as a line of JSON to this file, or
+	// to stderr when it is -
+	std::string metrics_output;
+
+	result_cache *cache = nullptr;
+};
+
+// The file name of \a input without directory and extensions
+fs::path input_stem(const fs::path &input)
+{
+	auto name = input.filename();
+	if (name.extension() == ".gz" or name.extension() == ".xz")
+		name = name.stem();
+	if (is_input_file(name))
+		name = name.stem();
+	return name;
+}
+
+// The output file for the input with output name \a name, see
+// for_each_batch_input. The subdirectories of that name are kept.
+fs::path batch_output_name(const fs::path &name, const dssp_options &options, const batch_options &batch)
+{
+	auto result = input_stem(name);
+	if (options.fmt == "dssp")
+		result += ".dssp";
+	else if (options.fmt == "binary")
+		result += ".bdssp";
+	else
+		result += ".cif";
+	if (batch.compress)
+		result += ".gz";
+
+	return (batch.output_dir / name.parent_path() / result).lexically_normal();
+}
+
+// A file travelling through the pipeline
+struct batch_item
+{
+	fs::path input;
+	fs::path output_file;
+	std::optional<cif::file> file;
+	std::string output;	// for the formats other than mmCIF
+	std::string error;
+
+	// kept for the metrics
+	std::vector<dssp> models;
+	double read_time = 0;
+	bool cached = false;
+};
+
+// The batch is processed in three stages, connected by bounded queues:
+// reading and parsing, calculating and annotating, and writing. That way
+// (de)compression of one file overlaps the calculation of another.
+int run_batch(const std::string &inputs, const dssp_options &options, batch_options batch)
+{
+	if (batch.nr_of_jobs == 0)
+		batch.nr_of_jobs = std::max<size_t>(1, std::thread::hardware_concurrency());
+	if (batch.nr_of_io_threads == 0)
+		batch.nr_of_io_threads = 1;
+
+	bool aggregate = is_ss_string_format(options.fmt);
+
+	if (not aggregate and not fs::exists(batch.output_dir))
+		fs::create_directories(batch.output_dir);
+
+	std::optional<cif::gzio::ofstream> aggregated_file;
+	if (aggregate and batch.aggregated_output != "-")
+	{
+		aggregated_file.emplace(batch.aggregated_output);
+		if (not aggregated_file->is_open())
+			throw std::runtime_error("Could not open output file " + batch.aggregated_output);
+	}
+
+	std::ostream &aggregated = aggregated_file ? static_cast<std::ostream &>(*aggregated_file) : std::cout;
+	std::ostream &report = aggregate and not aggregated_file ? std::cerr : std::cout;
+
+	std::optional<std::ofstream> metrics_file;
+	if (not batch.metrics_output.empty() and batch.metrics_output != "-")
+	{
+		metrics_file.emplace(batch.metrics_output);
+		if (not metrics_file->is_open())
+			throw std::runtime_error("Could not open metrics file " + batch.metrics_output);
+	}
+
+	std::ostream &metrics = metrics_file ? static_cast<std::ostream &>(*metrics_file) : std::cerr;
+
+	// Before the worker threads start using the shared validator
+	if (not aggregate and options.fmt != "dssp" and options.fmt != "binary")
+		dssp::extend_dictionary();
+
+	blocking_queue<batch_item> names(2 * batch.nr_of_io_threads);
+	blocking_queue<batch_item> parsed(batch.nr_of_jobs);
+	blocking_queue<batch_item> calculated(batch.nr_of_io_threads);
+
+	std::mutex report_mutex;
+	size_t processed = 0, failed = 0;
+
+	auto reader = [&]()
+	{
+		while (auto item = names.pop())
+		{
+			if (item->error.empty())
+			{
+				try
+				{
+					auto start = std::chrono::steady_clock::now();
+					item->file.emplace(read_input(item->input, options));
+					item->read_time = seconds_since(start);
+				}
+				catch (const std::exception &ex)
+				{
+					item->error = what_of(ex);
+				}
+			}
+
+			parsed.push(std::move(*item));
+		}
+	};
+
+	auto calculator = [&]()
+	{
+		while (auto item = parsed.pop())
+		{
+			if (item->error.empty())
+			{
+				try
+				{
+					auto &db = item->file->front();
+
+					if (options.fmt == "dssp" or options.fmt == "binary" or aggregate)
+					{
+						auto name = db.name();
+						if (name.empty())
+							name = input_stem(item->input).string();
+
+						item->output = cached_output(batch.cache, db, options, name, [&]()
+							{
+								auto models = calculate(*item->file, options);
+
+								std::ostringstream os;
+								if (aggregate)
+								{
+									for (auto &model : models)
+										model.write_secondary_structure(os, ss_string_format(options.fmt), name);
+								}
+								else
+									write_output(os, *item->file, models, options);
+
+								if (not batch.metrics_output.empty())
+									item->models = std::move(models);
+
+								return os.str(); },
+							&item->cached);
+					}
+					else
+					{
+						auto models = calculate(*item->file, options);
+						dssp::annotate(db, models, options.write_other, options.write_dssp_categories, options.nr_of_threads);
+
+						if (not batch.metrics_output.empty())
+							item->models = std::move(models);
+					}
+				}
+				catch (const std::exception &ex)
+				{
+					item->error = what_of(ex);
+				}
+			}
+
+			calculated.push(std::move(*item));
+		}
+	};
+
+	auto writer = [&]()
+	{
+		while (auto item = calculated.pop())
+		{
+			auto start = std::chrono::steady_clock::now();
+
+			if (item->error.empty() and aggregate)
+			{
+				std::unique_lock lock(report_mutex);
+				aggregated << item->output;
+			}
+			else if (item->error.empty())
+			{
+				try
+				{
+					std::error_code ec;
+					fs::create_directories(item->output_file.parent_path(), ec);
+
+					cif::gzio::ofstream out(item->output_file);
+
+					if (not out.is_open())
+						throw std::runtime_error("Could not open output file");
+
+					if (options.fmt == "dssp" or options.fmt == "binary")
+						out << item->output;
+					else
+						out << item->file->front();
+				}
+				catch (const std::exception &ex)
+				{
+					item->error = what_of(ex);
+				}
+			}
+
+			double write_time = seconds_since(start);
+
+			std::unique_lock lock(report_mutex);
+
+			if (not batch.metrics_output.empty() and (not item->models.empty() or item->cached))
+				write_metrics(metrics, item->input, item->read_time, write_time, item->cached, item->models);
+
+			++processed;
+			if (item->error.empty())
+				report << item->input.string() << "\tOK" << std::endl;
+			else
+			{
+				++failed;
+				report << item->input.string() << "\tFAILED\t" << item->error << std::endl;
+			}
+		}
+	};
+
+	std::vector<std::thread> readers, calculators, writers;
+	for (size_t i = 0; i < batch.nr_of_io_threads; ++i)
+	{
+		readers.emplace_back(reader);
+		writers.emplace_back(writer);
+	}
+	for (size_t i = 0; i < batch.nr_of_jobs; ++i)
+		calculators.emplace_back(calculator);
+
+	// Shut down the stages in order, each stage drains its input queue
+	auto finish = [&]()
+	{
+		names.close();
+		for (auto &t : readers)
+			t.join();
+
+		parsed.close();
+		for (auto &t : calculators)
+			t.join();
+
+		calculated.close();
+		for (auto &t : writers)
+			t.join();
+	};
+
+	try
+	{
+		// Two inputs writing the same output file would overwrite each
+		// other, the second one fails instead
+		std::set<fs::path> outputs;
+
+		for_each_batch_input(inputs, [&](const fs::path &input, const fs::path &name)
+			{
+				batch_item item{ input };
+
+				if (not aggregate)
+				{
+					item.output_file = batch_output_name(name, options, batch);
+					if (not outputs.insert(item.output_file).second)
+						item.error = "The output file " + item.output_file.string() + " is also written for another input";
+				}
+
+				names.push(std::move(item)); });
+	}
+	catch (...)
+	{
+		finish();
+		throw;
+	}
+
+	finish();
+
+	aggregated.flush();
+
+	if (cif::VERBOSE > 0)
+	{
+		std::cerr << "Processed " << processed << " files, " << failed << " failed" << std::endl;
+		if (batch.cache != nullptr)
+			std::cerr << "Cache hits: " << batch.cache->hits() << ", misses: " << batch.cache->misses() << std::endl;
+	}
+
+	return failed == 0 ? 0 : 1;
+}
+
+// --------------------------------------------------------------------
+// Server mode, listen on a Unix domain socket and handle requests using
+// a pool of worker threads. The dictionaries and tables are loaded only
+// once, that way the overhead per request is small. The requests and
+// replies are described in server-connection.hpp.
+
+#ifndef _WIN32
+
+struct server_options
+{
+	size_t nr_of_workers = 1;
+
+	// The maximum size in bytes of the structure in a request
+	size_t max_request_size = size_t(256) << 20;
+
+	connection_timeouts timeouts;
+
+	result_cache *cache = nullptr;
+};
+
+// Calculate the result for a single request
+std::string handle_request(const std::string &header, const std::string &data, dssp_options options, result_cache *cache)
+{
+	std::istringstream is(header);
+	std::string item;
+	while (is >> item)
+	{
+		auto eq = item.find('=');
+		if (eq == std::string::npos)
+			throw std::runtime_error("Invalid item in header: " + item);
+
+		auto key = item.substr(0, eq);
+		auto value = item.substr(eq + 1);
+
+		if (key == "format")
+		{
+			if (value != "dssp" and value != "mmcif" and value != "binary" and not is_ss_string_format(value))
+				throw std::runtime_error("Unsupported format " + value);
+			options.fmt = value;
+		}
+		else if (key == "all-models")
+			options.all_models = value == "1";
+		else if (key == "calculate-accessibility")
+			options.calculate_accessibility = value == "1";
+		else if (key == "write-other")
+			options.write_other = value == "1";
+		else if (key == "min-pp-stretch")
+			options.pp_stretch = static_cast<short>(std::stoi(value));
+		else if (key == "surface-dots")
+			options.surface_dots = checked_surface_dots(std::stoul(value));
+		else if (key != "length")
+			throw std::runtime_error("Unknown item in header: " + key);
+	}
+
+	if (options.fmt.empty())
+		options.fmt = "mmcif";
+
+	struct membuf : public std::streambuf
+	{
+		membuf(const std::string &data)
+		{
+			auto p = const_cast<char *>(data.data());
+			this->setg(p, p, p + data.length());
+		}
+	} buffer(data);
+
+	std::istream in(&buffer);
+	auto f = read_input(in, options);
+
+	return cached_output(cache, f.front(), options, {}, [&]()
+		{
+			auto models = calculate(f, options);
+
+			std::ostringstream os;
+			write_output(os, f, models, options);
+			return os.str(); });
+}
+
+void serve_connection(server_connection &connection, const dssp_options &options, const server_options &server)
+{
+	std::string header, data;
+
+	while (connection.read_line(header))
+	{
+		std::string reply;
+		bool ok = true;
+
+		try
+		{
+			connection.read(data, request_length(header, server.max_request_size));
+
+			try
+			{
+				reply = handle_request(header, data, options, server.cache);
+			}
+			catch (const std::exception &ex)
+			{
+				reply = what_of(ex);
+				ok = false;
+			}
+		}
+		catch (const std::exception &ex)
+		{
+			// The header or the data could not be read, the rest of
+			// the connection would be out of sync
+			connection.write("ERROR " + std::to_string(std::strlen(ex.what())) + "\n" + ex.what());
+			return;
+		}
+
+		connection.write((ok ? "OK " : "ERROR ") + std::to_string(reply.length()) + "\n");
+		connection.write(reply);
+	}
+}
+
+// Written to by the signal handler to stop the server
+int gServerStopFd = -1;
+
+extern "C" void stop_server(int)
+{
+	char ch = 0;
+	[[maybe_unused]] auto n = ::write(gServerStopFd, &ch, 1);
+}
+
+int run_server(const fs::path &socket_path, const dssp_options &options, server_options server)
+{
+	if (server.nr_of_workers == 0)
+		server.nr_of_workers = std::max<size_t>(1, std::thread::hardware_concurrency());
+
+	// Writing to a connection closed by the client should not end the server
+	std::signal(SIGPIPE, SIG_IGN);
+
+	// Before the worker threads start using the shared validator
+	dssp::extend_dictionary();
+
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+
+	if (socket_path.string().length() >= sizeof(address.sun_path))
+		throw std::runtime_error("Socket path is too long");
+	std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+	// A socket left by a previous run is removed, but not when another
+	// server is still listening on it
+	std::error_code ec;
+	if (fs::is_socket(socket_path, ec))
+	{
+		int probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if (probe < 0)
+			throw std::runtime_error(std::string("Could not create socket: ") + std::strerror(errno));
+
+		bool live = ::connect(probe, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0;
+		auto err = errno;
+		::close(probe);
+
+		if (live)
+			throw std::runtime_error("Another server is already listening on " + socket_path.string());
+		if (err != ECONNREFUSED)
+			throw std::runtime_error("Could not check the existing socket " + socket_path.string() + ": " + std::strerror(err));
+
+		fs::remove(socket_path);
+	}
+
+	int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		throw std::runtime_error(std::string("Could not create socket: ") + std::strerror(errno));
+
+	// Only the owner may connect, the socket is created with these
+	// permissions so there is no moment it is open to others
+	auto mask = ::umask(0177);
+	bool bound = ::bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0;
+	auto err = errno;
+	::umask(mask);
+
+	if (not bound or ::listen(fd, 64) < 0)
+	{
+		if (bound)
+			err = errno;
+		::close(fd);
+		throw std::runtime_error("Could not listen on " + socket_path.string() + ": " + std::strerror(err));
+	}
+
+	// The workers wait for a connection or a stop, a worker that loses the
+	// race for a connection should not block in accept
+	::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	// SIGTERM and SIGINT stop the server, the requests being handled are
+	// finished first
+	int stop[2];
+	if (::pipe(stop) < 0)
+	{
+		::close(fd);
+		throw std::runtime_error(std::string("Could not create pipe: ") + std::strerror(errno));
+	}
+
+	gServerStopFd = stop[1];
+
+	struct sigaction action = {};
+	action.sa_handler = stop_server;
+	sigemptyset(&action.sa_mask);
+	::sigaction(SIGTERM, &action, nullptr);
+	::sigaction(SIGINT, &action, nullptr);
+
+	if (cif::VERBOSE > 0)
+		std::cerr << "Listening on " << socket_path << " using " << server.nr_of_workers << " workers" << std::endl;
+
+	// The workers accept connections themselves and handle them one at a time
+	auto worker = [fd, stop_fd = stop[0], &options, &server]()
+	{
+		for (;;)
+		{
+			pollfd fds[2] = { { fd, POLLIN, 0 }, { stop_fd, POLLIN, 0 } };
+			if (::poll(fds, 2, -1) < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+
+			if (fds[1].revents != 0)
+				break;
+
+			int client = ::accept(fd, nullptr, nullptr);
+			if (client < 0)
+			{
+				if (errno == EINTR or errno == ECONNABORTED or errno == EAGAIN or errno == EWOULDBLOCK)
+					continue;
+				break;
+			}
+
+			// Some systems pass on O_NONBLOCK to the accepted socket
+			::fcntl(client, F_SETFL, ::fcntl(client, F_GETFL) & ~O_NONBLOCK);
+
+			try
+			{
+				server_connection connection(client, stop_fd, server.timeouts);
+				serve_connection(connection, options, server);
+			}
+			catch (const std::exception &ex)
+			{
+				if (cif::VERBOSE > 0)
+					std::cerr << "Error in connection: " << what_of(ex) << std::endl;
+			}
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < server.nr_of_workers; ++i)
+		workers.emplace_back(worker);
+
+	for (auto &t : workers)
+		t.join();
+
+	std::signal(SIGTERM, SIG_DFL);
+	std::signal(SIGINT, SIG_DFL);
+
+	::close(fd);
+	::close(stop[0]);
+	::close(stop[1]);
+	gServerStopFd = -1;
+
+	fs::remove(socket_path, ec);
+
+	if (cif::VERBOSE > 0)
+		std::cerr << "Server stopped" << std::endl;
+
+	return 0;
+}
+
+#endif
+
+// --------------------------------------------------------------------
+
 int d_main(int argc, const char *argv[])
 {
 	using namespace std::literals;
 
 	auto &config = mcfp::config::instance();
 
-	config.init("Usage: mkdssp [options] input-file [output-file]",
-		mcfp::make_option<std::string>("output-format", "Output format, can be either 'dssp' for classic DSSP or 'mmcif' for annotated mmCIF. The default is chosen based on the extension of the output file, if any."),
+	config.init("Usage: mkdssp [options] input-file [output-file]\n       mkdssp [options] --batch list-file|directory|- [--output-dir directory]",
+		mcfp::make_option<std::string>("output-format", "Output format, can be either 'dssp' for classic DSSP, 'mmcif' for annotated mmCIF, 'binary' for the binary columnar format or 'fasta' or 'tsv' for only the secondary structure string of each chain. The default is chosen based on the extension of the output file, if any."),
 		mcfp::make_option<short>("min-pp-stretch", 3, "Minimal number of residues having PSI/PHI in range for a PP helix, default is 3"),
 		mcfp::make_option("write-other", "If set, write the type OTHER for loops, default is to leave this out"),
 		mcfp::make_option("no-dssp-categories", "If set, will suppress output of new DSSP output in mmCIF format"),
 
 		mcfp::make_option("calculate-accessibility", "Default is to not calculate the surface accessibility when the output format is mmCIF"),
+		mcfp::make_option<size_t>("surface-dots", dssp::kDefaultSurfaceDots, "Number of dots on the sphere around each atom used to calculate the surface accessibility, fewer is faster but less accurate, default is 401"),
+		mcfp::make_option("all-models", "Calculate the secondary structure for all models, not just the first. Only for mmCIF output"),
+		mcfp::make_option<unsigned short>("threads", 1, "Number of threads to use for calculating H-bond energies and the surface accessibility and for writing the mmCIF annotation, use 0 to use all cores, default is 1"),
+
+		mcfp::make_option<std::string>("batch", "Process all files listed in this file, or found in this directory. Use - to read the file names from stdin"),
+		mcfp::make_option<std::string>("output-dir", "Directory to write the output files to in batch mode, default is the current directory"),
+		mcfp::make_option<unsigned short>("jobs", 1, "Number of files to process in parallel in batch mode, use 0 to use all cores, default is 1"),
+		mcfp::make_option<unsigned short>("io-threads", 1, "Number of threads for reading and for writing files in batch mode, default is 1"),
+		mcfp::make_option("compress", "Write gzip compressed output files in batch mode"),
+		mcfp::make_option<std::string>("batch-output", "File to write the output of all files to in batch mode for the fasta and tsv formats, default is stdout"),
+#ifndef _WIN32
+		mcfp::make_option<std::string>("server", "Run as a server listening on this Unix domain socket, requests are handled by --jobs workers"),
+		mcfp::make_option<size_t>("max-request-size", "The maximum size in MB of the structure in a request in server mode, the default is 256"),
+		mcfp::make_option<unsigned short>("idle-timeout", "Seconds a connection may wait for the next request in server mode before it is closed, 0 is forever, the default is 10"),
+		mcfp::make_option<unsigned short>("read-timeout", "Seconds a request in server mode may wait for more data, or for the client to read the reply, 0 is forever, the default is 30"),
+#endif
+		mcfp::make_option<std::string>("cache-dir", "Directory to cache the output in for batch and server mode, for the formats other than mmCIF"),
+		mcfp::make_option<size_t>("cache-size", "The amount of memory in MB used to cache the output in batch and server mode, the default is 64"),
+		mcfp::make_option<size_t>("cache-dir-size", "The maximum size in MB of the cached output in --cache-dir, the least recently used are removed first, 0 means no limit, the default is 1024"),
+		mcfp::make_option<std::string>("metrics", "Write the timings and counters of the calculation as JSON to this file, use - for stderr. In batch mode one line is written per file"),
 
 		mcfp::make_option<std::string>("mmcif-dictionary", "Path to the mmcif_pdbx.dic file to use instead of default"),
 
@@ -93,15 +1182,16 @@ int d_main(int argc, const char *argv[])
 		exit(0);
 	}
 
-	if (config.has("help") or config.operands().empty())
+	if (config.has("help") or (config.operands().empty() and not config.has("batch") and not config.has("server")))
 	{
 		std::cerr << config << std::endl;
 		exit(config.has("help") ? 0 : 1);
 	}
 
-	if (config.has("output-format") and config.get<std::string>("output-format") != "dssp" and config.get<std::string>("output-format") != "mmcif")
+	if (config.has("output-format") and config.get<std::string>("output-format") != "dssp" and config.get<std::string>("output-format") != "mmcif" and
+		config.get<std::string>("output-format") != "binary" and not is_ss_string_format(config.get<std::string>("output-format")))
 	{
-		std::cerr << "Output format should be one of 'dssp' or 'mmcif'" << std::endl;
+		std::cerr << "Output format should be one of 'dssp', 'mmcif', 'binary', 'fasta' or 'tsv'" << std::endl;
 		exit(1);
 	}
 
@@ -116,90 +1206,177 @@ int d_main(int argc, const char *argv[])
 	if (config.has("mmcif-dictionary"))
 		cif::add_file_resource("mmcif_pdbx.dic", config.get<std::string>("mmcif-dictionary"));
 
-	cif::gzio::ifstream in(config.operands().front());
-	if (not in.is_open())
-	{
-		std::cerr << "Could not open file" << std::endl;
-		exit(1);
-	}
+	dssp_options options;
 
-	cif::file f = cif::pdb::read(in);
+	if (config.has("min-pp-stretch"))
+		options.pp_stretch = config.get<short>("min-pp-stretch");
 
-	// --------------------------------------------------------------------
+	options.write_other = config.has("write-other");
+	options.write_dssp_categories = not config.has("no-dssp-categories");
+	options.calculate_accessibility = config.has("calculate-accessibility");
+	options.all_models = config.has("all-models");
 
-	short pp_stretch = 3;
-	if (config.has("min-pp-stretch"))
-		pp_stretch = config.get<short>("min-pp-stretch");
+	if (config.has("threads"))
+		options.nr_of_threads = config.get<unsigned short>("threads");
 
-	bool writeOther = config.has("write-other");
+	if (config.has("surface-dots"))
+		options.surface_dots = checked_surface_dots(config.get<size_t>("surface-dots"));
 
-	std::string fmt;
 	if (config.has("output-format"))
-		fmt = config.get<std::string>("output-format");
+		options.fmt = config.get<std::string>("output-format");
 
-	fs::path output;
-	if (config.operands().size() > 1)
-		output = config.operands()[1];
+	// --------------------------------------------------------------------
 
-	if (fmt.empty() and not output.empty())
+	for (auto server_option : { "max-request-size", "idle-timeout", "read-timeout" })
 	{
-		if (output.extension() == ".gz" or output.extension() == ".xz")
+		if (config.has(server_option) and not config.has("server"))
 		{
-			if (output.stem().extension() == ".dssp")
-				fmt = "dssp";
-			else
-				fmt = "cif";
+			std::cerr << "The " << server_option << " option can only be used in server mode" << std::endl;
+			exit(1);
 		}
-		else if (output.extension() == ".dssp")
-			fmt = "dssp";
-		else
-			fmt = "cif";
 	}
 
-	if (fmt == "dssp")
+	bool use_cache = config.has("cache-dir") or config.has("cache-size") or config.has("cache-dir-size");
+
+	if (use_cache and not config.has("batch") and not config.has("server"))
 	{
-		// See if the data will fit at all
-		auto &db = f.front();
-		for (const auto &[chain_id, seq_nr] : db["pdbx_poly_seq_scheme"].rows<std::string,int>("pdb_strand_id", "pdb_seq_num"))
+		std::cerr << "The cache options can only be used in batch and server mode" << std::endl;
+		exit(1);
+	}
+
+	std::unique_ptr<result_cache> cache;
+	if (use_cache)
+	{
+		size_t size = config.has("cache-size") ? config.get<size_t>("cache-size") : 64;
+		size_t dir_size = config.has("cache-dir-size") ? config.get<size_t>("cache-dir-size") : 1024;
+		cache.reset(new result_cache(size * 1024 * 1024, config.has("cache-dir") ? config.get<std::string>("cache-dir") : "",
+			static_cast<uintmax_t>(dir_size) * 1024 * 1024));
+	}
+
+	if (config.has("batch"))
+	{
+		batch_options batch;
+
+		if (config.has("output-dir"))
+			batch.output_dir = config.get<std::string>("output-dir");
+
+		if (config.has("jobs"))
+			batch.nr_of_jobs = config.get<unsigned short>("jobs");
+
+		if (config.has("io-threads"))
+			batch.nr_of_io_threads = config.get<unsigned short>("io-threads");
+
+		batch.compress = config.has("compress");
+
+		if (config.has("batch-output"))
+			batch.aggregated_output = config.get<std::string>("batch-output");
+
+		if (config.has("metrics"))
+			batch.metrics_output = config.get<std::string>("metrics");
+
+		batch.cache = cache.get();
+
+		options.progress_bar = false;
+
+		return run_batch(config.get<std::string>("batch"), options, batch);
+	}
+
+#ifndef _WIN32
+	if (config.has("server"))
+	{
+		server_options server;
+
+		if (config.has("jobs"))
+			server.nr_of_workers = config.get<unsigned short>("jobs");
+
+		if (config.has("max-request-size"))
+			server.max_request_size = config.get<size_t>("max-request-size") << 20;
+
+		// in seconds, 0 means no timeout
+		auto timeout = [&config](const char *name, int &ioMilliseconds)
 		{
-			if (chain_id.length() > 1 or seq_nr > 99999)
+			if (config.has(name))
 			{
-				std::cerr << "The data in this file won't fit in the old DSSP format, please use the mmCIF format instead." << std::endl;
-				exit(2);
+				auto seconds = config.get<unsigned short>(name);
+				ioMilliseconds = seconds == 0 ? -1 : seconds * 1000;
 			}
-		}
+		};
+
+		timeout("idle-timeout", server.timeouts.idle);
+		timeout("read-timeout", server.timeouts.read);
+
+		server.cache = cache.get();
+
+		// progress bars are of no use in a server
+		options.progress_bar = false;
+
+		return run_server(config.get<std::string>("server"), options, server);
 	}
+#endif
 
-	dssp dssp(f.front(), 1, pp_stretch, fmt == "dssp" or config.has("calculate-accessibility"));
+	// --------------------------------------------------------------------
 
-	if (not output.empty())
-	{
-		cif::gzio::ofstream out(output);
+	fs::path output;
+	if (config.operands().size() > 1)
+		output = config.operands()[1];
 
-		if (not out.is_open())
-		{
-			std::cerr << "Could not open output file" << std::endl;
-			exit(1);
-		}
+	if (options.fmt.empty() and not output.empty())
+	{
+		auto ext = output.extension();
+		if (ext == ".gz" or ext == ".xz")
+			ext = output.stem().extension();
 
-		if (fmt == "dssp")
-			dssp.write_legacy_output(out);
+		if (ext == ".dssp")
+			options.fmt = "dssp";
+		else if (ext == ".bdssp")
+			options.fmt = "binary";
+		else if (ext == ".fasta" or ext == ".fa")
+			options.fmt = "fasta";
+		else if (ext == ".tsv")
+			options.fmt = "tsv";
 		else
-		{
-			dssp.annotate(f.front(), writeOther, not config.has("no-dssp-categories"));
-			out << f.front();
-		}
+			options.fmt = "cif";
 	}
-	else
+
+	auto start = std::chrono::steady_clock::now();
+	cif::file f = read_input(config.operands().front(), options);
+	double read_time = seconds_since(start);
+
+	try
 	{
-		if (fmt == "dssp")
-			dssp.write_legacy_output(std::cout);
+		auto models = calculate(f, options);
+
+		start = std::chrono::steady_clock::now();
+
+		if (not output.empty())
+			write_output(output, f, models, options);
 		else
+			write_output(std::cout, f, models, options);
+
+		double write_time = seconds_since(start);
+
+		if (cif::VERBOSE > 0)
+			report_metrics(std::cerr, read_time, write_time, models);
+
+		if (config.has("metrics"))
 		{
-			dssp.annotate(f.front(), writeOther, not config.has("no-dssp-categories"));
-			std::cout << f.front();
+			auto metrics = config.get<std::string>("metrics");
+			if (metrics == "-")
+				write_metrics(std::cerr, config.operands().front(), read_time, write_time, false, models);
+			else
+			{
+				std::ofstream out(metrics);
+				if (not out.is_open())
+					throw std::runtime_error("Could not open metrics file " + metrics);
+				write_metrics(out, config.operands().front(), read_time, write_time, false, models);
+			}
 		}
 	}
+	catch (const legacy_format_error &ex)
+	{
+		std::cerr << ex.what() << std::endl;
+		exit(2);
+	}
 
 	return 0;
 }
@@ -0,0 +1,480 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2020 NKI/AVL, Netherlands Cancer Institute
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/// \file result-cache.hpp
+/// The cache mkdssp uses for the output of the formats other than mmCIF.
+
+#include "dssp.hpp"
+
+#include <cif++.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <initializer_list>
+#include <iomanip>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// --------------------------------------------------------------------
+// SHA-256 as in FIPS 180-4, the cache key is the hash of the input data
+// the output depends on. A collision would return the output of another
+// input, a strong hash makes that practically impossible.
+
+class sha256
+{
+  public:
+	void update(std::string_view s)
+	{
+		update(reinterpret_cast<const unsigned char *>(s.data()), s.length());
+	}
+
+	// Add a field preceded by its length, that way different sequences of
+	// fields never give the same data to hash
+	void add_field(std::string_view s)
+	{
+		unsigned char length[8];
+		for (size_t i = 0; i < sizeof(length); ++i)
+			length[i] = static_cast<unsigned char>(static_cast<uint64_t>(s.length()) >> (8 * i));
+
+		update(length, sizeof(length));
+		update(s);
+	}
+
+	// The hash in hexadecimal, nothing can be added after this
+	std::string str()
+	{
+		uint64_t bits = m_length * 8;
+
+		const unsigned char kOne = 0x80, kZero = 0;
+		update(&kOne, 1);
+		while (m_used != 56)
+			update(&kZero, 1);
+
+		unsigned char length[8];
+		for (size_t i = 0; i < sizeof(length); ++i)
+			length[i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+		update(length, sizeof(length));
+
+		std::ostringstream os;
+		os << std::hex << std::setfill('0');
+		for (auto h : m_state)
+			os << std::setw(8) << h;
+		return os.str();
+	}
+
+  private:
+	void update(const unsigned char *data, size_t length)
+	{
+		m_length += length;
+
+		while (length > 0)
+		{
+			size_t n = std::min(length, sizeof(m_block) - m_used);
+			std::copy(data, data + n, m_block + m_used);
+
+			m_used += n;
+			data += n;
+			length -= n;
+
+			if (m_used == sizeof(m_block))
+			{
+				transform();
+				m_used = 0;
+			}
+		}
+	}
+
+	static uint32_t rotr(uint32_t x, int n)
+	{
+		return (x >> n) | (x << (32 - n));
+	}
+
+	void transform()
+	{
+		static const uint32_t k[64] = {
+			0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+			0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+			0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+			0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+			0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+			0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+			0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+			0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+		};
+
+		uint32_t w[64];
+		for (size_t i = 0; i < 16; ++i)
+		{
+			w[i] = static_cast<uint32_t>(m_block[4 * i]) << 24 | static_cast<uint32_t>(m_block[4 * i + 1]) << 16 |
+			       static_cast<uint32_t>(m_block[4 * i + 2]) << 8 | static_cast<uint32_t>(m_block[4 * i + 3]);
+		}
+
+		for (size_t i = 16; i < 64; ++i)
+		{
+			uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3],
+				 e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+
+		for (size_t i = 0; i < 64; ++i)
+		{
+			uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+			uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		m_state[0] += a;
+		m_state[1] += b;
+		m_state[2] += c;
+		m_state[3] += d;
+		m_state[4] += e;
+		m_state[5] += f;
+		m_state[6] += g;
+		m_state[7] += h;
+	}
+
+	uint32_t m_state[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	unsigned char m_block[64];
+	size_t m_used = 0;
+	uint64_t m_length = 0;
+};
+
+// The key for the output for \a db, \a settings are the version, options
+// and names the output depends on as well
+inline std::string content_key(const cif::datablock &db, std::initializer_list<std::string_view> settings)
+{
+	sha256 h;
+
+	for (auto s : settings)
+		h.add_field(s);
+
+	h.add_field(db.name());
+
+	// The atom_site items used for the calculation
+	auto &items = dssp::required_atom_site_items();
+
+	for (auto atom : db["atom_site"])
+	{
+		for (auto item : items)
+			h.add_field(atom[item].text());
+	}
+
+	// The other categories, used for the header of the legacy format, are
+	// small enough to hash as a whole
+	for (auto name : dssp::required_categories())
+	{
+		if (name == "atom_site")
+			continue;
+
+		std::ostringstream os;
+		if (auto cat = db.get(name); cat != nullptr)
+			os << *cat;
+		h.add_field(os.str());
+	}
+
+	return h.str();
+}
+
+// The legacy format contains the date it was written in its first line,
+// for output taken from the cache that date is set to today
+inline void refresh_legacy_date(std::string &ioOutput)
+{
+	auto eol = ioOutput.find('\n');
+	auto p = ioOutput.find("DATE=");
+	if (p == std::string::npos or p > eol)
+		return;
+	p += 5;
+
+	std::time_t today = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+	std::tm tm = {};
+#if defined(_WIN32)
+	gmtime_s(&tm, &today);
+#else
+	gmtime_r(&today, &tm);
+#endif
+
+	char date[32];
+	auto dateLength = std::strftime(date, sizeof(date), "%F", &tm);
+
+	ioOutput.replace(p, std::min(dateLength, eol - p), date, std::min(dateLength, eol - p));
+}
+
+// --------------------------------------------------------------------
+// The output is kept in memory, up to a maximum size, and optionally in a
+// directory so that it can be shared by several runs. The files in that
+// directory are limited in size as well, the least recently used are
+// removed first.
+//
+// The files are kept in the subdirectory mkdssp-cache of that directory.
+// Only files named like a key, and temporary files of those left behind
+// for a day, are ever removed. Other files are left alone, even when the
+// directory was given by mistake.
+
+// Keys are SHA-256 hashes in hexadecimal, see content_key
+inline bool is_cache_key(std::string_view name)
+{
+	return name.length() == 64 and std::all_of(name.begin(), name.end(), [](char ch)
+									   { return (ch >= '0' and ch <= '9') or (ch >= 'a' and ch <= 'f'); });
+}
+
+class result_cache
+{
+  public:
+	result_cache(size_t max_memory, const std::filesystem::path &dir = {}, uintmax_t max_disk = 0)
+		: m_max_memory(max_memory)
+		, m_max_disk(max_disk)
+		, m_dir(dir.empty() ? dir : dir / "mkdssp-cache")
+	{
+		if (not m_dir.empty())
+		{
+			if (not std::filesystem::exists(m_dir))
+				std::filesystem::create_directories(m_dir);
+
+			evict_files();
+		}
+	}
+
+	std::optional<std::string> find(const std::string &key)
+	{
+		{
+			std::unique_lock lock(m_mutex);
+			if (auto i = m_entries.find(key); i != m_entries.end())
+			{
+				++m_hits;
+				return i->second;
+			}
+		}
+
+		if (not m_dir.empty() and is_cache_key(key))
+		{
+			std::ifstream in(m_dir / key, std::ios::binary);
+			if (in.is_open())
+			{
+				std::string result{ std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+				if (not in.bad())
+				{
+					// Mark it as used for the eviction
+					std::error_code ec;
+					std::filesystem::last_write_time(m_dir / key, std::filesystem::file_time_type::clock::now(), ec);
+
+					store_in_memory(key, result);
+
+					std::unique_lock lock(m_mutex);
+					++m_hits;
+					return result;
+				}
+			}
+		}
+
+		std::unique_lock lock(m_mutex);
+		++m_misses;
+		return {};
+	}
+
+	void store(const std::string &key, const std::string &output)
+	{
+		store_in_memory(key, output);
+
+		if (not m_dir.empty() and is_cache_key(key) and (m_max_disk == 0 or output.length() <= m_max_disk))
+		{
+			// Write to a temporary file first, so other processes never
+			// see a partially written entry
+			std::ostringstream tmp_name;
+			tmp_name << key << ".tmp-" << kProcessTag << '-' << std::this_thread::get_id();
+			auto tmp = m_dir / tmp_name.str();
+
+			{
+				std::ofstream out(tmp, std::ios::binary);
+				out << output;
+				if (not out)
+				{
+					std::error_code ec;
+					std::filesystem::remove(tmp, ec);
+					return;
+				}
+			}
+
+			std::error_code ec;
+			std::filesystem::rename(tmp, m_dir / key, ec);
+			if (ec)
+			{
+				std::filesystem::remove(tmp, ec);
+				return;
+			}
+
+			bool full;
+			{
+				std::unique_lock lock(m_mutex);
+				m_disk += output.length();
+				full = m_max_disk > 0 and m_disk > m_max_disk;
+			}
+
+			if (full)
+				evict_files();
+		}
+	}
+
+	size_t hits() const { return m_hits; }
+	size_t misses() const { return m_misses; }
+
+	// The directory containing the files, empty when caching in memory only
+	const std::filesystem::path &entry_dir() const { return m_dir; }
+
+  private:
+	// Entries are dropped in the order they were stored once the memory
+	// used exceeds the maximum
+	void store_in_memory(const std::string &key, const std::string &output)
+	{
+		if (output.length() > m_max_memory)
+			return;
+
+		std::unique_lock lock(m_mutex);
+
+		if (not m_entries.emplace(key, output).second)
+			return;
+
+		m_order.push_back(key);
+		m_memory += output.length();
+
+		while (m_memory > m_max_memory)
+		{
+			auto i = m_entries.find(m_order.front());
+			m_memory -= i->second.length();
+			m_entries.erase(i);
+			m_order.pop_front();
+		}
+	}
+
+	// Measure the entries in the directory, when these exceed the maximum
+	// the least recently used are removed until three quarters of it is
+	// left. The directory may be shared with other processes, so the size
+	// is measured again each time instead of only counted. Temporary files
+	// may still be written by another process, they count but are only
+	// removed once they are a day old.
+	void evict_files()
+	{
+		std::unique_lock evict_lock(m_evict_mutex, std::try_to_lock);
+		if (not evict_lock.owns_lock())
+			return;
+
+		struct file_entry
+		{
+			std::filesystem::file_time_type time;
+			uintmax_t size;
+			std::filesystem::path path;
+		};
+
+		std::vector<file_entry> files;
+		uintmax_t total = 0;
+
+		auto stale = std::filesystem::file_time_type::clock::now() - std::chrono::hours(24);
+
+		std::error_code ec;
+		for (std::filesystem::directory_iterator i(m_dir, ec), end; not ec and i != end; i.increment(ec))
+		{
+			std::error_code entry_ec;
+			if (not i->is_regular_file(entry_ec))
+				continue;
+
+			auto name = i->path().filename().string();
+			auto tmp = name.find(".tmp-");
+
+			bool entry = is_cache_key(name);
+			bool temporary = tmp != std::string::npos and is_cache_key(std::string_view{ name }.substr(0, tmp));
+			if (not entry and not temporary)
+				continue;
+
+			auto size = i->file_size(entry_ec);
+			auto time = i->last_write_time(entry_ec);
+			if (entry_ec)
+				continue;
+
+			total += size;
+
+			if (entry or time < stale)
+				files.push_back({ time, size, i->path() });
+		}
+
+		if (m_max_disk > 0 and total > m_max_disk)
+		{
+			std::sort(files.begin(), files.end(), [](const file_entry &a, const file_entry &b)
+				{ return a.time < b.time; });
+
+			for (auto &file : files)
+			{
+				if (total <= m_max_disk / 4 * 3)
+					break;
+
+				if (std::filesystem::remove(file.path, ec))
+					total -= file.size;
+			}
+		}
+
+		std::unique_lock lock(m_mutex);
+		m_disk = total;
+	}
+
+	// Distinguishes the temporary files of different processes
+	inline static const auto kProcessTag = std::random_device{}();
+
+	size_t m_max_memory, m_memory = 0;
+	uintmax_t m_max_disk, m_disk = 0;
+	std::filesystem::path m_dir;
+
+	std::mutex m_mutex, m_evict_mutex;
+	std::unordered_map<std::string, std::string> m_entries;
+	std::deque<std::string> m_order;
+	size_t m_hits = 0, m_misses = 0;
+};
@@ -0,0 +1,278 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2020 NKI/AVL, Netherlands Cancer Institute
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/// \file server-connection.hpp
+/// The framing of the requests and replies of mkdssp in server mode.
+///
+/// Each request is a header line followed by the structure in mmCIF or PDB
+/// format. The header contains key=value pairs separated by spaces, length
+/// is required and is the size of the structure in bytes:
+///
+///     length=123456 format=dssp all-models=0 calculate-accessibility=1
+///
+/// The reply is either 'OK <length>' or 'ERROR <length>' on a line, followed
+/// by that many bytes of output or error message. A connection can be used
+/// for any number of requests.
+
+#ifndef _WIN32
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// The length of the data following \a header, at most \a max_length
+inline size_t request_length(const std::string &header, size_t max_length)
+{
+	auto l = header.find("length=");
+	if (l == std::string::npos or (l > 0 and header[l - 1] != ' '))
+		throw std::runtime_error("Missing length in header");
+
+	auto b = l + 7, e = header.find(' ', b);
+	if (e == std::string::npos)
+		e = header.length();
+
+	if (b == e or not std::all_of(header.begin() + b, header.begin() + e, [](char ch)
+					   { return ch >= '0' and ch <= '9'; }))
+		throw std::runtime_error("Invalid length in header");
+
+	// Too many digits would overflow
+	if (e - b > 18)
+		throw std::runtime_error("Request too large, the maximum is " + std::to_string(max_length) + " bytes");
+
+	auto length = std::stoull(header.substr(b, e - b));
+
+	if (length > max_length)
+		throw std::runtime_error("Request too large, the maximum is " + std::to_string(max_length) + " bytes");
+
+	return length;
+}
+
+// The time in milliseconds a connection may wait, -1 is forever. idle is
+// the wait for the next request, after which the connection is closed.
+// read is the wait for more data of a request, or for the client to
+// accept the reply. stop_grace is the time a request that was started
+// gets to arrive completely once the server stops.
+struct connection_timeouts
+{
+	int idle = 10000;
+	int read = 30000;
+	int stop_grace = 5000;
+};
+
+class server_connection
+{
+  public:
+	/// \a stop_fd, when not -1, becomes readable when the server shuts down.
+	/// Waiting for the next request then ends as if the connection was closed,
+	/// a request that was started may still take stop_grace to arrive.
+	server_connection(int fd, int stop_fd = -1, connection_timeouts timeouts = {})
+		: m_fd(fd)
+		, m_stop_fd(stop_fd)
+		, m_timeouts(timeouts)
+	{
+	}
+
+	~server_connection()
+	{
+		::close(m_fd);
+	}
+
+	server_connection(const server_connection &) = delete;
+	server_connection &operator=(const server_connection &) = delete;
+
+	// Returns false when the connection was closed before a new line, was
+	// idle for too long or the server stops
+	bool read_line(std::string &line)
+	{
+		const size_t kMaxLineLength = 4096;
+
+		line.clear();
+		for (;;)
+		{
+			if (m_next == m_end and not fill(line.empty()))
+			{
+				if (line.empty())
+					return false;
+				throw std::runtime_error("Connection closed while reading the header");
+			}
+
+			char ch = m_buffer[m_next++];
+			if (ch == '\n')
+				return true;
+
+			if (line.length() == kMaxLineLength)
+				throw std::runtime_error("Header line is too long");
+
+			line += ch;
+		}
+	}
+
+	void read(std::string &data, size_t length)
+	{
+		data.clear();
+		data.reserve(length);
+
+		while (data.length() < length)
+		{
+			if (m_next == m_end and not fill(false))
+				throw std::runtime_error("Connection closed while reading the data");
+
+			size_t n = std::min(length - data.length(), m_end - m_next);
+			data.append(m_buffer + m_next, n);
+			m_next += n;
+		}
+	}
+
+	void write(std::string_view data)
+	{
+		while (not data.empty())
+		{
+			auto n = ::send(m_fd, data.data(), data.length(), MSG_DONTWAIT);
+			if (n < 0 and errno == EINTR)
+				continue;
+
+			if (n < 0 and (errno == EAGAIN or errno == EWOULDBLOCK))
+			{
+				// A client that does not read its reply should not keep
+				// the worker forever
+				if (not wait_for(POLLOUT, m_timeouts.read))
+					throw std::runtime_error("Timeout writing to connection");
+				continue;
+			}
+
+			if (n <= 0)
+				throw std::runtime_error(std::string("Error writing to connection: ") + std::strerror(errno));
+			data.remove_prefix(n);
+		}
+	}
+
+  private:
+	// Wait until the connection is ready for \a events. Returns false on a
+	// timeout or, when watching \a stop, when the server stops.
+	bool wait_for(short events, int timeout, bool stop = false)
+	{
+		for (;;)
+		{
+			if (stop and m_stopping)
+				return false;
+
+			pollfd fds[2] = { { m_fd, events, 0 }, { m_stop_fd, POLLIN, 0 } };
+			bool watch_stop = m_stop_fd >= 0 and not m_stopping;
+
+			auto start = std::chrono::steady_clock::now();
+			int r = ::poll(fds, watch_stop ? 2 : 1, timeout);
+			if (r < 0 and errno == EINTR)
+			{
+				if (timeout >= 0)
+				{
+					auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+					timeout = std::max<int>(0, timeout - static_cast<int>(waited));
+				}
+				continue;
+			}
+
+			if (r < 0)
+				throw std::runtime_error(std::string("Error waiting for connection: ") + std::strerror(errno));
+
+			if (r == 0)
+				return false;
+
+			if (watch_stop and fds[1].revents != 0)
+			{
+				m_stopping = true;
+				m_stop_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_timeouts.stop_grace);
+
+				if (stop)
+					return false;
+
+				// Keep waiting, but no longer than the grace period
+				timeout = timeout < 0 ? m_timeouts.stop_grace : std::min(timeout, m_timeouts.stop_grace);
+				continue;
+			}
+
+			return true;
+		}
+	}
+
+	// Returns false at the end of the connection, or when \a idle and the
+	// connection was idle for too long or the server stops. Throws when
+	// the rest of a request does not arrive in time.
+	bool fill(bool idle)
+	{
+		if (idle)
+		{
+			if (not wait_for(POLLIN, m_timeouts.idle, true))
+				return false;
+		}
+		else
+		{
+			int timeout = m_timeouts.read;
+			if (m_stopping)
+			{
+				auto left = std::chrono::duration_cast<std::chrono::milliseconds>(m_stop_deadline - std::chrono::steady_clock::now()).count();
+				int grace = static_cast<int>(std::max<decltype(left)>(left, 0));
+				timeout = timeout < 0 ? grace : std::min(timeout, grace);
+			}
+
+			if (not wait_for(POLLIN, timeout))
+				throw std::runtime_error(m_stopping ? "Server stopped while reading the request" : "Timeout reading the request");
+		}
+
+		for (;;)
+		{
+			auto n = ::read(m_fd, m_buffer, sizeof(m_buffer));
+			if (n < 0 and errno == EINTR)
+				continue;
+			if (n < 0)
+				throw std::runtime_error(std::string("Error reading from connection: ") + std::strerror(errno));
+
+			m_next = 0;
+			m_end = n;
+			return n > 0;
+		}
+	}
+
+	int m_fd, m_stop_fd;
+	connection_timeouts m_timeouts;
+
+	bool m_stopping = false;
+	std::chrono::steady_clock::time_point m_stop_deadline;
+
+	char m_buffer[65536];
+	size_t m_next = 0, m_end = 0;
+};
+
+#endif
@@ -0,0 +1,401 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2020 NKI/AVL, Netherlands Cancer Institute
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// A simple benchmark for libdssp. It reports the time spent in each phase
+// of the calculation for the structures given on the command line and for
+// synthetic structures made by placing copies of 1cbs on a grid.
+
+#include "dssp.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+#ifndef BENCH_DATA_DIR
+# define BENCH_DATA_DIR "."
+#endif
+
+// --------------------------------------------------------------------
+
+struct bench_options
+{
+	fs::path data_dir = BENCH_DATA_DIR;
+	std::vector<size_t> sizes = { 1, 8, 64, 512 };
+	size_t repeat = 3;
+	size_t threads = 1;
+	std::vector<fs::path> files;
+};
+
+void usage(std::ostream &os)
+{
+	os << "usage: bench-dssp [options] [file...]" << std::endl
+	   << std::endl
+	   << "  --data-dir dir    directory containing 1cbs.cif.gz" << std::endl
+	   << "  --sizes n,...     the number of copies of 1cbs, default 1,8,64,512" << std::endl
+	   << "  --repeat n        the number of runs, the best is reported, default 3" << std::endl
+	   << "  --threads n       the number of threads, default 1" << std::endl;
+}
+
+std::vector<size_t> ParseSizes(const std::string &s)
+{
+	std::vector<size_t> result;
+
+	std::istringstream is(s);
+	std::string n;
+	while (std::getline(is, n, ','))
+		result.push_back(std::stoul(n));
+
+	return result;
+}
+
+bench_options ParseOptions(int argc, char *argv[])
+{
+	bench_options result;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+
+		auto value = [&]() -> std::string
+		{
+			if (i + 1 >= argc)
+				throw std::runtime_error("Missing value for option " + arg);
+			return argv[++i];
+		};
+
+		if (arg == "--data-dir")
+			result.data_dir = value();
+		else if (arg == "--sizes")
+			result.sizes = ParseSizes(value());
+		else if (arg == "--repeat")
+			result.repeat = std::max<size_t>(1, std::stoul(value()));
+		else if (arg == "--threads")
+			result.threads = std::max<size_t>(1, std::stoul(value()));
+		else if (arg == "-h" or arg == "--help")
+		{
+			usage(std::cout);
+			exit(0);
+		}
+		else if (arg.compare(0, 2, "--") == 0)
+			throw std::runtime_error("Unknown option " + arg);
+		else
+			result.files.emplace_back(arg);
+	}
+
+	return result;
+}
+
+// --------------------------------------------------------------------
+// Replicate a structure, each copy gets its own chains and is moved
+// so that the copies do not touch each other.
+
+// A, B, ..., Z, AA, AB, ...
+std::string ChainIDForIndex(size_t ix)
+{
+	std::string result;
+
+	for (++ix; ix > 0; ix = (ix - 1) / 26)
+		result.insert(result.begin(), static_cast<char>('A' + (ix - 1) % 26));
+
+	return result;
+}
+
+cif::datablock Replicate(const cif::datablock &db, size_t copies)
+{
+	cif::datablock result(db.name());
+
+	// The categories that do not refer to chains are copied as is, they
+	// are only used for the header of the output
+	for (auto &cat : db)
+	{
+		if (cat.name() != "atom_site" and cat.name() != "pdbx_poly_seq_scheme" and cat.name() != "struct_conn")
+			result.push_back(cat);
+	}
+
+	auto atoms = db["atom_site"].rows<std::string, std::string, std::string, std::string, std::string, std::string, std::string, std::string, double, double, double, std::string, std::string>(
+		"group_PDB", "type_symbol", "label_atom_id", "label_alt_id", "label_comp_id", "label_asym_id", "label_seq_id", "pdbx_PDB_model_num",
+		"Cartn_x", "Cartn_y", "Cartn_z", "auth_seq_id", "auth_asym_id");
+
+	// The size of a copy, plus some room so the copies do not interact
+	double min[3] = { 1e9, 1e9, 1e9 }, max[3] = { -1e9, -1e9, -1e9 };
+	for (const auto &[group, type, atom_id, alt_id, comp_id, asym_id, seq_id, model, x, y, z, auth_seq_id, auth_asym_id] : atoms)
+	{
+		double c[3] = { x, y, z };
+		for (int i = 0; i < 3; ++i)
+		{
+			min[i] = std::min(min[i], c[i]);
+			max[i] = std::max(max[i], c[i]);
+		}
+	}
+
+	double spacing = 0;
+	for (int i = 0; i < 3; ++i)
+		spacing = std::max(spacing, max[i] - min[i]);
+	spacing += 10;
+
+	auto grid = static_cast<size_t>(std::ceil(std::cbrt(static_cast<double>(copies))));
+
+	// The new chain IDs for each copy
+	std::map<std::string, size_t> asymIndex, authAsymIndex;
+	for (const auto &atom : atoms)
+	{
+		asymIndex.emplace(std::get<5>(atom), asymIndex.size());
+		authAsymIndex.emplace(std::get<12>(atom), authAsymIndex.size());
+	}
+
+	auto asymFor = [&](const std::string &asym_id, size_t copy)
+	{
+		return ChainIDForIndex(copy * asymIndex.size() + asymIndex.at(asym_id));
+	};
+
+	// The legacy DSSP format only has room for a single character chain ID,
+	// these are reused when there are many copies
+	auto authAsymFor = [&](const std::string &auth_asym_id, size_t copy)
+	{
+		const std::string_view kChainIDs = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+		return std::string{ kChainIDs[(copy * authAsymIndex.size() + authAsymIndex.at(auth_asym_id)) % kChainIDs.length()] };
+	};
+
+	auto &atom_site = result["atom_site"];
+	size_t id = 0;
+
+	for (size_t copy = 0; copy < copies; ++copy)
+	{
+		double dx = spacing * (copy % grid);
+		double dy = spacing * ((copy / grid) % grid);
+		double dz = spacing * (copy / (grid * grid));
+
+		for (const auto &[group, type, atom_id, alt_id, comp_id, asym_id, seq_id, model, x, y, z, auth_seq_id, auth_asym_id] : atoms)
+		{
+			atom_site.emplace({
+				{ "group_PDB", group },
+				{ "id", ++id },
+				{ "type_symbol", type },
+				{ "label_atom_id", atom_id },
+				{ "label_alt_id", alt_id },
+				{ "label_comp_id", comp_id },
+				{ "label_asym_id", asymFor(asym_id, copy) },
+				{ "label_seq_id", seq_id },
+				{ "Cartn_x", x + dx, 3 },
+				{ "Cartn_y", y + dy, 3 },
+				{ "Cartn_z", z + dz, 3 },
+				{ "auth_seq_id", auth_seq_id },
+				{ "auth_asym_id", authAsymFor(auth_asym_id, copy) },
+				{ "pdbx_PDB_model_num", model } });
+		}
+	}
+
+	auto &pdbx_poly_seq_scheme = result["pdbx_poly_seq_scheme"];
+	auto residues = db["pdbx_poly_seq_scheme"].rows<std::string, std::string, std::string, std::string, std::string, std::string, std::string>(
+		"asym_id", "entity_id", "seq_id", "mon_id", "pdb_seq_num", "pdb_strand_id", "pdb_ins_code");
+
+	for (size_t copy = 0; copy < copies; ++copy)
+	{
+		for (const auto &[asym_id, entity_id, seq_id, mon_id, pdb_seq_num, pdb_strand_id, pdb_ins_code] : residues)
+		{
+			pdbx_poly_seq_scheme.emplace({
+				{ "asym_id", asymFor(asym_id, copy) },
+				{ "entity_id", entity_id },
+				{ "seq_id", seq_id },
+				{ "mon_id", mon_id },
+				{ "pdb_seq_num", pdb_seq_num },
+				{ "pdb_strand_id", authAsymFor(pdb_strand_id, copy) },
+				{ "pdb_ins_code", pdb_ins_code } });
+		}
+	}
+
+	using namespace cif::literals;
+
+	auto &struct_conn = result["struct_conn"];
+	auto bonds = db["struct_conn"].find<std::string, std::string, std::string, std::string>("conn_type_id"_key == "disulf",
+		"ptnr1_label_asym_id", "ptnr1_label_seq_id", "ptnr2_label_asym_id", "ptnr2_label_seq_id");
+
+	size_t bond_id = 0;
+	for (size_t copy = 0; copy < copies; ++copy)
+	{
+		for (const auto &[asym1, seq1, asym2, seq2] : bonds)
+		{
+			struct_conn.emplace({
+				{ "id", "disulf" + std::to_string(++bond_id) },
+				{ "conn_type_id", "disulf" },
+				{ "ptnr1_label_asym_id", asymFor(asym1, copy) },
+				{ "ptnr1_label_seq_id", seq1 },
+				{ "ptnr2_label_asym_id", asymFor(asym2, copy) },
+				{ "ptnr2_label_seq_id", seq2 } });
+		}
+	}
+
+	return result;
+}
+
+// --------------------------------------------------------------------
+
+struct bench_result
+{
+	dssp::timings phases;
+	double legacy_output, binary_output, total;
+};
+
+// Keep the fastest time for each phase
+void KeepBest(bench_result &ioBest, const bench_result &inRun, bool inFirst)
+{
+	auto best = [inFirst](double &a, double b)
+	{
+		if (inFirst or b < a)
+			a = b;
+	};
+
+	best(ioBest.phases.load, inRun.phases.load);
+	best(ioBest.phases.hydrogens, inRun.phases.hydrogens);
+	best(ioBest.phases.geometry, inRun.phases.geometry);
+	best(ioBest.phases.pair_search, inRun.phases.pair_search);
+	best(ioBest.phases.hbond_energies, inRun.phases.hbond_energies);
+	best(ioBest.phases.beta_sheets, inRun.phases.beta_sheets);
+	best(ioBest.phases.helices, inRun.phases.helices);
+	best(ioBest.phases.pp_helices, inRun.phases.pp_helices);
+	best(ioBest.phases.accessibility, inRun.phases.accessibility);
+	best(ioBest.legacy_output, inRun.legacy_output);
+	best(ioBest.binary_output, inRun.binary_output);
+	best(ioBest.total, inRun.total);
+}
+
+double SecondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Run(const std::string &name, const cif::datablock &db, const bench_options &options)
+{
+	bench_result best{};
+	size_t residues = 0, atoms = db["atom_site"].size();
+
+	for (size_t run = 0; run < options.repeat; ++run)
+	{
+		bench_result r{};
+
+		auto start = std::chrono::steady_clock::now();
+		dssp dssp(db, 1, 3, dssp::calculate_flags::all, options.threads);
+		r.total = SecondsSince(start);
+		r.phases = dssp.get_timings();
+
+		std::ostringstream os;
+
+		start = std::chrono::steady_clock::now();
+		dssp.write_legacy_output(os);
+		r.legacy_output = SecondsSince(start);
+
+		os.str({});
+
+		start = std::chrono::steady_clock::now();
+		dssp.write_binary_output(os);
+		r.binary_output = SecondsSince(start);
+
+		residues = dssp.get_statistics().count.residues;
+
+		KeepBest(best, r, run == 0);
+	}
+
+	std::cout << name << ": " << residues << " residues, " << atoms << " atoms, "
+			  << options.threads << " thread(s), best of " << options.repeat << std::endl
+			  << std::endl
+			  << "  phase                 seconds    residues/s       atoms/s" << std::endl;
+
+	auto line = [residues, atoms](const char *phase, double seconds)
+	{
+		std::cout << "  " << std::left << std::setw(16) << phase << std::right
+				  << std::fixed << std::setprecision(6) << std::setw(14) << seconds
+				  << std::setprecision(0) << std::setw(14) << (seconds > 0 ? residues / seconds : 0)
+				  << std::setw(14) << (seconds > 0 ? atoms / seconds : 0) << std::endl;
+	};
+
+	line("load", best.phases.load);
+	line("hydrogens", best.phases.hydrogens);
+	line("geometry", best.phases.geometry);
+	line("pair search", best.phases.pair_search);
+	line("hbond energies", best.phases.hbond_energies);
+	line("beta sheets", best.phases.beta_sheets);
+	line("helices", best.phases.helices);
+	line("pp helices", best.phases.pp_helices);
+	line("accessibility", best.phases.accessibility);
+	line("legacy output", best.legacy_output);
+	line("binary output", best.binary_output);
+	line("calculation", best.total);
+
+	std::cout << std::endl;
+}
+
+// --------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		auto options = ParseOptions(argc, argv);
+
+		if (options.files.empty())
+		{
+			cif::file f(options.data_dir / "1cbs.cif.gz");
+			if (f.empty())
+				throw std::runtime_error("Could not read 1cbs.cif.gz from " + options.data_dir.string());
+
+			for (auto copies : options.sizes)
+			{
+				if (copies == 1)
+					Run("1cbs", f.front(), options);
+				else
+					Run("1cbs x " + std::to_string(copies), Replicate(f.front(), copies), options);
+			}
+		}
+
+		for (auto &file : options.files)
+		{
+			cif::file f(file);
+			if (f.empty())
+				throw std::runtime_error("Could not read " + file.string());
+
+			Run(file.filename().string(), f.front(), options);
+		}
+	}
+	catch (const std::exception &ex)
+	{
+		std::cerr << ex.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -24,7 +24,9 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <map>
 #include <stdexcept>
+#include <thread>
 
 #define CATCH_CONFIG_RUNNER
 
@@ -35,11 +37,17 @@
 #endif
 
 #include "../libdssp/src/dssp-io.hpp"
+#include "../src/result-cache.hpp"
 #include "../src/revision.hpp"
+#include "../src/server-connection.hpp"
 #include "dssp.hpp"
 
 #include <cif++/dictionary_parser.hpp>
 
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+
 namespace fs = std::filesystem;
 
 // --------------------------------------------------------------------
@@ -271,4 +279,1139 @@ TEST_CASE("dssp_3")
 	dssp.annotate(f.front(), true, true);
 
 	// CHECK(f.is_valid());
-}
\ No newline at end of file
+}
+
+// --------------------------------------------------------------------
+
+TEST_CASE("dssp_threads")
+{
+	cif::file f(gTestDir / "1cbs.cif.gz");
+
+	REQUIRE(f.is_valid());
+
+	dssp a(f.front(), 1, 3, true, 1);
+	dssp b(f.front(), 1, 3, true, 4);
+
+	CHECK(a.get_statistics().accessible_surface == b.get_statistics().accessible_surface);
+
+	for (auto ra = a.begin(), rb = b.begin(); ra != a.end() and rb != b.end(); ++ra, ++rb)
+	{
+		CHECK(ra->accessibility() == rb->accessibility());
+
+		for (int i : { 0, 1 })
+		{
+			auto &&[da, ea] = ra->acceptor(i);
+			auto &&[db, eb] = rb->acceptor(i);
+			CHECK(ea == eb);
+			CHECK(bool(da) == bool(db));
+			if (da and db)
+				CHECK(da.nr() == db.nr());
+		}
+	}
+}
+
+// --------------------------------------------------------------------
+
+TEST_CASE("dssp_all_models")
+{
+	cif::file f(gTestDir / "1cbs.cif.gz");
+
+	REQUIRE(f.is_valid());
+
+	auto models = dssp::calculate_all_models(f.front(), 3, true);
+
+	REQUIRE(models.size() == 1);
+	CHECK(models.front().get_model_nr() == 1);
+
+	dssp single(f.front(), 1, 3, true);
+
+	CHECK(models.front().get_statistics().accessible_surface == single.get_statistics().accessible_surface);
+
+	for (auto ra = models.front().begin(), rb = single.begin(); ra != models.front().end() and rb != single.end(); ++ra, ++rb)
+	{
+		CHECK(ra->type() == rb->type());
+		CHECK(ra->accessibility() == rb->accessibility());
+	}
+}
+
+TEST_CASE("dssp_all_models_2")
+{
+	using namespace cif::literals;
+
+	// Three models of 1cbs, the second rotated with some noise added, the
+	// third also with the loop 55-62 moved. The ligand and the waters have
+	// no model number, they belong to all models.
+	cif::file f(gTestDir / "1cbs-models.cif.gz");
+
+	REQUIRE(f.is_valid());
+
+	auto &db = f.front();
+
+	std::map<int, size_t> atoms;
+	size_t shared = 0;
+	for (auto atom : db["atom_site"])
+	{
+		if (auto model_nr = atom["pdbx_PDB_model_num"].as<std::optional<int>>())
+			++atoms[*model_nr];
+		else
+			++shared;
+	}
+
+	REQUIRE(atoms.size() == 3);
+	REQUIRE(shared > 0);
+
+	auto models = dssp::calculate_all_models(db, 3, true, 2);
+
+	REQUIRE(models.size() == 3);
+
+	for (size_t i = 0; i < models.size(); ++i)
+	{
+		auto &model = models[i];
+		int model_nr = static_cast<int>(i + 1);
+
+		CHECK(model.get_model_nr() == model_nr);
+		CHECK(model.atom_count() == atoms[model_nr] + shared);
+
+		// The same as calculating the model on its own
+		dssp separate(db, model_nr, 3, true);
+
+		CHECK(model.get_statistics().accessible_surface == separate.get_statistics().accessible_surface);
+		CHECK(model.get_statistics().count.H_bonds == separate.get_statistics().count.H_bonds);
+
+		REQUIRE(model.size() == separate.size());
+
+		for (auto ra = model.begin(), rb = separate.begin(); ra != model.end() and rb != separate.end(); ++ra, ++rb)
+		{
+			CHECK(ra->type() == rb->type());
+			CHECK(ra->accessibility() == rb->accessibility());
+			CHECK(std::get<1>(ra->acceptor(0)) == std::get<1>(rb->acceptor(0)));
+		}
+	}
+
+	// The models do differ
+	CHECK(models[0].get_statistics().accessible_surface != models[1].get_statistics().accessible_surface);
+
+	std::string ss[3];
+	for (size_t i = 0; i < models.size(); ++i)
+	{
+		for (auto r : models[i])
+			ss[i] += static_cast<char>(r.type());
+	}
+
+	CHECK(ss[0] != ss[2]);
+
+	// The summary has the rows for each model, keyed by model number
+	dssp::annotate(db, models, true, true);
+
+	auto &summary = db["dssp_struct_summary"];
+
+	size_t rows = 0;
+	for (auto &model : models)
+	{
+		CHECK(summary.find("pdbx_PDB_model_num"_key == model.get_model_nr()).size() == model.size());
+		rows += model.size();
+	}
+
+	CHECK(summary.size() == rows);
+}
+
+// --------------------------------------------------------------------
+
+TEST_CASE("dssp_update_coordinates")
+{
+	cif::file f(gTestDir / "1cbs.cif.gz");
+
+	REQUIRE(f.is_valid());
+
+	auto &atom_site = f.front()["atom_site"];
+
+	dssp frames(f.front(), 1, 3, true);
+
+	REQUIRE(frames.atom_count() == atom_site.size());
+
+	// The models in 1cbs-models.cif.gz have the atoms of 1cbs in the same
+	// order, the ligand and waters are shared. Model 2 is 1cbs rotated with
+	// noise added, model 3 also has a loop moved. Replay them as frames,
+	// ending with 1cbs itself, and compare with a fresh calculation.
+	cif::file m(gTestDir / "1cbs-models.cif.gz");
+
+	REQUIRE(m.is_valid());
+
+	auto frame_coordinates = [](const cif::category &atoms, std::optional<int> model_nr)
+	{
+		std::vector<float> result;
+		for (const auto &[nr, x, y, z] : atoms.rows<std::optional<int>, float, float, float>("pdbx_PDB_model_num", "Cartn_x", "Cartn_y", "Cartn_z"))
+		{
+			if (nr and nr != model_nr)
+				continue;
+
+			result.push_back(x);
+			result.push_back(y);
+			result.push_back(z);
+		}
+		return result;
+	};
+
+	REQUIRE_THROWS(frames.update_coordinates(frame_coordinates(atom_site, 1).data(), 3 * atom_site.size() - 3));
+
+	std::string first_ss;
+	for (auto r : frames)
+		first_ss += static_cast<char>(r.type());
+
+	for (int model_nr : { 2, 3, 1 })
+	{
+		auto &db = model_nr == 1 ? f.front() : m.front();
+		dssp reference(db, model_nr, 3, true);
+
+		auto coordinates = frame_coordinates(db["atom_site"], model_nr);
+		REQUIRE(coordinates.size() == 3 * atom_site.size());
+
+		frames.update_coordinates(coordinates.data(), coordinates.size());
+		frames.recompute();
+
+		CHECK(frames.get_statistics().accessible_surface == reference.get_statistics().accessible_surface);
+		CHECK(frames.get_statistics().count.H_bonds == reference.get_statistics().count.H_bonds);
+
+		REQUIRE(frames.size() == reference.size());
+
+		std::string ss;
+
+		for (auto ra = frames.begin(), rb = reference.begin(); ra != frames.end() and rb != reference.end(); ++ra, ++rb)
+		{
+			ss += static_cast<char>(ra->type());
+
+			CHECK(ra->type() == rb->type());
+			CHECK(ra->accessibility() == rb->accessibility());
+			CHECK(ra->ca_location() == rb->ca_location());
+			CHECK(ra->phi() == rb->phi());
+			CHECK(ra->psi() == rb->psi());
+			CHECK(ra->sheet() == rb->sheet());
+
+			// The energies of the N-H-->O bonds depend on the position of
+			// the hydrogen, which is recalculated for each frame as well
+			for (int i : { 0, 1 })
+			{
+				auto &&[da, ea] = ra->acceptor(i);
+				auto &&[db, eb] = rb->acceptor(i);
+				CHECK(ea == eb);
+				CHECK(bool(da) == bool(db));
+				if (da and db)
+					CHECK(da.nr() == db.nr());
+
+				auto &&[dc, ec] = ra->donor(i);
+				auto &&[dd, ed] = rb->donor(i);
+				CHECK(ec == ed);
+				CHECK(bool(dc) == bool(dd));
+				if (dc and dd)
+					CHECK(dc.nr() == dd.nr());
+			}
+		}
+
+		// The frames do differ from the first
+		if (model_nr == 1)
+			CHECK(ss == first_ss);
+		else if (model_nr == 3)
+			CHECK(ss != first_ss);
+	}
+}
+
+// --------------------------------------------------------------------
+
+TEST_CASE("dssp_update_residues")
+{
+	cif::file f(gTestDir / "1cbs.cif.gz");
+
+	REQUIRE(f.is_valid());
+
+	auto &atom_site = f.front()["atom_site"];
+
+	// Move residues 40 up to 42 of chain A a bit, a local change
+	std::vector<dssp::key_type> moved{ { "A", 40 }, { "A", 41 }, { "A", 42 } };
+
+	std::vector<float> coordinates, local;
+	for (const auto &[asym_id, seq_id, x, y, z] : atom_site.rows<std::string, std::optional<int>, float, float, float>("label_asym_id", "label_seq_id", "Cartn_x", "Cartn_y", "Cartn_z"))
+	{
+		bool move = asym_id == "A" and seq_id and *seq_id >= 40 and *seq_id <= 42;
+
+		float c[3] = { x, y, z };
+		if (move)
+		{
+			c[0] += 0.7f;
+			c[1] -= 0.4f;
+			c[2] += 0.3f;
+
+			local.insert(local.end(), c, c + 3);
+		}
+
+		coordinates.insert(coordinates.end(), c, c + 3);
+	}
+
+	dssp reference(f.front(), 1, 3, true);
+	dssp incremental(f.front(), 1, 3, true);
+
+	size_t atoms = 0;
+	for (auto &key : moved)
+		atoms += incremental.atom_count(key);
+	REQUIRE(3 * atoms == local.size());
+
+	REQUIRE_THROWS(incremental.update_residues(moved, local.data(), local.size() - 3));
+	REQUIRE_THROWS(incremental.update_residues({ { "A", 9999 } }, local.data(), local.size()));
+
+	reference.update_coordinates(coordinates.data(), coordinates.size());
+	reference.recompute();
+
+	incremental.update_residues(moved, local.data(), local.size());
+
+	CHECK(incremental.get_statistics().accessible_surface == reference.get_statistics().accessible_surface);
+	CHECK(incremental.get_statistics().count.H_bonds == reference.get_statistics().count.H_bonds);
+
+	for (auto ra = incremental.begin(), rb = reference.begin(); ra != incremental.end() and rb != reference.end(); ++ra, ++rb)
+	{
+		CHECK(ra->type() == rb->type());
+		CHECK(ra->accessibility() == rb->accessibility());
+		CHECK(ra->phi() == rb->phi());
+		CHECK(ra->sheet() == rb->sheet());
+
+		for (int i : { 0, 1 })
+		{
+			auto &&[da, ea] = ra->acceptor(i);
+			auto &&[db, eb] = rb->acceptor(i);
+
+			CHECK(ea == eb);
+			CHECK(bool(da) == bool(db));
+			if (da and db)
+				CHECK(da.nr() == db.nr());
+		}
+	}
+}
+
+TEST_CASE("dssp_residue_lookup")
+{
+	cif::file f(gTestDir / "1cbs.cif.gz");
+
+	REQUIRE(f.is_valid());
+
+	dssp structure(f.front(), 1, 3, false);
+
+	for (auto res : structure)
+	{
+		CHECK(structure[{ res.asym_id(), res.seq_id() }].nr() == res.nr());
+		CHECK(structure.get_residue_by_pdb_id({ res.pdb_strand_id(), res.pdb_seq_num(), res.pdb_ins_code() }).nr() == res.nr());
+	}
+
+	CHECK_THROWS_AS((structure[dssp::key_type{ "X", 1 }]), std::out_of_range);
+	CHECK_THROWS_AS((structure.get_residue_by_pdb_id(dssp::pdb_key_type{ "A", 1, "X" })), std::out_of_range);
+}
+
+// --------------------------------------------------------------------
+
+TEST_CASE("dssp_calculate_flags")
+{
+	cif::file f(gTestDir / "1cbs.cif.gz");
+
+	REQUIRE(f.is_valid());
+
+	dssp full(f.front(), 1, 3, true);
+	dssp minimal(f.front(), 1, 3, dssp::calculate_flags::none);
+
+	REQUIRE(std::distance(full.begin(), full.end()) == std::distance(minimal.begin(), minimal.end()));
+
+	for (auto fi = full.begin(), mi = minimal.begin(); fi != full.end(); ++fi, ++mi)
+	{
+		CHECK(fi->type() == mi->type());
+		CHECK(fi->bend() == mi->bend());
+		CHECK(fi->kappa() == mi->kappa());
+
+		// calculated on access
+		CHECK(fi->alpha() == mi->alpha());
+		CHECK(fi->tco() == mi->tco());
+		CHECK(fi->omega() == mi->omega());
+
+		CHECK(mi->accessibility() == 0);
+		CHECK(mi->sheet() == 0);
+		CHECK_FALSE(std::get<0>(mi->bridge_partner(0)));
+	}
+
+	CHECK(minimal.get_statistics().count.H_bonds == 0);
+	CHECK(full.get_statistics().count.H_bonds > 0);
+
+	using flags = dssp::calculate_flags;
+	CHECK(~flags::all == flags::none);
+	CHECK(~flags::none == flags::all);
+	CHECK((flags::all & ~flags::accessibility) == (flags::angles | flags::side_chains | flags::bridge_partners | flags::statistics));
+}
+
+// --------------------------------------------------------------------
+
+TEST_CASE("dssp_ss_strings")
+{
+	cif::file f(gTestDir / "1cbs.cif.gz");
+
+	REQUIRE(f.is_valid());
+
+	dssp structure(f.front(), 1, 3, dssp::calculate_flags::none);
+
+	std::string ss;
+	for (auto res : structure)
+		ss += static_cast<char>(res.type());
+
+	std::ostringstream fasta;
+	structure.write_secondary_structure(fasta, dssp::ss_string_format::fasta);
+	CHECK(fasta.str() == ">" + f.front().name() + ":A\n" + ss + "\n");
+
+	std::ostringstream tsv;
+	structure.write_secondary_structure(tsv, dssp::ss_string_format::tsv, "1cbs");
+	CHECK(tsv.str() == "1cbs\t1\tA\t" + ss + "\n");
+}
+
+// --------------------------------------------------------------------
+
+TEST_CASE("dssp_binary_output")
+{
+	cif::file f(gTestDir / "1cbs.cif.gz");
+
+	REQUIRE(f.is_valid());
+
+	dssp structure(f.front(), 1, 3, true);
+
+	std::ostringstream os;
+	structure.write_binary_output(os);
+	auto data = os.str();
+
+	auto read = [&data](size_t offset, auto v)
+	{
+		REQUIRE(offset + sizeof(v) <= data.length());
+		std::memcpy(&v, data.data() + offset, sizeof(v));
+		return v;
+	};
+
+	REQUIRE(data.length() >= 64);
+	CHECK(std::string(data.data(), 7) == "DSSPBIN");
+	CHECK(read(8, uint32_t{}) == 1);
+	CHECK(read(12, uint32_t{}) == 1);
+	CHECK(read(40, uint64_t{}) == data.length());
+
+	auto stats = structure.get_statistics();
+	auto residues = read(16, uint32_t{});
+	CHECK(residues == stats.count.residues);
+
+	auto statistics = read(24, uint64_t{});
+	CHECK(read(statistics, double{}) == stats.accessible_surface);
+	CHECK(read(statistics + 8 + 4 * 4, uint32_t{}) == stats.count.H_bonds);
+
+	// Look up the columns in the directory
+	std::map<std::string, uint64_t> columns;
+	auto directory = read(32, uint64_t{});
+	for (uint32_t i = 0; i < read(20, uint32_t{}); ++i)
+	{
+		auto entry = directory + i * 56;
+		std::string name(data.data() + entry, strnlen(data.data() + entry, 32));
+		columns[name] = read(entry + 40, uint64_t{});
+		CHECK(read(entry + 40, uint64_t{}) % 8 == 0);
+	}
+
+	REQUIRE(columns.count("nr"));
+	REQUIRE(columns.count("type"));
+	REQUIRE(columns.count("accessibility"));
+	REQUIRE(columns.count("pdb_strand_id"));
+
+	uint32_t ix = 0;
+	for (auto res : structure)
+	{
+		CHECK(read(columns["nr"] + 4 * ix, int32_t{}) == res.nr());
+		CHECK(data[columns["type"] + ix] == static_cast<char>(res.type()));
+		CHECK(read(columns["accessibility"] + 4 * ix, float{}) == static_cast<float>(res.accessibility()));
+
+		auto b = read(columns["pdb_strand_id"] + 4 * ix, uint32_t{});
+		auto e = read(columns["pdb_strand_id"] + 4 * (ix + 1), uint32_t{});
+		CHECK(data.substr(columns["pdb_strand_id"] + 4 * (residues + 1) + b, e - b) == res.pdb_strand_id());
+
+		++ix;
+	}
+}
+
+// --------------------------------------------------------------------
+
+TEST_CASE("dssp_read_required_categories")
+{
+	cif::file f(gTestDir / "1cbs.cif.gz");
+	REQUIRE(f.is_valid());
+
+	cif::gzio::ifstream in(gTestDir / "1cbs.cif.gz");
+	REQUIRE(in.is_open());
+
+	auto r = dssp::read_required_categories(in);
+	REQUIRE(r.is_valid());
+
+	CHECK(r.front().name() == f.front().name());
+	CHECK(r.front().get("exptl") == nullptr);
+	CHECK(r.front()["atom_site"].size() == f.front()["atom_site"].size());
+
+	for (auto &cat : r.front())
+	{
+		auto &categories = dssp::required_categories();
+		CHECK(std::find(categories.begin(), categories.end(), cat.name()) != categories.end());
+	}
+
+	dssp a(f.front(), 1, 3, true);
+	dssp b(r.front(), 1, 3, true);
+
+	std::ostringstream sa, sb;
+	a.write_legacy_output(sa);
+	b.write_legacy_output(sb);
+
+	CHECK(sa.str() == sb.str());
+}
+
+// --------------------------------------------------------------------
+
+TEST_CASE("result_cache")
+{
+	sha256 abc;
+	abc.update("abc");
+	CHECK(abc.str() == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+
+	sha256 empty;
+	CHECK(empty.str() == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+
+	// Two blocks
+	sha256 two;
+	two.update("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq");
+	CHECK(two.str() == "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+
+	// The key depends on the coordinates and the settings
+	auto a = R"(data_TEST
+loop_
+_atom_site.id
+_atom_site.label_atom_id
+_atom_site.Cartn_x
+_atom_site.Cartn_y
+_atom_site.Cartn_z
+1 CA 1.000 2.000 3.000
+)"_cf;
+
+	auto b = R"(data_TEST
+loop_
+_atom_site.id
+_atom_site.label_atom_id
+_atom_site.Cartn_x
+_atom_site.Cartn_y
+_atom_site.Cartn_z
+1 CA 1.001 2.000 3.000
+)"_cf;
+
+	auto key = content_key(a.front(), { "dssp" });
+	CHECK(key.length() == 64);
+	CHECK(key == content_key(a.front(), { "dssp" }));
+	CHECK(key != content_key(b.front(), { "dssp" }));
+	CHECK(key != content_key(a.front(), { "binary" }));
+	CHECK(content_key(a.front(), { "a", "bc" }) != content_key(a.front(), { "ab", "c" }));
+
+	auto dir = fs::temp_directory_path() / "dssp-result-cache-test";
+	fs::remove_all(dir);
+
+	auto k1 = std::string(64, '1'), k2 = std::string(64, '2'), k3 = std::string(64, '3');
+
+	CHECK(is_cache_key(k1));
+	CHECK(is_cache_key(key));
+	CHECK_FALSE(is_cache_key("k1"));
+	CHECK_FALSE(is_cache_key(k1 + ".tmp-1-2"));
+
+	auto write_file = [](const fs::path &p, size_t size)
+	{
+		std::ofstream out(p, std::ios::binary);
+		out << std::string(size, 'x');
+	};
+
+	{
+		result_cache cache(1024 * 1024, dir, 100);
+
+		CHECK_FALSE(cache.find(k1));
+		CHECK(cache.misses() == 1);
+
+		cache.store(k1, std::string(40, '1'));
+		CHECK(cache.find(k1) == std::string(40, '1'));
+		CHECK(cache.hits() == 1);
+
+		CHECK(cache.entry_dir() == dir / "mkdssp-cache");
+		CHECK(fs::exists(dir / "mkdssp-cache" / k1));
+	}
+
+	// Files that are not entries, a temporary file still being written by
+	// another process and one left behind long ago
+	auto now = fs::file_time_type::clock::now();
+
+	write_file(dir / "data.cif", 500);
+	write_file(dir / "mkdssp-cache" / "notes.txt", 500);
+	fs::last_write_time(dir / "mkdssp-cache" / "notes.txt", now - std::chrono::hours(100));
+
+	auto fresh_tmp = dir / "mkdssp-cache" / (k3 + ".tmp-1-2");
+	write_file(fresh_tmp, 30);
+
+	auto stale_tmp = dir / "mkdssp-cache" / (k2 + ".tmp-1-2");
+	write_file(stale_tmp, 30);
+	fs::last_write_time(stale_tmp, now - std::chrono::hours(48));
+
+	{
+		// Another cache using the same directory, as a later run would
+		result_cache cache(1024 * 1024, dir, 100);
+		CHECK(cache.find(k1) == std::string(40, '1'));
+		CHECK_FALSE(cache.find(k2));
+
+		// The least recently used files are removed once the directory
+		// holds more than the maximum
+		auto entries = cache.entry_dir();
+		fs::last_write_time(entries / k1, now - std::chrono::hours(2));
+
+		cache.store(k2, std::string(40, '2'));
+		fs::last_write_time(entries / k2, now - std::chrono::hours(1));
+
+		cache.store(k3, std::string(40, '3'));
+
+		CHECK_FALSE(fs::exists(entries / k1));
+		CHECK_FALSE(fs::exists(entries / k2));
+		CHECK(fs::exists(entries / k3));
+
+		CHECK_FALSE(fs::exists(stale_tmp));
+		CHECK(fs::exists(fresh_tmp));
+		CHECK(fs::exists(entries / "notes.txt"));
+		CHECK(fs::exists(dir / "data.cif"));
+	}
+
+	{
+		// Only the cache directory itself is used
+		result_cache cache(1024 * 1024, dir, 1);
+		cache.store(k1, "1");
+		CHECK(fs::exists(dir / "data.cif"));
+		CHECK(fs::exists(dir / "mkdssp-cache" / "notes.txt"));
+	}
+
+	fs::remove_all(dir);
+
+	std::string legacy = "==== Secondary Structure Definition by the program DSSP ==== DATE=2000-01-01        .\nREFERENCE DATE=2000-01-01\n";
+	auto length = legacy.length();
+	refresh_legacy_date(legacy);
+	CHECK(legacy.length() == length);
+	CHECK(legacy.find("DATE=2000-01-01        .\n") == std::string::npos);
+	CHECK(legacy.find("REFERENCE DATE=2000-01-01\n") != std::string::npos);
+}
+
+// --------------------------------------------------------------------
+
+#ifndef _WIN32
+
+TEST_CASE("server_framing")
+{
+	CHECK(request_length("length=5", 10) == 5);
+	CHECK(request_length("format=dssp length=10 all-models=1", 10) == 10);
+	CHECK_THROWS(request_length("format=dssp", 10));
+	CHECK_THROWS(request_length("xlength=5", 10));
+	CHECK_THROWS(request_length("length=5x", 10));
+	CHECK_THROWS(request_length("length=", 10));
+	CHECK_THROWS(request_length("length=11", 10));
+	CHECK_THROWS(request_length("length=99999999999999999999999", 10));
+
+	int fds[2];
+	REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+	{
+		server_connection server(fds[0]);
+		server_connection client(fds[1]);
+
+		// Two requests, the second one written in pieces. Small enough to
+		// fit in the socket buffers, nothing is read until all is written.
+		std::string data(3000, 'x');
+		client.write("length=5 format=dssp\nhello");
+		client.write("length=" + std::to_string(data.length()) + "\n");
+		client.write(data.substr(0, 1000));
+		client.write(data.substr(1000));
+
+		std::string header, request;
+		REQUIRE(server.read_line(header));
+		CHECK(header == "length=5 format=dssp");
+		server.read(request, request_length(header, 1 << 20));
+		CHECK(request == "hello");
+
+		server.write("OK 3\nabc");
+
+		REQUIRE(server.read_line(header));
+		server.read(request, request_length(header, 1 << 20));
+		CHECK(request == data);
+
+		std::string reply;
+		REQUIRE(client.read_line(reply));
+		CHECK(reply == "OK 3");
+		client.read(reply, 3);
+		CHECK(reply == "abc");
+
+		// A header without end
+		client.write(std::string(5000, 'x'));
+		CHECK_THROWS(server.read_line(header));
+	}
+
+	// A connection closed in the middle of a request
+	REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	{
+		server_connection server(fds[0]);
+
+		{
+			server_connection client(fds[1]);
+			client.write("length=10\nabc");
+		}
+
+		std::string header, request;
+		REQUIRE(server.read_line(header));
+		CHECK_THROWS(server.read(request, request_length(header, 100)));
+		CHECK_FALSE(server.read_line(header));
+	}
+
+	// When the server stops, waiting for the next request ends
+	int stop[2];
+	REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	REQUIRE(::pipe(stop) == 0);
+	{
+		server_connection server(fds[0], stop[0]);
+		server_connection client(fds[1]);
+
+		REQUIRE(::write(stop[1], "", 1) == 1);
+
+		std::string header;
+		CHECK_FALSE(server.read_line(header));
+	}
+	::close(stop[0]);
+	::close(stop[1]);
+
+	// A request that was started still arrives after the stop, the next
+	// one is not waited for
+	REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	REQUIRE(::pipe(stop) == 0);
+	{
+		server_connection server(fds[0], stop[0], { -1, -1, 1000 });
+		server_connection client(fds[1]);
+
+		client.write("length=6\nabc");
+
+		std::string header, request;
+		REQUIRE(server.read_line(header));
+
+		std::thread t([&]()
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(50));
+				[[maybe_unused]] auto n = ::write(stop[1], "", 1);
+				std::this_thread::sleep_for(std::chrono::milliseconds(50));
+				client.write("def"); });
+
+		server.read(request, request_length(header, 100));
+		t.join();
+
+		CHECK(request == "abcdef");
+		CHECK_FALSE(server.read_line(header));
+	}
+	::close(stop[0]);
+	::close(stop[1]);
+
+	// But one that stays incomplete is given up after the grace period
+	REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	REQUIRE(::pipe(stop) == 0);
+	{
+		server_connection server(fds[0], stop[0], { -1, -1, 100 });
+		server_connection client(fds[1]);
+
+		client.write("length=10\nabc");
+
+		std::string header, request;
+		REQUIRE(server.read_line(header));
+
+		REQUIRE(::write(stop[1], "", 1) == 1);
+		CHECK_THROWS(server.read(request, request_length(header, 100)));
+	}
+	::close(stop[0]);
+	::close(stop[1]);
+
+	// Without a stop the timeouts end idle connections and stalled requests
+	REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	{
+		server_connection server(fds[0], -1, { 100, 100, 100 });
+		server_connection client(fds[1]);
+
+		std::string header, request;
+		CHECK_FALSE(server.read_line(header));
+
+		client.write("length=10\nabc");
+		REQUIRE(server.read_line(header));
+		CHECK_THROWS(server.read(request, request_length(header, 100)));
+
+		// A client that does not read its reply
+		CHECK_THROWS(server.write(std::string(16 << 20, 'x')));
+	}
+}
+
+#endif
+
+// --------------------------------------------------------------------
+
+TEST_CASE("dssp_metrics")
+{
+	cif::file f(gTestDir / "1cbs.cif.gz");
+	REQUIRE(f.is_valid());
+
+	dssp dssp(f.front(), 1, 3, true);
+
+	auto counters = dssp.get_counters();
+	CHECK(counters.residues == dssp.get_statistics().count.residues);
+	CHECK(counters.atoms >= counters.residues * 4);
+	CHECK(counters.candidate_pairs > 0);
+	CHECK(counters.bridges >= counters.ladders);
+	CHECK(counters.ladders > 0);
+	CHECK(counters.neighbours >= counters.residues);
+	CHECK(counters.surface_dots > 0);
+
+	auto timings = dssp.get_timings();
+	CHECK(timings.load > 0);
+	CHECK(timings.accessibility > 0);
+	CHECK(timings.hydrogens > 0);
+
+	// Without accessibility nothing is counted for it
+	::dssp other(f.front(), 1, 3, false);
+	CHECK(other.get_counters().surface_dots == 0);
+	CHECK(other.get_timings().accessibility == 0);
+	CHECK(other.get_counters().candidate_pairs == counters.candidate_pairs);
+}
+
+// --------------------------------------------------------------------
+
+TEST_CASE("dssp_progress")
+{
+	cif::file f(gTestDir / "1cbs.cif.gz");
+	REQUIRE(f.is_valid());
+
+	struct recorder : public dssp::progress
+	{
+		void report(std::string_view phase, uint64_t done, uint64_t total) override
+		{
+			CHECK_FALSE(busy.exchange(true));
+			CHECK(done <= total);
+
+			if (done == total)
+				finished.emplace_back(phase);
+
+			if (phase == cancel_in)
+				cancel();
+
+			busy = false;
+		}
+
+		std::atomic<bool> busy = false;
+		std::vector<std::string> finished;
+		std::string cancel_in;
+	};
+
+	recorder r;
+	dssp a(f.front(), 1, 3, dssp::calculate_flags::all, 4, &r);
+
+	for (auto phase : { "calculate distances", "calculate hbond energies", "calculate beta sheets", "calculate accessibility" })
+		CHECK(std::find(r.finished.begin(), r.finished.end(), phase) != r.finished.end());
+
+	// The same result as without reporting
+	dssp b(f.front(), 1, 3, dssp::calculate_flags::all, 4);
+
+	std::ostringstream sa, sb;
+	a.write_legacy_output(sa);
+	b.write_legacy_output(sb);
+	CHECK(sa.str() == sb.str());
+
+	recorder c;
+	c.cancel_in = "calculate hbond energies";
+	CHECK_THROWS_AS(dssp(f.front(), 1, 3, dssp::calculate_flags::all, 4, &c), dssp::cancelled_error);
+
+	recorder d;
+	d.cancel_in = "calculate hbond energies";
+	CHECK_THROWS_AS(dssp::calculate_all_models(f.front(), 3, dssp::calculate_flags::all, 2, &d), dssp::cancelled_error);
+}
+
+// --------------------------------------------------------------------
+
+TEST_CASE("dssp_concurrent")
+{
+	cif::file f(gTestDir / "1cbs.cif.gz");
+	REQUIRE(f.is_valid());
+
+	std::ostringstream reference;
+	dssp(f.front(), 1, 3, true).write_legacy_output(reference);
+
+	// Each thread uses its own options and log, the results must all be
+	// the same as for the sequential calculation. Catch is not thread safe,
+	// so the results are checked afterwards.
+	const size_t kThreads = 8, kRounds = 4;
+
+	std::vector<std::string> outputs(kThreads * kRounds);
+	std::vector<std::string> logs(kThreads);
+	std::vector<std::thread> threads;
+
+	for (size_t t = 0; t < kThreads; ++t)
+	{
+		threads.emplace_back([&, t]()
+			{
+				std::ostringstream log;
+
+				dssp::options options;
+				options.nr_of_threads = 1 + t % 2;
+				options.verbose = t == 0 ? 1 : 0;
+				options.log = &log;
+
+				for (size_t r = 0; r < kRounds; ++r)
+				{
+					std::ostringstream os;
+					if (r % 2 == 0)
+						dssp(f.front(), 1, options).write_legacy_output(os);
+					else
+						dssp::calculate_all_models(f.front(), options).front().write_legacy_output(os);
+					outputs[t * kRounds + r] = os.str();
+				}
+
+				logs[t] = log.str(); });
+	}
+
+	for (auto &t : threads)
+		t.join();
+
+	for (auto &output : outputs)
+		CHECK(output == reference.str());
+
+	CHECK_FALSE(logs[0].empty());
+	for (size_t t = 1; t < kThreads; ++t)
+		CHECK(logs[t].empty());
+}
+
+// --------------------------------------------------------------------
+
+TEST_CASE("dssp_surface_dots")
+{
+	cif::file f(gTestDir / "1cbs.cif.gz");
+	REQUIRE(f.is_valid());
+
+	dssp reference(f.front(), 1, 3, true);
+
+	dssp::options options;
+
+	options.surface_dots = dssp::kDefaultSurfaceDots;
+	dssp same(f.front(), 1, options);
+	CHECK(same.get_statistics().accessible_surface == reference.get_statistics().accessible_surface);
+
+	// The number of dots is rounded up to an odd number
+	options.surface_dots = dssp::kDefaultSurfaceDots - 1;
+	dssp rounded(f.front(), 1, options);
+	CHECK(rounded.get_statistics().accessible_surface == reference.get_statistics().accessible_surface);
+
+	options.surface_dots = 101;
+	dssp coarse(f.front(), 1, options);
+
+	// Each atom is tested with a quarter of the dots, the result is close
+	CHECK(coarse.get_counters().surface_dots * 401 == reference.get_counters().surface_dots * 101);
+
+	auto total = reference.get_statistics().accessible_surface;
+	CHECK(std::abs(coarse.get_statistics().accessible_surface - total) < 0.02 * total);
+
+	// The secondary structure does not depend on it
+	std::ostringstream a, b;
+	coarse.write_secondary_structure(a, dssp::ss_string_format::fasta);
+	reference.write_secondary_structure(b, dssp::ss_string_format::fasta);
+	CHECK(a.str() == b.str());
+}
+
+// --------------------------------------------------------------------
+
+TEST_CASE("dssp_bulk_access")
+{
+	cif::file f(gTestDir / "1cbs.cif.gz");
+	REQUIRE(f.is_valid());
+
+	dssp structure(f.front(), 1, 3, true);
+
+	const size_t n = structure.size();
+	REQUIRE(n == static_cast<size_t>(std::distance(structure.begin(), structure.end())));
+
+	std::vector<dssp::structure_type> types(n);
+	structure.get_types(types.data());
+
+	std::vector<float> accessibilities(n);
+	structure.get_accessibilities(accessibilities.data());
+
+	std::vector<float> phi(n), omega(n);
+	structure.get_angles(dssp::angle_type::phi, phi.data());
+	structure.get_angles(dssp::angle_type::omega, omega.data());
+
+	std::vector<int32_t> acceptors(n), donors(n);
+	std::vector<double> acceptorEnergies(n), donorEnergies(n);
+	structure.get_acceptors(0, acceptors.data(), acceptorEnergies.data());
+	structure.get_donors(1, donors.data(), nullptr);
+	structure.get_donors(1, nullptr, donorEnergies.data());
+
+	CHECK_THROWS_AS(structure.get_acceptors(2, acceptors.data(), nullptr), std::out_of_range);
+
+	// The index of a residue is its position in the order of iteration
+	std::vector<int> nrs;
+	for (auto r : structure)
+		nrs.push_back(r.nr());
+
+	auto index_of = [&nrs](const dssp::residue_info &r)
+	{
+		return r ? static_cast<int32_t>(std::find(nrs.begin(), nrs.end(), r.nr()) - nrs.begin()) : -1;
+	};
+
+	size_t i = 0;
+	for (auto r : structure)
+	{
+		CHECK(types[i] == r.type());
+		CHECK(accessibilities[i] == static_cast<float>(r.accessibility()));
+
+		if (r.phi())
+			CHECK(phi[i] == *r.phi());
+		else
+			CHECK(std::isnan(phi[i]));
+
+		if (r.omega())
+			CHECK(omega[i] == *r.omega());
+		else
+			CHECK(std::isnan(omega[i]));
+
+		auto [acceptor, acceptorEnergy] = r.acceptor(0);
+		CHECK(acceptors[i] == index_of(acceptor));
+		CHECK(acceptorEnergies[i] == acceptorEnergy);
+
+		auto [donor, donorEnergy] = r.donor(1);
+		CHECK(donors[i] == index_of(donor));
+		CHECK(donorEnergies[i] == donorEnergy);
+
+		++i;
+	}
+}
+
+// --------------------------------------------------------------------
+
+TEST_CASE("dssp_annotate_threads")
+{
+	cif::file a(gTestDir / "1cbs.cif.gz"), b(gTestDir / "1cbs.cif.gz");
+	REQUIRE(a.is_valid());
+	REQUIRE(b.is_valid());
+
+	dssp structure(a.front(), 1, 3, true);
+
+	// The rows are built in parallel, the output must not depend on it
+	structure.annotate(a.front(), true, true, 1);
+	structure.annotate(b.front(), true, true, 4);
+
+	std::ostringstream sa, sb;
+	sa << a.front();
+	sb << b.front();
+
+	CHECK(sa.str() == sb.str());
+	CHECK(a.front()["dssp_struct_summary"].size() == structure.size());
+	CHECK(a.front()["dssp_struct_bridge_pairs"].size() == structure.size());
+}
+
+// --------------------------------------------------------------------
+
+TEST_CASE("dssp_chain_segments")
+{
+	cif::file f(gTestDir / "1cbs.cif.gz");
+	REQUIRE(f.is_valid());
+
+	// Eight copies of 1cbs, moved apart, each a chain of its own. In the
+	// second copy residue 50 is left out, splitting it in two segments.
+	cif::datablock db(f.front().name());
+
+	auto atoms = f.front()["atom_site"].rows<std::string, std::string, std::string, std::string, std::string, int, float, float, float, int, std::string>(
+		"group_PDB", "type_symbol", "label_atom_id", "label_comp_id", "label_asym_id", "label_seq_id",
+		"Cartn_x", "Cartn_y", "Cartn_z", "auth_seq_id", "auth_asym_id");
+	auto residues = f.front()["pdbx_poly_seq_scheme"].rows<std::string, std::string, int, std::string, int, std::string>(
+		"asym_id", "entity_id", "seq_id", "mon_id", "pdb_seq_num", "pdb_strand_id");
+
+	const int kCopies = 8;
+
+	auto &atom_site = db["atom_site"];
+	auto &pdbx_poly_seq_scheme = db["pdbx_poly_seq_scheme"];
+	int id = 0;
+
+	for (int copy = 0; copy < kCopies; ++copy)
+	{
+		auto suffix = std::to_string(copy);
+
+		for (const auto &[group, type, atom_id, comp_id, asym_id, seq_id, x, y, z, auth_seq_id, auth_asym_id] : atoms)
+		{
+			if (copy == 1 and seq_id == 50)
+				continue;
+
+			atom_site.emplace({
+				{ "group_PDB", group },
+				{ "id", ++id },
+				{ "type_symbol", type },
+				{ "label_atom_id", atom_id },
+				{ "label_comp_id", comp_id },
+				{ "label_asym_id", asym_id + suffix },
+				{ "label_seq_id", seq_id },
+				{ "Cartn_x", x + 100 * copy, 3 },
+				{ "Cartn_y", y, 3 },
+				{ "Cartn_z", z, 3 },
+				{ "auth_seq_id", auth_seq_id },
+				{ "auth_asym_id", auth_asym_id + suffix },
+				{ "pdbx_PDB_model_num", 1 } });
+		}
+
+		for (const auto &[asym_id, entity_id, seq_id, mon_id, pdb_seq_num, pdb_strand_id] : residues)
+		{
+			pdbx_poly_seq_scheme.emplace({
+				{ "asym_id", asym_id + suffix },
+				{ "entity_id", entity_id },
+				{ "seq_id", seq_id },
+				{ "mon_id", mon_id },
+				{ "pdb_seq_num", pdb_seq_num },
+				{ "pdb_strand_id", pdb_strand_id + suffix },
+				{ "pdb_ins_code", "" } });
+		}
+	}
+
+	// The geometry and helices are done per chain segment in parallel, the
+	// result must be the same as doing it in one go
+	dssp::options options;
+	options.flags = dssp::calculate_flags::angles | dssp::calculate_flags::bridge_partners | dssp::calculate_flags::statistics;
+
+	options.nr_of_threads = 1;
+	dssp a(db, 1, options);
+
+	options.nr_of_threads = 4;
+	dssp b(db, 1, options);
+
+	REQUIRE(a.size() == b.size());
+	CHECK(a.get_statistics().count.chains == kCopies + 1);
+
+	for (auto ra = a.begin(), rb = b.begin(); ra != a.end(); ++ra, ++rb)
+	{
+		CHECK(ra->type() == rb->type());
+		CHECK(ra->chain_break() == rb->chain_break());
+		for (auto helix : { dssp::helix_type::_3_10, dssp::helix_type::alpha, dssp::helix_type::pi, dssp::helix_type::pp })
+			CHECK(ra->helix(helix) == rb->helix(helix));
+		CHECK(ra->kappa() == rb->kappa());
+		CHECK(ra->phi() == rb->phi());
+		CHECK(ra->psi() == rb->psi());
+		CHECK(ra->alpha() == rb->alpha());
+	}
+
+	auto sa = a.get_statistics(), sb = b.get_statistics();
+	CHECK(std::equal(std::begin(sa.histogram.residues_per_alpha_helix), std::end(sa.histogram.residues_per_alpha_helix),
+		std::begin(sb.histogram.residues_per_alpha_helix)));
+	CHECK(sa.count.H_bonds == sb.count.H_bonds);
+
+	// And each copy is the same as the original
+	dssp single(f.front(), 1, 3, false);
+	std::ostringstream os;
+	single.write_secondary_structure(os, dssp::ss_string_format::tsv, "x");
+
+	std::string ss;
+	for (auto r : b)
+	{
+		if (r.asym_id() == "A" + std::to_string(kCopies - 1))
+			ss += static_cast<char>(r.type());
+	}
+	CHECK(os.str() == "x\t1\tA\t" + ss + "\n");
+}